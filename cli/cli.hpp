@@ -43,8 +43,10 @@ struct Command {
 extern const Command diff_command;
 extern const Command diff_state_command;
 extern const Command diff_images_command;
+extern const Command diff_tiles_command;
 extern const Command dump_command;
 extern const Command dump_images_command;
+extern const Command export_command;
 extern const Command pickle_command;
 extern const Command repack_command;
 extern const Command retrace_command;
@@ -26,9 +26,11 @@
  *********************************************************************/
 
 #include <string.h>
+#include <limits.h> // for CHAR_MAX
 #include <getopt.h>
 
 #include <iostream>
+#include <vector>
 
 #include "cli.hpp"
 #include "os_string.hpp"
@@ -41,30 +43,52 @@ static void
 usage(void)
 {
     std::cout
-        << "usage: apitrace diff-state <state-1> <state-2>\n"
+        << "usage: apitrace diff-state [OPTIONS] <state-1> <state-2>\n"
         << synopsis << "\n"
         "\n"
-        "    Both input files should be the result of running 'glretrace -D XYZ <trace>'.\n";
+        "    Both input files should be the result of running 'glretrace -D XYZ <trace>',\n"
+        "    or 'glretrace --dump-states=CALLSET <trace>', in which case the last dump\n"
+        "    is compared unless told otherwise.\n"
+        "\n"
+        "    -h, --help           Show this help message and exit\n"
+        "    --ref-call=CALL      Compare the dump of CALL from the first file\n"
+        "    --src-call=CALL      Compare the dump of CALL from the second file\n";
 }
 
+enum {
+    REF_CALL_OPT = CHAR_MAX + 1,
+    SRC_CALL_OPT,
+};
+
 const static char *
 shortOptions = "h";
 
 const static struct option
 longOptions[] = {
     {"help", no_argument, 0, 'h'},
+    {"ref-call", required_argument, 0, REF_CALL_OPT},
+    {"src-call", required_argument, 0, SRC_CALL_OPT},
     {0, 0, 0, 0}
 };
 
 static int
 command(int argc, char *argv[])
 {
+    std::vector<const char *> opts;
     int opt;
     while ((opt = getopt_long(argc, argv, shortOptions, longOptions, NULL)) != -1) {
         switch (opt) {
         case 'h':
             usage();
             return 0;
+        case REF_CALL_OPT:
+            opts.push_back("--ref-call");
+            opts.push_back(optarg);
+            break;
+        case SRC_CALL_OPT:
+            opts.push_back("--src-call");
+            opts.push_back(optarg);
+            break;
         default:
             std::cerr << "error: unexpected option `" << (char)opt << "`\n";
             usage();
@@ -85,15 +109,15 @@ command(int argc, char *argv[])
 
     os::String command = findScript("jsondiff.py");
 
-    char *args[5];
-
-    args[0] = const_cast<char *>("python");
-    args[1] = const_cast<char *>(command.str());
-    args[2] = file1;
-    args[3] = file2;
-    args[4] = NULL;
+    std::vector<const char *> args;
+    args.push_back("python");
+    args.push_back(command.str());
+    args.insert(args.end(), opts.begin(), opts.end());
+    args.push_back(file1);
+    args.push_back(file2);
+    args.push_back(NULL);
 
-    return os::execute(args);
+    return os::execute((char * const *)&args[0]);
 }
 
 const Command diff_state_command = {
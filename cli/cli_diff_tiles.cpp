@@ -0,0 +1,328 @@
+/**************************************************************************
+ *
+ * Copyright 2014 VMware, Inc.
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ **************************************************************************/
+
+
+/*
+ * Compare the tile hashes of the snapshots of two runs, as written by
+ * `glretrace --snapshot-format=TILES -s -`, and report the regions that
+ * changed.
+ */
+
+
+#include <string.h>
+#include <getopt.h>
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "cli.hpp"
+
+
+static const char *synopsis = "Identify differences between the tile hashes of two snapshot runs.";
+
+static void
+usage(void)
+{
+    std::cout
+        << "usage: apitrace diff-tiles [OPTIONS] REF_HASHES SRC_HASHES\n"
+        << synopsis << "\n"
+        << "\n"
+        << "Each file is the output of `glretrace --snapshot-format=TILES -s - TRACE`.\n"
+        << "Exits with a non-zero status when any snapshot differs.\n"
+        << "\n"
+        << "    -h, --help           Show this help message and exit\n"
+        << "    -v, --verbose        List every tile which differs\n"
+        << "\n";
+}
+
+const static char *
+shortOptions = "hv";
+
+const static struct option
+longOptions[] = {
+    {"help", no_argument, 0, 'h'},
+    {"verbose", no_argument, 0, 'v'},
+    {0, 0, 0, 0}
+};
+
+
+struct TileHashes
+{
+    unsigned width;
+    unsigned height;
+    unsigned tileSize;
+    std::string imageHash;
+    std::vector<std::string> tileHashes;
+
+    unsigned
+    columns(void) const {
+        return (width + tileSize - 1) / tileSize;
+    }
+
+    unsigned
+    rows(void) const {
+        return (height + tileSize - 1) / tileSize;
+    }
+};
+
+typedef std::map<std::string, TileHashes> TileHashesMap;
+
+
+static bool
+readTileHashes(const char *filename,
+               TileHashesMap &snapshots,
+               std::vector<std::string> &order)
+{
+    std::ifstream stream(filename);
+    if (!stream.is_open()) {
+        std::cerr << "error: failed to open " << filename << "\n";
+        return false;
+    }
+
+    std::string line;
+    unsigned lineNo = 0;
+    while (std::getline(stream, line)) {
+        ++lineNo;
+        if (line.empty()) {
+            continue;
+        }
+
+        std::istringstream is(line);
+        std::string name;
+        TileHashes hashes;
+        if (!(is >> name >> hashes.width >> hashes.height >> hashes.tileSize >> hashes.imageHash) ||
+            hashes.tileSize == 0) {
+            std::cerr << "error: " << filename << ":" << lineNo << ": malformed tile hashes\n";
+            return false;
+        }
+
+        std::string hash;
+        while (is >> hash) {
+            hashes.tileHashes.push_back(hash);
+        }
+        if (hashes.tileHashes.size() != hashes.columns() * hashes.rows()) {
+            std::cerr << "error: " << filename << ":" << lineNo << ": expected "
+                      << hashes.columns() * hashes.rows() << " tile hashes\n";
+            return false;
+        }
+
+        if (snapshots.find(name) == snapshots.end()) {
+            order.push_back(name);
+        }
+        snapshots[name] = hashes;
+    }
+
+    return true;
+}
+
+
+struct Region
+{
+    unsigned x0, y0, x1, y1;
+    unsigned tiles;
+};
+
+
+/**
+ * Group the differing tiles into regions of adjacent tiles.
+ */
+static void
+findRegions(const TileHashes &ref, const std::vector<bool> &differs,
+            std::vector<Region> &regions)
+{
+    unsigned columns = ref.columns();
+    unsigned rows = ref.rows();
+    std::vector<bool> visited(differs.size(), false);
+    std::vector<unsigned> stack;
+
+    for (unsigned i = 0; i < differs.size(); ++i) {
+        if (!differs[i] || visited[i]) {
+            continue;
+        }
+
+        Region region;
+        region.x0 = region.x1 = i % columns;
+        region.y0 = region.y1 = i / columns;
+        region.tiles = 0;
+
+        visited[i] = true;
+        stack.push_back(i);
+        while (!stack.empty()) {
+            unsigned tile = stack.back();
+            stack.pop_back();
+
+            unsigned x = tile % columns;
+            unsigned y = tile / columns;
+            region.x0 = std::min(region.x0, x);
+            region.x1 = std::max(region.x1, x);
+            region.y0 = std::min(region.y0, y);
+            region.y1 = std::max(region.y1, y);
+            ++region.tiles;
+
+            unsigned neighbours[4];
+            unsigned count = 0;
+            if (x > 0)           neighbours[count++] = tile - 1;
+            if (x + 1 < columns) neighbours[count++] = tile + 1;
+            if (y > 0)           neighbours[count++] = tile - columns;
+            if (y + 1 < rows)    neighbours[count++] = tile + columns;
+            for (unsigned j = 0; j < count; ++j) {
+                unsigned neighbour = neighbours[j];
+                if (differs[neighbour] && !visited[neighbour]) {
+                    visited[neighbour] = true;
+                    stack.push_back(neighbour);
+                }
+            }
+        }
+
+        // Convert to pixels
+        region.x0 *= ref.tileSize;
+        region.y0 *= ref.tileSize;
+        region.x1 = std::min((region.x1 + 1) * ref.tileSize, ref.width);
+        region.y1 = std::min((region.y1 + 1) * ref.tileSize, ref.height);
+        regions.push_back(region);
+    }
+}
+
+
+static bool
+compareSnapshot(const std::string &name, const TileHashes &ref, const TileHashes &src, bool verbose)
+{
+    if (ref.width != src.width || ref.height != src.height || ref.tileSize != src.tileSize) {
+        std::cout << name << ": size differs ("
+                  << ref.width << "x" << ref.height << " vs "
+                  << src.width << "x" << src.height << ")\n";
+        return false;
+    }
+
+    if (ref.imageHash == src.imageHash) {
+        return true;
+    }
+
+    std::vector<bool> differs(ref.tileHashes.size());
+    unsigned count = 0;
+    for (unsigned i = 0; i < differs.size(); ++i) {
+        differs[i] = ref.tileHashes[i] != src.tileHashes[i];
+        count += differs[i];
+    }
+
+    std::vector<Region> regions;
+    findRegions(ref, differs, regions);
+
+    std::cout << name << ": " << count << " of " << differs.size() << " tiles differ\n";
+    for (unsigned i = 0; i < regions.size(); ++i) {
+        const Region &region = regions[i];
+        std::cout << "  " << region.x0 << "," << region.y0
+                  << " " << (region.x1 - region.x0) << "x" << (region.y1 - region.y0)
+                  << " (" << region.tiles << " tiles)\n";
+    }
+
+    if (verbose) {
+        unsigned columns = ref.columns();
+        for (unsigned i = 0; i < differs.size(); ++i) {
+            if (differs[i]) {
+                std::cout << "    tile " << (i % columns) * ref.tileSize
+                          << "," << (i / columns) * ref.tileSize << "\n";
+            }
+        }
+    }
+
+    return false;
+}
+
+
+static int
+command(int argc, char *argv[])
+{
+    bool verbose = false;
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, shortOptions, longOptions, NULL)) != -1) {
+        switch (opt) {
+        case 'h':
+            usage();
+            return 0;
+        case 'v':
+            verbose = true;
+            break;
+        default:
+            std::cerr << "error: unexpected option `" << (char)opt << "`\n";
+            usage();
+            return 1;
+        }
+    }
+
+    if (argc != optind + 2) {
+        std::cerr << "error: apitrace diff-tiles requires two tile hash files as arguments.\n";
+        usage();
+        return 1;
+    }
+
+    TileHashesMap refSnapshots;
+    TileHashesMap srcSnapshots;
+    std::vector<std::string> refOrder;
+    std::vector<std::string> srcOrder;
+    if (!readTileHashes(argv[optind], refSnapshots, refOrder) ||
+        !readTileHashes(argv[optind + 1], srcSnapshots, srcOrder)) {
+        return 1;
+    }
+
+    unsigned total = 0;
+    unsigned different = 0;
+
+    std::vector<std::string>::const_iterator it;
+    for (it = refOrder.begin(); it != refOrder.end(); ++it) {
+        ++total;
+        TileHashesMap::const_iterator src = srcSnapshots.find(*it);
+        if (src == srcSnapshots.end()) {
+            std::cout << *it << ": missing from " << argv[optind + 1] << "\n";
+            ++different;
+        } else if (!compareSnapshot(*it, refSnapshots[*it], src->second, verbose)) {
+            ++different;
+        }
+    }
+    for (it = srcOrder.begin(); it != srcOrder.end(); ++it) {
+        if (refSnapshots.find(*it) == refSnapshots.end()) {
+            std::cout << *it << ": missing from " << argv[optind] << "\n";
+            ++total;
+            ++different;
+        }
+    }
+
+    std::cout << different << " of " << total << " snapshots differ\n";
+
+    return different ? 1 : 0;
+}
+
+const Command diff_tiles_command = {
+    "diff-tiles",
+    synopsis,
+    usage,
+    command
+};
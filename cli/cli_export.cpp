@@ -0,0 +1,650 @@
+/**************************************************************************
+ *
+ * Copyright 2014 VMware, Inc.
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ **************************************************************************/
+
+
+/*
+ * Export of the call table in a columnar file, for offline analytics.
+ *
+ * The file starts with the magic "APICOLS\0", followed by row groups of up
+ * to ROW_GROUP_SIZE calls.  Each row group holds one chunk per column, in
+ * schema order, each made of a 32 bits little endian length followed by that
+ * many bytes of snappy compressed data.  Uncompressed, a chunk is just an
+ * array of little endian values, one per row:
+ *
+ *     column       type  contents
+ *     no           u32   call number
+ *     thread       u32   thread id
+ *     function     u32   index in the function dictionary
+ *     frame        u32   frame number (a frame includes its end-of-frame call)
+ *     flags        u32   trace::CALL_FLAG_* bits
+ *     ARG          i64   value of the argument named ARG, for each --args name
+ *     ARG.valid    u8    1 if the call has an integer-like ARG argument, else 0
+ *     ARG.string   u32   1 + index in the string dictionary if the call has a
+ *                        string ARG argument, else 0
+ *
+ * The footer, written after the last row group, is made of varints (7 bits
+ * per byte, least significant first) and strings (varint length followed by
+ * the bytes):
+ *
+ *     version
+ *     number of columns, then for each: name, type ("u8", "u32", or "i64")
+ *     number of functions, then for each: name
+ *     number of strings, then for each: the string
+ *     number of row groups, then for each: file offset, number of rows
+ *
+ * The file ends with the footer length as 32 bits little endian, and the
+ * magic again, so that readers can find the footer by seeking from the end.
+ */
+
+
+#include <stdint.h>
+#include <string.h>
+#include <limits.h> // for CHAR_MAX
+#include <getopt.h>
+
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <snappy.h>
+
+#include "cli.hpp"
+
+#include "os_string.hpp"
+
+#include "trace_callset.hpp"
+#include "trace_model.hpp"
+#include "trace_parser.hpp"
+
+
+#define COLUMNAR_MAGIC "APICOLS"
+#define COLUMNAR_VERSION 2
+
+#define ROW_GROUP_SIZE (64 * 1024)
+
+
+static const char *synopsis = "Export the call table of a trace for analysis.";
+
+static void
+usage(void)
+{
+    std::cout
+        << "usage: apitrace export --columnar [OPTIONS] TRACE_FILE\n"
+        << synopsis << "\n"
+        "\n"
+        "    -h, --help           show this help message and exit\n"
+        "        --columnar       write a columnar file (required, as the only format for now)\n"
+        "        --calls=CALLSET  only export specified calls\n"
+        "        --args=NAME[,NAME...]\n"
+        "                         also export the arguments with these names\n"
+        "    -o, --output=FILE    output file [default: TRACE_FILE with .cols extension]\n"
+        "\n"
+        "Each call gets its number, thread, function, frame and flags.  Arguments\n"
+        "selected with --args are exported when they are integer-like, i.e., booleans,\n"
+        "integers, enums, bitmasks or pointers, or strings.\n"
+    ;
+}
+
+enum {
+    COLUMNAR_OPT = CHAR_MAX + 1,
+    CALLS_OPT,
+    ARGS_OPT,
+};
+
+const static char *
+shortOptions = "ho:";
+
+const static struct option
+longOptions[] = {
+    {"help", no_argument, 0, 'h'},
+    {"columnar", no_argument, 0, COLUMNAR_OPT},
+    {"calls", required_argument, 0, CALLS_OPT},
+    {"args", required_argument, 0, ARGS_OPT},
+    {"output", required_argument, 0, 'o'},
+    {0, 0, 0, 0}
+};
+
+
+static inline void
+putUInt8(std::string &buf, unsigned char value)
+{
+    buf.push_back((char)value);
+}
+
+static inline void
+putUInt32(std::string &buf, uint32_t value)
+{
+    char bytes[4];
+    bytes[0] = value & 0xff;
+    bytes[1] = (value >>  8) & 0xff;
+    bytes[2] = (value >> 16) & 0xff;
+    bytes[3] = (value >> 24) & 0xff;
+    buf.append(bytes, sizeof bytes);
+}
+
+static inline void
+putInt64(std::string &buf, int64_t value)
+{
+    uint64_t bits = value;
+    char bytes[8];
+    for (unsigned i = 0; i < 8; ++i) {
+        bytes[i] = bits & 0xff;
+        bits >>= 8;
+    }
+    buf.append(bytes, sizeof bytes);
+}
+
+static void
+putVarint(std::string &buf, unsigned long long value)
+{
+    while (value >= 0x80) {
+        buf.push_back((char)(0x80 | (value & 0x7f)));
+        value >>= 7;
+    }
+    buf.push_back((char)value);
+}
+
+static void
+putString(std::string &buf, const std::string &s)
+{
+    putVarint(buf, s.size());
+    buf.append(s);
+}
+
+
+/**
+ * Accumulates rows in per-column buffers, and writes them out compressed,
+ * one row group at a time.
+ */
+class ColumnarWriter
+{
+protected:
+    struct Column
+    {
+        std::string name;
+        const char *type;
+        std::string data;
+
+        Column(const std::string &_name, const char *_type) :
+            name(_name),
+            type(_type)
+        {}
+    };
+
+    struct RowGroup
+    {
+        unsigned long long offset;
+        unsigned rows;
+    };
+
+    enum {
+        COLUMN_NO = 0,
+        COLUMN_THREAD,
+        COLUMN_FUNCTION,
+        COLUMN_FRAME,
+        COLUMN_FLAGS,
+        NUM_CALL_COLUMNS
+    };
+
+    std::ofstream stream;
+    unsigned long long offset;
+
+    std::vector<Column> columns;
+    std::vector<RowGroup> rowGroups;
+    unsigned rows;
+
+    std::vector<std::string> argNames;
+
+    /*
+     * Function dictionary: names in order of first appearance, and the
+     * dictionary index of each signature id (~0 if not seen yet).
+     */
+    std::vector<std::string> functionNames;
+    std::vector<unsigned> functionIndices;
+
+    /*
+     * String dictionary: strings in order of first appearance, and their
+     * dictionary indices.
+     */
+    std::vector<std::string> strings;
+    std::map<std::string, unsigned> stringIndices;
+
+    /*
+     * Index of each selected argument in each function signature (-1 if the
+     * function has no such argument), cached per signature id.
+     */
+    std::vector< std::vector<int> > argIndices;
+
+    std::string compressed;
+
+    void
+    write(const std::string &buf);
+
+    void
+    flushRowGroup(void);
+
+    unsigned
+    lookupFunction(const trace::FunctionSig *sig);
+
+    unsigned
+    lookupString(const char *s);
+
+    const std::vector<int> &
+    lookupArgs(const trace::FunctionSig *sig);
+
+public:
+    ColumnarWriter(const std::vector<std::string> &_argNames);
+
+    bool
+    open(const char *filename);
+
+    void
+    addCall(const trace::Call *call, unsigned frame);
+
+    bool
+    close(void);
+
+    /**
+     * Whether any of the selected arguments belongs to this function.
+     */
+    bool
+    hasArgs(const trace::FunctionSig *sig) {
+        const std::vector<int> &indices = lookupArgs(sig);
+        for (unsigned i = 0; i < indices.size(); ++i) {
+            if (indices[i] >= 0) {
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+
+ColumnarWriter::ColumnarWriter(const std::vector<std::string> &_argNames) :
+    offset(0),
+    rows(0),
+    argNames(_argNames)
+{
+    columns.push_back(Column("no", "u32"));
+    columns.push_back(Column("thread", "u32"));
+    columns.push_back(Column("function", "u32"));
+    columns.push_back(Column("frame", "u32"));
+    columns.push_back(Column("flags", "u32"));
+    for (unsigned i = 0; i < argNames.size(); ++i) {
+        columns.push_back(Column(argNames[i], "i64"));
+        columns.push_back(Column(argNames[i] + ".valid", "u8"));
+        columns.push_back(Column(argNames[i] + ".string", "u32"));
+    }
+}
+
+
+bool
+ColumnarWriter::open(const char *filename)
+{
+    stream.open(filename, std::ofstream::binary | std::ofstream::trunc);
+    if (!stream.is_open()) {
+        return false;
+    }
+    write(std::string(COLUMNAR_MAGIC, sizeof COLUMNAR_MAGIC));
+    return true;
+}
+
+
+void
+ColumnarWriter::write(const std::string &buf)
+{
+    stream.write(buf.data(), buf.size());
+    offset += buf.size();
+}
+
+
+unsigned
+ColumnarWriter::lookupFunction(const trace::FunctionSig *sig)
+{
+    if (sig->id >= functionIndices.size()) {
+        functionIndices.resize(sig->id + 1, ~0U);
+    }
+    unsigned &index = functionIndices[sig->id];
+    if (index == ~0U) {
+        index = functionNames.size();
+        functionNames.push_back(sig->name ? sig->name : "");
+    }
+    return index;
+}
+
+
+unsigned
+ColumnarWriter::lookupString(const char *s)
+{
+    std::pair<std::map<std::string, unsigned>::iterator, bool> result =
+        stringIndices.insert(std::make_pair(std::string(s), (unsigned)strings.size()));
+    if (result.second) {
+        strings.push_back(result.first->first);
+    }
+    return result.first->second;
+}
+
+
+const std::vector<int> &
+ColumnarWriter::lookupArgs(const trace::FunctionSig *sig)
+{
+    if (sig->id >= argIndices.size()) {
+        argIndices.resize(sig->id + 1);
+    }
+    std::vector<int> &indices = argIndices[sig->id];
+    if (indices.size() != argNames.size()) {
+        indices.assign(argNames.size(), -1);
+        for (unsigned i = 0; i < argNames.size(); ++i) {
+            for (unsigned j = 0; j < sig->num_args; ++j) {
+                if (argNames[i] == sig->arg_names[j]) {
+                    indices[i] = j;
+                    break;
+                }
+            }
+        }
+    }
+    return indices;
+}
+
+
+/**
+ * Get the value of integer-like scalars.
+ */
+static bool
+getInteger(const trace::Value *value, long long &result)
+{
+    if (!value) {
+        return false;
+    }
+
+    switch (value->kind) {
+    case trace::Value::KIND_SINT:
+        result = value->toSInt();
+        return true;
+    case trace::Value::KIND_UINT:
+        result = (long long)value->toUInt();
+        return true;
+    case trace::Value::KIND_OTHER:
+        break;
+    default:
+        return false;
+    }
+
+    if (dynamic_cast<const trace::Bool *>(value)) {
+        result = value->toBool();
+        return true;
+    }
+
+    const trace::Repr *repr = dynamic_cast<const trace::Repr *>(value);
+    if (repr) {
+        return getInteger(repr->machineValue, result);
+    }
+
+    return false;
+}
+
+
+void
+ColumnarWriter::addCall(const trace::Call *call, unsigned frame)
+{
+    putUInt32(columns[COLUMN_NO].data, call->no);
+    putUInt32(columns[COLUMN_THREAD].data, call->thread_id);
+    putUInt32(columns[COLUMN_FUNCTION].data, lookupFunction(call->sig));
+    putUInt32(columns[COLUMN_FRAME].data, frame);
+    putUInt32(columns[COLUMN_FLAGS].data, call->flags);
+
+    if (!argNames.empty()) {
+        const std::vector<int> &indices = lookupArgs(call->sig);
+        for (unsigned i = 0; i < indices.size(); ++i) {
+            const trace::Value *arg = NULL;
+            if (indices[i] >= 0 && (unsigned)indices[i] < call->args.size()) {
+                arg = call->args[indices[i]].value;
+            }
+
+            long long value = 0;
+            bool valid = getInteger(arg, value);
+
+            unsigned string = 0;
+            if (dynamic_cast<const trace::String *>(arg) && arg->toString()) {
+                string = lookupString(arg->toString()) + 1;
+            }
+
+            putInt64(columns[NUM_CALL_COLUMNS + 3*i].data, value);
+            putUInt8(columns[NUM_CALL_COLUMNS + 3*i + 1].data, valid);
+            putUInt32(columns[NUM_CALL_COLUMNS + 3*i + 2].data, string);
+        }
+    }
+
+    if (++rows >= ROW_GROUP_SIZE) {
+        flushRowGroup();
+    }
+}
+
+
+void
+ColumnarWriter::flushRowGroup(void)
+{
+    if (!rows) {
+        return;
+    }
+
+    RowGroup rowGroup;
+    rowGroup.offset = offset;
+    rowGroup.rows = rows;
+    rowGroups.push_back(rowGroup);
+
+    for (unsigned i = 0; i < columns.size(); ++i) {
+        std::string &data = columns[i].data;
+        size_t length = 0;
+        compressed.resize(snappy::MaxCompressedLength(data.size()));
+        snappy::RawCompress(data.data(), data.size(), &compressed[0], &length);
+        compressed.resize(length);
+
+        std::string header;
+        putUInt32(header, length);
+        write(header);
+        write(compressed);
+
+        data.clear();
+    }
+
+    rows = 0;
+}
+
+
+bool
+ColumnarWriter::close(void)
+{
+    flushRowGroup();
+
+    std::string footer;
+    putVarint(footer, COLUMNAR_VERSION);
+    putVarint(footer, columns.size());
+    for (unsigned i = 0; i < columns.size(); ++i) {
+        putString(footer, columns[i].name);
+        putString(footer, columns[i].type);
+    }
+    putVarint(footer, functionNames.size());
+    for (unsigned i = 0; i < functionNames.size(); ++i) {
+        putString(footer, functionNames[i]);
+    }
+    putVarint(footer, strings.size());
+    for (unsigned i = 0; i < strings.size(); ++i) {
+        putString(footer, strings[i]);
+    }
+    putVarint(footer, rowGroups.size());
+    for (unsigned i = 0; i < rowGroups.size(); ++i) {
+        putVarint(footer, rowGroups[i].offset);
+        putVarint(footer, rowGroups[i].rows);
+    }
+    putUInt32(footer, footer.size());
+    footer.append(COLUMNAR_MAGIC, sizeof COLUMNAR_MAGIC);
+    write(footer);
+
+    stream.close();
+    return !stream.fail();
+}
+
+
+/**
+ * Only decode the calls that carry any of the exported arguments.
+ */
+class ExportFilter : public trace::CallFilter
+{
+protected:
+    ColumnarWriter &writer;
+
+public:
+    ExportFilter(ColumnarWriter &_writer) :
+        writer(_writer)
+    {}
+
+    bool
+    contains(const trace::Call &call) const {
+        return writer.hasArgs(call.sig);
+    }
+};
+
+
+static void
+splitNames(const char *names, std::vector<std::string> &result)
+{
+    std::string list(names);
+    size_t start = 0;
+    while (start <= list.size()) {
+        size_t end = list.find(',', start);
+        if (end == std::string::npos) {
+            end = list.size();
+        }
+        if (end > start) {
+            result.push_back(list.substr(start, end - start));
+        }
+        start = end + 1;
+    }
+}
+
+
+static int
+command(int argc, char *argv[])
+{
+    trace::CallSet calls(trace::FREQUENCY_ALL);
+    std::vector<std::string> argNames;
+    std::string output;
+    bool columnar = false;
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, shortOptions, longOptions, NULL)) != -1) {
+        switch (opt) {
+        case 'h':
+            usage();
+            return 0;
+        case COLUMNAR_OPT:
+            columnar = true;
+            break;
+        case CALLS_OPT:
+            calls.merge(optarg);
+            break;
+        case ARGS_OPT:
+            splitNames(optarg, argNames);
+            break;
+        case 'o':
+            output = optarg;
+            break;
+        default:
+            std::cerr << "error: unexpected option `" << (char)opt << "`\n";
+            usage();
+            return 1;
+        }
+    }
+
+    if (!columnar) {
+        std::cerr << "error: no export format given (only --columnar is supported)\n";
+        usage();
+        return 1;
+    }
+
+    if (argc != optind + 1) {
+        std::cerr << "error: expected exactly one trace file\n";
+        usage();
+        return 1;
+    }
+
+    const char *filename = argv[optind];
+
+    trace::Parser parser;
+    if (!parser.open(filename)) {
+        std::cerr << "error: failed to open " << filename << "\n";
+        return 1;
+    }
+
+    if (output.empty()) {
+        os::String base(filename);
+        base.trimExtension();
+
+        output = std::string(base.str()) + std::string(".cols");
+    }
+
+    ColumnarWriter writer(argNames);
+    if (!writer.open(output.c_str())) {
+        std::cerr << "error: failed to create " << output << "\n";
+        return 1;
+    }
+
+    // Argument values are only needed for the calls that have them
+    ExportFilter filter(writer);
+    parser.setCallFilter(&filter);
+
+    unsigned frame = 0;
+    trace::Call *call;
+    while ((call = parser.parse_call())) {
+        if (call->no > calls.getLast()) {
+            delete call;
+            break;
+        }
+        if (calls.contains(*call)) {
+            writer.addCall(call, frame);
+        }
+        if (call->flags & trace::CALL_FLAG_END_FRAME) {
+            ++frame;
+        }
+        delete call;
+    }
+
+    if (!writer.close()) {
+        std::cerr << "error: failed to write " << output << "\n";
+        return 1;
+    }
+
+    return 0;
+}
+
+const Command export_command = {
+    "export",
+    synopsis,
+    usage,
+    command
+};
@@ -69,8 +69,10 @@ static const Command * commands[] = {
     &diff_command,
     &diff_state_command,
     &diff_images_command,
+    &diff_tiles_command,
     &dump_command,
     &dump_images_command,
+    &export_command,
     &pickle_command,
     &sed_command,
     &repack_command,
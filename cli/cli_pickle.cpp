@@ -25,12 +25,20 @@
 
 
 #include <string.h>
+#include <stdlib.h>
 #include <limits.h> // for CHAR_MAX
 #include <getopt.h>
 
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
 #include "pickle.hpp"
 
 #include "os_binary.hpp"
+#include "os_queue.hpp"
+#include "os_thread.hpp"
 
 #include "cli.hpp"
 #include "cli_pager.hpp"
@@ -188,7 +196,264 @@ public:
 };
 
 
-static trace::CallSet calls(trace::FREQUENCY_ALL);
+/**
+ * Selects the calls to pickle, by number and by function name.
+ */
+class PickleFilter : public trace::CallFilter
+{
+public:
+    trace::CallSet calls;
+    std::set<std::string> functions;
+
+    PickleFilter() :
+        calls(trace::FREQUENCY_ALL)
+    {}
+
+    void
+    addFunctions(const char *names) {
+        std::string list(names);
+        size_t start = 0;
+        while (start <= list.size()) {
+            size_t end = list.find(',', start);
+            if (end == std::string::npos) {
+                end = list.size();
+            }
+            if (end > start) {
+                functions.insert(list.substr(start, end - start));
+            }
+            start = end + 1;
+        }
+    }
+
+    bool
+    contains(const Call &call) const {
+        if (!calls.contains(call.no, call.flags)) {
+            return false;
+        }
+        if (functions.empty()) {
+            return true;
+        }
+
+        // Cache the answer per signature, as names repeat a lot
+        unsigned id = call.sig->id;
+        if (id >= selected.size()) {
+            selected.resize(id + 1, UNKNOWN);
+        }
+        if (selected[id] == UNKNOWN) {
+            selected[id] = functions.count(call.name()) ? YES : NO;
+        }
+        return selected[id] == YES;
+    }
+
+private:
+    enum {
+        UNKNOWN = 0,
+        YES,
+        NO
+    };
+
+    mutable std::vector<unsigned char> selected;
+};
+
+
+static PickleFilter filter;
+
+
+/**
+ * Pickles calls on several threads.
+ *
+ * The calls are parsed on the calling thread, grouped in batches, and dealt
+ * round-robin to the workers, which encode each batch into a buffer of its
+ * own.  A writer thread collects the buffers from the workers in the same
+ * round-robin order, so the output is identical to the sequential one.
+ */
+class ParallelPickler
+{
+protected:
+    enum {
+        BATCH_SIZE = 256,
+        QUEUE_SIZE = 4
+    };
+
+    struct Batch
+    {
+        std::vector<trace::Call *> calls;
+        std::string data;
+    };
+
+    struct Worker
+    {
+        ParallelPickler *pickler;
+        os::spsc_queue<Batch *> input;
+        os::spsc_queue<Batch *> output;
+        os::thread thread;
+
+        Worker() :
+            pickler(0),
+            input(QUEUE_SIZE),
+            output(QUEUE_SIZE)
+        {}
+    };
+
+    bool symbolic;
+    std::vector<Worker *> workers;
+    os::thread writerThread;
+
+    Batch *batch;
+    unsigned nextWorker;
+
+    static void *
+    workerThread(Worker *worker);
+
+    static void *
+    writerThreadFunction(ParallelPickler *_this);
+
+    void
+    encode(Batch *batch) const;
+
+    void
+    write(void);
+
+    void
+    dispatch(Batch *batch);
+
+public:
+    ParallelPickler(unsigned numWorkers, bool _symbolic);
+    ~ParallelPickler();
+
+    void
+    pickle(trace::Call *call);
+};
+
+
+ParallelPickler::ParallelPickler(unsigned numWorkers, bool _symbolic) :
+    symbolic(_symbolic),
+    batch(0),
+    nextWorker(0)
+{
+    workers.resize(numWorkers);
+    for (unsigned i = 0; i < numWorkers; ++i) {
+        Worker *worker = new Worker;
+        worker->pickler = this;
+        worker->thread = os::thread(workerThread, worker);
+        workers[i] = worker;
+    }
+    writerThread = os::thread(writerThreadFunction, this);
+}
+
+
+/**
+ * Flush the pending calls and wait for everything to be written.
+ */
+ParallelPickler::~ParallelPickler()
+{
+    if (batch) {
+        dispatch(batch);
+        batch = 0;
+    }
+
+    for (unsigned i = 0; i < workers.size(); ++i) {
+        dispatch(NULL);
+    }
+
+    writerThread.join();
+
+    for (unsigned i = 0; i < workers.size(); ++i) {
+        workers[i]->thread.join();
+        delete workers[i];
+    }
+}
+
+
+void
+ParallelPickler::pickle(trace::Call *call)
+{
+    if (!batch) {
+        batch = new Batch;
+        batch->calls.reserve(BATCH_SIZE);
+    }
+    batch->calls.push_back(call);
+    if (batch->calls.size() >= BATCH_SIZE) {
+        dispatch(batch);
+        batch = 0;
+    }
+}
+
+
+void
+ParallelPickler::dispatch(Batch *batch)
+{
+    // Blocks while the worker is busy
+    workers[nextWorker]->input.push(batch);
+    nextWorker = (nextWorker + 1) % workers.size();
+}
+
+
+void
+ParallelPickler::encode(Batch *batch) const
+{
+    std::ostringstream stream;
+    PickleWriter writer(stream);
+    PickleVisitor visitor(writer, symbolic);
+
+    for (unsigned i = 0; i < batch->calls.size(); ++i) {
+        trace::Call *call = batch->calls[i];
+        writer.begin();
+        visitor.visit(call);
+        writer.end();
+        delete call;
+    }
+    batch->calls.clear();
+
+    batch->data = stream.str();
+}
+
+
+void *
+ParallelPickler::workerThread(Worker *worker)
+{
+    Batch *batch;
+    do {
+        worker->input.pop(batch);
+        if (batch) {
+            worker->pickler->encode(batch);
+        }
+        worker->output.push(batch);
+    } while (batch);
+    return 0;
+}
+
+
+/**
+ * Writer thread main loop.
+ */
+void
+ParallelPickler::write(void)
+{
+    unsigned i = 0;
+    for (;;) {
+        Batch *batch;
+        workers[i]->output.pop(batch);
+        if (!batch) {
+            // The end marker is dealt after the last batch, so everything
+            // else was already written.
+            break;
+        }
+        std::cout.write(batch->data.data(), batch->data.size());
+        delete batch;
+        i = (i + 1) % workers.size();
+    }
+    std::cout.flush();
+}
+
+
+void *
+ParallelPickler::writerThreadFunction(ParallelPickler *_this)
+{
+    _this->write();
+    return 0;
+}
+
 
 static const char *synopsis = "Pickle given trace(s) to standard output.";
 
@@ -202,28 +467,39 @@ usage(void)
         "    -h, --help           show this help message and exit\n"
         "    -s, --symbolic       dump symbolic names\n"
         "    --calls=CALLSET      only dump specified calls\n"
+        "    --functions=NAME[,NAME...]\n"
+        "                         only dump calls to the specified functions\n"
+        "    -j, --jobs=N         encode calls on N threads\n"
+        "\n"
+        "Calls left out by --calls or --functions are skipped without decoding\n"
+        "their arguments.\n"
     ;
 }
 
 enum {
 	CALLS_OPT = CHAR_MAX + 1,
+	FUNCTIONS_OPT,
 };
 
 const static char *
-shortOptions = "hs";
+shortOptions = "hsj:";
 
 const static struct option
 longOptions[] = {
     {"help", no_argument, 0, 'h'},
     {"symbolic", no_argument, 0, 's'},
     {"calls", required_argument, 0, CALLS_OPT},
+    {"functions", required_argument, 0, FUNCTIONS_OPT},
+    {"jobs", required_argument, 0, 'j'},
     {0, 0, 0, 0}
 };
 
 static int
 command(int argc, char *argv[])
 {
-    bool symbolic;
+    bool symbolic = false;
+    bool filtered = false;
+    int jobs = 1;
 
     int opt;
     while ((opt = getopt_long(argc, argv, shortOptions, longOptions, NULL)) != -1) {
@@ -235,7 +511,19 @@ command(int argc, char *argv[])
             symbolic = true;
             break;
         case CALLS_OPT:
-            calls.merge(optarg);
+            filter.calls.merge(optarg);
+            filtered = true;
+            break;
+        case FUNCTIONS_OPT:
+            filter.addFunctions(optarg);
+            filtered = true;
+            break;
+        case 'j':
+            jobs = atoi(optarg);
+            if (jobs < 1) {
+                std::cerr << "error: invalid number of jobs `" << optarg << "`\n";
+                return 1;
+            }
             break;
         default:
             std::cerr << "error: unexpected option `" << (char)opt << "`\n";
@@ -258,15 +546,38 @@ command(int argc, char *argv[])
             return 1;
         }
 
+        if (filtered) {
+            parser.setCallFilter(&filter);
+        }
+
+        // The calls refer to signatures owned by the parser, so all must be
+        // written before moving on to the next trace.
+        ParallelPickler *pickler = NULL;
+        if (jobs > 1) {
+            pickler = new ParallelPickler(jobs, symbolic);
+        }
+
         trace::Call *call;
         while ((call = parser.parse_call())) {
-            if (calls.contains(*call)) {
+            if (call->no > filter.calls.getLast()) {
+                delete call;
+                break;
+            }
+            if (filtered && !filter.contains(*call)) {
+                delete call;
+                continue;
+            }
+            if (pickler) {
+                pickler->pickle(call);
+            } else {
                 writer.begin();
                 visitor.visit(call);
                 writer.end();
+                delete call;
             }
-            delete call;
         }
+
+        delete pickler;
     }
 
     return 0;
@@ -0,0 +1,82 @@
+/**************************************************************************
+ *
+ * Copyright 2014 VMware, Inc.
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ **************************************************************************/
+
+/*
+ * Fast non-cryptographic 64-bit hashing, for telling whether data changed.
+ */
+
+#ifndef _FAST_HASH_HPP_
+#define _FAST_HASH_HPP_
+
+
+#include <string.h>
+
+
+namespace fasthash {
+
+
+static const unsigned long long
+basis = 0xcbf29ce484222325ULL;
+
+
+/*
+ * Consumes eight bytes at a time.  Each step is a bijection of the hash,
+ * so a change to any single word always changes the final hash, and shifts
+ * the high bits of the product down, so they affect later steps.
+ */
+inline unsigned long long
+update(unsigned long long hash, const void *data, size_t size) {
+    const unsigned char *bytes = (const unsigned char *)data;
+    while (size >= sizeof(unsigned long long)) {
+        unsigned long long word;
+        memcpy(&word, bytes, sizeof word);
+        hash = (hash ^ word) * 0x9e3779b97f4a7c15ULL;
+        hash ^= hash >> 29;
+        bytes += sizeof word;
+        size -= sizeof word;
+    }
+    while (size--) {
+        hash = (hash ^ *bytes++) * 0x9e3779b97f4a7c15ULL;
+        hash ^= hash >> 29;
+    }
+    return hash;
+}
+
+
+/*
+ * Spread the remaining high bits over the whole hash.
+ */
+inline unsigned long long
+finish(unsigned long long hash) {
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+
+} /* namespace fasthash */
+
+#endif /* _FAST_HASH_HPP_ */
@@ -25,43 +25,74 @@
  **************************************************************************/
 
 /*
- * Simple OS time measurement abstraction.
+ * Simple OS memory usage measurement abstraction.
  */
 
 #ifndef _OS_MEMORY_HPP_
 #define _OS_MEMORY_HPP_
 
-#ifdef HAVE_READPROC_H
-#include <proc/readproc.h>
+#if defined(__linux__)
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
 
 namespace os {
-    inline long long
-    getVsize(void) {
-        proc_t proc;
-        look_up_our_self(&proc);
-        return proc.vsize;
-    }
+    /**
+     * Get the virtual size (in bytes) and the resident set size (in pages) of
+     * the current process.
+     *
+     * This is called around every profiled call, so rather than parsing
+     * /proc/self/stat, it reads the much shorter /proc/self/statm, through a
+     * file descriptor which is kept open.
+     */
+    inline void
+    getMemoryUsage(long long &vsize, long long &rss) {
+        static int fd = open("/proc/self/statm", O_RDONLY);
+        static long pageSize = sysconf(_SC_PAGESIZE);
 
-    inline long long
-    getRss(void) {
-        proc_t proc;
-        look_up_our_self(&proc);
-        return proc.rss;
+        vsize = 0;
+        rss = 0;
+
+        char buf[128];
+        ssize_t len = fd < 0 ? -1 : pread(fd, buf, sizeof buf - 1, 0);
+        if (len <= 0) {
+            return;
+        }
+        buf[len] = 0;
+
+        char *end;
+        unsigned long size = strtoul(buf, &end, 10);
+        unsigned long resident = strtoul(end, NULL, 10);
+        vsize = (long long)size * pageSize;
+        rss = resident;
     }
 } /* namespace os */
 
 #else
+namespace os {
+    inline void
+    getMemoryUsage(long long &vsize, long long &rss) {
+        vsize = 0;
+        rss = 0;
+    }
+} /* namespace os */
+#endif
+
 namespace os {
     inline long long
     getVsize(void) {
-        return 0;
+        long long vsize, rss;
+        getMemoryUsage(vsize, rss);
+        return vsize;
     }
 
     inline long long
     getRss(void) {
-        return 0;
+        long long vsize, rss;
+        getMemoryUsage(vsize, rss);
+        return rss;
     }
 } /* namespace os */
-#endif
 
 #endif /* _OS_MEMORY_HPP_ */
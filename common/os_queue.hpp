@@ -0,0 +1,232 @@
+/**************************************************************************
+ *
+ * Copyright 2014 VMware, Inc.
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ **************************************************************************/
+
+/*
+ * Bounded single-producer/single-consumer queue.
+ *
+ * Pushing and popping is lock-free.  The mutex and condition variables are
+ * only used to put the producer (consumer) to sleep when the queue is full
+ * (empty), and to wake it up again.
+ *
+ * A sleeping side is only woken up once a whole batch of items (or of free
+ * slots) is available, so that the threads do not take turns item by item
+ * when one is much faster than the other.  The producer must call flush()
+ * when it will not push anything for a while, e.g., at the end of its input.
+ */
+
+#ifndef _OS_QUEUE_HPP_
+#define _OS_QUEUE_HPP_
+
+
+#include <assert.h>
+#include <stddef.h>
+
+#include "os_thread.hpp"
+
+
+namespace os {
+
+
+    /*
+     * Minimal memory ordering primitives.
+     */
+#if defined(_MSC_VER)
+    template< class T >
+    inline T
+    load_acquire(const volatile T *ptr) {
+        T value = *ptr;
+        _ReadWriteBarrier();
+        return value;
+    }
+
+    template< class T >
+    inline void
+    store_release(volatile T *ptr, T value) {
+        _ReadWriteBarrier();
+        *ptr = value;
+    }
+
+    inline void
+    memory_fence(void) {
+        MemoryBarrier();
+    }
+#else
+    template< class T >
+    inline T
+    load_acquire(const volatile T *ptr) {
+        return __atomic_load_n(ptr, __ATOMIC_ACQUIRE);
+    }
+
+    template< class T >
+    inline void
+    store_release(volatile T *ptr, T value) {
+        __atomic_store_n(ptr, value, __ATOMIC_RELEASE);
+    }
+
+    inline void
+    memory_fence(void) {
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    }
+#endif
+
+
+    template< class T >
+    class spsc_queue
+    {
+    public:
+        /**
+         * The capacity is rounded up to the next power of two.
+         */
+        explicit
+        spsc_queue(size_t capacity, size_t batch = 1) :
+            _head(0),
+            _tail(0),
+            _consumerWaiting(0),
+            _producerWaiting(0)
+        {
+            size_t size = 2;
+            while (size < capacity) {
+                size <<= 1;
+            }
+            _mask = size - 1;
+            _batch = batch < 1 ? 1 : batch > size ? size : batch;
+            _items = new T[size];
+        }
+
+        ~spsc_queue() {
+            delete [] _items;
+        }
+
+        inline size_t
+        capacity(void) const {
+            return _mask + 1;
+        }
+
+        /**
+         * Producer side.
+         */
+        inline bool
+        try_push(const T &item) {
+            size_t tail = _tail;
+            if (tail - load_acquire(&_head) > _mask) {
+                return false;
+            }
+            _items[tail & _mask] = item;
+            store_release(&_tail, tail + 1);
+            memory_fence();
+            if (_consumerWaiting &&
+                tail + 1 - load_acquire(&_head) >= _batch) {
+                unique_lock<mutex> lock(_mutex);
+                _notEmpty.signal();
+            }
+            return true;
+        }
+
+        /**
+         * Wake up the consumer if it is waiting for a batch to fill up.
+         */
+        void
+        flush(void) {
+            memory_fence();
+            if (_consumerWaiting) {
+                unique_lock<mutex> lock(_mutex);
+                _notEmpty.signal();
+            }
+        }
+
+        void
+        push(const T &item) {
+            while (!try_push(item)) {
+                unique_lock<mutex> lock(_mutex);
+                _producerWaiting = 1;
+                memory_fence();
+                while (_tail - load_acquire(&_head) > _mask) {
+                    _notFull.wait(lock);
+                }
+                _producerWaiting = 0;
+            }
+        }
+
+        /**
+         * Consumer side.
+         */
+        inline bool
+        try_pop(T &item) {
+            size_t head = _head;
+            if (head == load_acquire(&_tail)) {
+                return false;
+            }
+            item = _items[head & _mask];
+            store_release(&_head, head + 1);
+            memory_fence();
+            if (_producerWaiting &&
+                _mask + 1 - (load_acquire(&_tail) - (head + 1)) >= _batch) {
+                unique_lock<mutex> lock(_mutex);
+                _notFull.signal();
+            }
+            return true;
+        }
+
+        void
+        pop(T &item) {
+            while (!try_pop(item)) {
+                unique_lock<mutex> lock(_mutex);
+                _consumerWaiting = 1;
+                memory_fence();
+                while (_head == load_acquire(&_tail)) {
+                    _notEmpty.wait(lock);
+                }
+                _consumerWaiting = 0;
+            }
+        }
+
+    private:
+        T *_items;
+        size_t _mask;
+        size_t _batch;
+
+        /*
+         * Keep the indices written by different threads on different cache
+         * lines to avoid false sharing.
+         */
+        volatile size_t _head;
+        char _pad0[64 - sizeof(size_t)];
+        volatile size_t _tail;
+        char _pad1[64 - sizeof(size_t)];
+
+        volatile int _consumerWaiting;
+        volatile int _producerWaiting;
+        mutex _mutex;
+        condition_variable _notEmpty;
+        condition_variable _notFull;
+
+        spsc_queue(const spsc_queue &);
+        spsc_queue & operator = (const spsc_queue &);
+    };
+
+
+} /* namespace os */
+
+#endif /* _OS_QUEUE_HPP_ */
@@ -27,6 +27,7 @@
 #include <assert.h>
 #include <stdlib.h>
 
+#include <algorithm>
 #include <limits>
 #include <fstream>
 #include <iostream>
@@ -194,33 +195,25 @@ public:
 };
 
 
-class FileCallSetParser : public CallSetParser
+// Read the whole file in one go, as it may list millions of calls.
+static bool
+readFile(const char *filename, std::string &contents)
 {
-    std::ifstream stream;
-
-public:
-    FileCallSetParser(CallSet &_set, const char *filename) :
-        CallSetParser(_set)
-    {
-        stream.open(filename);
-        if (!stream.is_open()) {
-            std::cerr << "error: failed to open \"" << filename << "\"\n";
-            exit(1);
-        }
-
-        stream.get(lookahead);
+    std::ifstream stream(filename, std::ifstream::binary);
+    if (!stream.is_open()) {
+        return false;
     }
 
-    char consume() {
-        char c = lookahead;
-        if (stream.eof()) {
-            lookahead = 0;
-        } else {
-            stream.get(lookahead);
-        }
-        return c;
+    stream.seekg(0, std::ifstream::end);
+    std::streamoff size = stream.tellg();
+    stream.seekg(0, std::ifstream::beg);
+    if (size > 0) {
+        contents.resize(size);
+        stream.read(&contents[0], size);
+        contents.resize(stream.gcount());
     }
-};
+    return true;
+}
 
 
 void
@@ -234,7 +227,12 @@ CallSet::merge(const char *string)
     }
 
     if (*string == '@') {
-        FileCallSetParser parser(*this, &string[1]);
+        std::string contents;
+        if (!readFile(&string[1], contents)) {
+            std::cerr << "error: failed to open \"" << &string[1] << "\"\n";
+            exit(1);
+        }
+        StringCallSetParser parser(*this, contents.c_str());
         parser.parse();
     } else {
         StringCallSetParser parser(*this, string);
@@ -243,7 +241,8 @@ CallSet::merge(const char *string)
 }
 
 
-CallSet::CallSet(CallFlags freq): limits(std::numeric_limits<CallNo>::min(), std::numeric_limits<CallNo>::max()), firstmerge(true) {
+CallSet::CallSet(CallFlags freq): limits(std::numeric_limits<CallNo>::min(), std::numeric_limits<CallNo>::max()), firstmerge(true), sorted(true) {
+    rewind(0);
     if (freq != FREQUENCY_NONE) {
         CallNo start = std::numeric_limits<CallNo>::min();
         CallNo stop = std::numeric_limits<CallNo>::max();
@@ -253,3 +252,58 @@ CallSet::CallSet(CallFlags freq): limits(std::numeric_limits<CallNo>::min(), std
     }
 }
 
+
+static bool
+startsBefore(const CallRange &a, const CallRange &b)
+{
+    return a.start < b.start;
+}
+
+
+static bool
+stopsBefore(const CallRange &range, CallNo callNo)
+{
+    return range.stop < callNo;
+}
+
+
+void
+CallSet::sort(void) const
+{
+    std::sort(intervals.begin(), intervals.end(), startsBefore);
+
+    // Merge overlapping and adjacent intervals
+    std::vector<CallRange>::iterator out = intervals.begin();
+    std::vector<CallRange>::const_iterator it;
+    for (it = intervals.begin(); it != intervals.end(); ++it) {
+        if (it != intervals.begin() &&
+            (out->stop == std::numeric_limits<CallNo>::max() ||
+             it->start <= out->stop + 1)) {
+            out->stop = std::max(out->stop, it->stop);
+        } else {
+            if (it != intervals.begin()) {
+                ++out;
+            }
+            *out = *it;
+        }
+    }
+    if (!intervals.empty()) {
+        intervals.erase(out + 1, intervals.end());
+    }
+
+    std::stable_sort(ranges.begin(), ranges.end(), startsBefore);
+
+    sorted = true;
+    rewind(0);
+}
+
+
+// Reposition the lookup cursor, for looking up calls from callNo onwards.
+void
+CallSet::rewind(CallNo callNo) const
+{
+    lastCallNo = callNo;
+    nextInterval = std::lower_bound(intervals.begin(), intervals.end(), callNo, stopsBefore) - intervals.begin();
+    nextRange = 0;
+    activeRanges.clear();
+}
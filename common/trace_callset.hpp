@@ -49,10 +49,9 @@
 
 
 #include <limits>
-#include <list>
+#include <vector>
 
 #include "trace_model.hpp"
-#include "trace_fast_callset.hpp"
 
 namespace trace {
 
@@ -100,22 +99,45 @@ namespace trace {
 
 
     // A collection of call ranges
+    //
+    // Ranges are kept in sorted vectors, which are (re)built lazily on the
+    // first lookup after any addition.  Lookups remember where the previous
+    // one ended, so that querying ascending call numbers -- as done when
+    // replaying -- takes amortized constant time.
+    //
+    // Hence lookups modify the set, despite being const, and a set must not
+    // be looked up from several threads at once.  Only empty sets, which
+    // lookups never modify, may be shared.
     class CallSet
     {
     private:
         CallRange limits;
         bool firstmerge;
 
-    public:
-        FastCallSet fast_call_set;
+        // Ranges without step or frequency, merged into disjoint intervals
+        mutable std::vector<CallRange> intervals;
+
+        // Remaining ranges, sorted by start
+        mutable std::vector<CallRange> ranges;
+
+        mutable bool sorted;
 
-        // TODO: use binary tree to speed up lookups, (less important
-        // now that we are using FastCallSet for ranges without step
-        // or freq).
-        typedef std::list< CallRange > RangeList;
-        RangeList ranges;
+        // Lookup cursor
+        mutable CallNo lastCallNo;
+        mutable size_t nextInterval;
+        mutable size_t nextRange;
+        mutable std::vector<size_t> activeRanges;
 
-        CallSet(): limits(std::numeric_limits<CallNo>::min(), std::numeric_limits<CallNo>::max()), firstmerge(true) {}
+        void
+        sort(void) const;
+
+        void
+        rewind(CallNo callNo) const;
+
+    public:
+        CallSet(): limits(std::numeric_limits<CallNo>::min(), std::numeric_limits<CallNo>::max()), firstmerge(true), sorted(true) {
+            rewind(0);
+        }
 
         CallSet(CallFlags freq);
 
@@ -125,7 +147,7 @@ namespace trace {
         // Not empty set
         inline bool
         empty() const {
-            return fast_call_set.empty() && ranges.empty();
+            return intervals.empty() && ranges.empty();
         }
 
         void
@@ -143,17 +165,12 @@ namespace trace {
                         limits.stop = range.stop;
                 }
 
-                /* Optimize by using fast_call_set whenever possible */
                 if (range.step == 1 && range.freq == FREQUENCY_ALL) {
-                    fast_call_set.add(range.start, range.stop);
+                    intervals.push_back(range);
                 } else {
-                    RangeList::iterator it = ranges.begin();
-                    while (it != ranges.end() && it->start < range.start) {
-                        ++it;
-                    }
-
-                    ranges.insert(it, range);
+                    ranges.push_back(range);
                 }
+                sorted = false;
             }
         }
 
@@ -162,19 +179,50 @@ namespace trace {
             if (empty()) {
                 return false;
             }
-            if (fast_call_set.contains(callNo))
+
+            if (!sorted) {
+                sort();
+            }
+            if (callNo < lastCallNo) {
+                rewind(callNo);
+            }
+            lastCallNo = callNo;
+
+            while (nextInterval < intervals.size() &&
+                   intervals[nextInterval].stop < callNo) {
+                ++nextInterval;
+            }
+            if (nextInterval < intervals.size() &&
+                intervals[nextInterval].start <= callNo) {
                 return true;
-            RangeList::const_iterator it;
-            for (it = ranges.begin(); it != ranges.end() && it->start <= callNo; ++it) {
-                if (it->contains(callNo, callFlags)) {
+            }
+
+            if (ranges.empty()) {
+                return false;
+            }
+            while (nextRange < ranges.size() &&
+                   ranges[nextRange].start <= callNo) {
+                activeRanges.push_back(nextRange++);
+            }
+            size_t i = 0;
+            while (i < activeRanges.size()) {
+                const CallRange &range = ranges[activeRanges[i]];
+                if (range.stop < callNo) {
+                    // Expired
+                    activeRanges[i] = activeRanges.back();
+                    activeRanges.pop_back();
+                    continue;
+                }
+                if (range.contains(callNo, callFlags)) {
                     return true;
                 }
+                ++i;
             }
             return false;
         }
 
         inline bool
-        contains(const trace::Call &call) {
+        contains(const trace::Call &call) const {
             return contains(call.no, call.flags);
         }
 
@@ -28,6 +28,8 @@
 
 #include <assert.h>
 
+#include <algorithm>
+
 
 using namespace trace;
 
@@ -35,7 +37,8 @@ using namespace trace;
 File::File(const std::string &filename,
            File::Mode mode)
     : m_mode(mode),
-      m_isOpened(false)
+      m_isOpened(false),
+      m_isTruncated(false)
 {
     if (!filename.empty()) {
         open(filename, m_mode);
@@ -54,3 +57,29 @@ void File::setCurrentOffset(const File::Offset &offset)
     assert(0);
 }
 
+char *File::rawReserve(size_t minLength, size_t &available)
+{
+    if (m_reserveBuffer.size() < minLength) {
+        m_reserveBuffer.resize(std::max(minLength, size_t(4096)));
+    }
+    available = m_reserveBuffer.size();
+    return &m_reserveBuffer[0];
+}
+
+void File::rawCommit(size_t length)
+{
+    assert(length <= m_reserveBuffer.size());
+    if (length) {
+        rawWrite(&m_reserveBuffer[0], length);
+    }
+}
+
+void File::markSegment(bool endOfFrame)
+{
+}
+
+size_t File::pendingWriteSize() const
+{
+    return 0;
+}
+
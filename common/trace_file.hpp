@@ -59,6 +59,7 @@ public:
 public:
     static File *createZLib(void);
     static File *createSnappy(void);
+    static File *createSnappyRing(size_t maxSize, unsigned maxFrames);
     static File *createUncompressed(void);
     static File *createForRead(const char *filename);
     static File *createForWrite(const char *filename, char compression = 's');
@@ -69,9 +70,24 @@ public:
 
     bool isOpened() const;
     File::Mode mode() const;
+    bool isTruncated() const;
 
     bool open(const std::string &filename, File::Mode mode);
     bool write(const void *buffer, size_t length);
+
+    /**
+     * Obtain a contiguous span of at least minLength bytes, for encoding data
+     * directly into the file's buffers instead of copying it in with write().
+     * Returns the start of the span and sets available to its full length.
+     *
+     * The data only becomes part of the file once commit() is called with the
+     * number of bytes used, and nothing else may be written in between.
+     * Spans are meant for small amounts of data -- a few KB at most; larger
+     * buffers should be passed to write() instead.
+     */
+    char *reserve(size_t minLength, size_t &available);
+    void commit(size_t length);
+
     size_t read(void *buffer, size_t length);
     void close();
     void flush(void);
@@ -79,12 +95,28 @@ public:
     bool skip(size_t length);
     int percentRead();
 
+    /**
+     * Number of bytes written but not yet handed over to the OS, i.e., the
+     * amount of data that would be lost if the process were killed now.
+     */
+    virtual size_t pendingWriteSize() const;
+
+    /**
+     * Note that the data written from now on starts a new, self-contained
+     * segment of the trace, and whether the segment just completed ends a
+     * frame.  Files that keep only the most recent frames (see
+     * createSnappyRing) drop whole segments at a time.
+     */
+    virtual void markSegment(bool endOfFrame);
+
     virtual bool supportsOffsets() const = 0;
     virtual File::Offset currentOffset() = 0;
     virtual void setCurrentOffset(const File::Offset &offset);
 protected:
     virtual bool rawOpen(const std::string &filename, File::Mode mode) = 0;
     virtual bool rawWrite(const void *buffer, size_t length) = 0;
+    virtual char *rawReserve(size_t minLength, size_t &available);
+    virtual void rawCommit(size_t length);
     virtual size_t rawRead(void *buffer, size_t length) = 0;
     virtual int rawGetc() = 0;
     virtual void rawClose() = 0;
@@ -95,6 +127,20 @@ protected:
 protected:
     File::Mode m_mode;
     bool m_isOpened;
+
+    /**
+     * Set when reading stopped early because the data at the end of the file
+     * was found to be truncated or corrupt (e.g., the traced process was
+     * killed while writing it).
+     */
+    bool m_isTruncated;
+
+private:
+    /**
+     * Scratch space backing reserve(), for files that can't expose their own
+     * buffers.
+     */
+    std::string m_reserveBuffer;
 };
 
 inline bool File::isOpened() const
@@ -107,11 +153,17 @@ inline File::Mode File::mode() const
     return m_mode;
 }
 
+inline bool File::isTruncated() const
+{
+    return m_isTruncated;
+}
+
 inline bool File::open(const std::string &filename, File::Mode mode)
 {
     if (m_isOpened) {
         close();
     }
+    m_isTruncated = false;
     m_isOpened = rawOpen(filename, mode);
     m_mode = mode;
 
@@ -126,6 +178,23 @@ inline bool File::write(const void *buffer, size_t length)
     return rawWrite(buffer, length);
 }
 
+inline char *File::reserve(size_t minLength, size_t &available)
+{
+    if (!m_isOpened || m_mode != File::Write) {
+        // Hand out scratch space, which commit() will then discard
+        return File::rawReserve(minLength, available);
+    }
+    return rawReserve(minLength, available);
+}
+
+inline void File::commit(size_t length)
+{
+    if (!m_isOpened || m_mode != File::Write) {
+        return;
+    }
+    rawCommit(length);
+}
+
 inline size_t File::read(void *buffer, size_t length)
 {
     if (!m_isOpened || m_mode != File::Read) {
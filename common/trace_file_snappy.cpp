@@ -48,6 +48,20 @@
  * to offer a pretty good compression/disk io speed ratio
  * but that might change.
  *
+ * Because every chunk carries its own length, a reader can tell apart a
+ * complete chunk from one that was cut short when the writing process was
+ * killed.  A truncated or otherwise undecodable chunk is treated as the end of
+ * the file, so that everything up to the last complete chunk can still be
+ * recovered.
+ *
+ * In flight recorder mode (see File::createSnappyRing) compressed chunks are
+ * kept in memory instead, grouped by segment, and the file is rewritten with
+ * the ones still kept every time it is flushed.  A new chunk is started at
+ * every segment, so segments can be dropped without decompressing anything.
+ * The first two segments -- the trace header, and the calls up to the first
+ * segment marked afterwards, which usually create the contexts and load the
+ * application's resources -- are always kept.
+ *
  */
 
 
@@ -55,10 +69,13 @@
 
 #include <iostream>
 #include <algorithm>
+#include <iterator>
+#include <list>
 
 #include <assert.h>
 #include <string.h>
 
+#include "os.hpp"
 #include "trace_file.hpp"
 
 
@@ -72,15 +89,22 @@ using namespace trace;
 class SnappyFile : public File {
 public:
     SnappyFile(const std::string &filename = std::string(),
-               File::Mode mode = File::Read);
+               File::Mode mode = File::Read,
+               size_t ringMaxSize = 0,
+               unsigned ringMaxFrames = 0);
     virtual ~SnappyFile();
 
+    virtual void markSegment(bool endOfFrame);
+
     virtual bool supportsOffsets() const;
     virtual File::Offset currentOffset();
     virtual void setCurrentOffset(const File::Offset &offset);
+    virtual size_t pendingWriteSize() const;
 protected:
     virtual bool rawOpen(const std::string &filename, File::Mode mode);
     virtual bool rawWrite(const void *buffer, size_t length);
+    virtual char *rawReserve(size_t minLength, size_t &available);
+    virtual void rawCommit(size_t length);
     virtual size_t rawRead(void *buffer, size_t length);
     virtual int rawGetc();
     virtual void rawClose();
@@ -105,13 +129,21 @@ private:
     }
     inline bool endOfData() const
     {
-        return m_stream.eof() && freeCacheSize() == 0;
+        return (m_stream.eof() || m_isTruncated) && freeCacheSize() == 0;
+    }
+    inline bool isRing() const
+    {
+        return m_ringMaxSize || m_ringMaxFrames;
     }
     void flushWriteCache();
+    void writeChunkData(const char *data, size_t length);
+    void dropSegments();
+    void writeSegments();
     void flushReadCache(size_t skipLength = 0);
     void createCache(size_t size);
     void writeCompressedLength(size_t length);
     size_t readCompressedLength();
+    void truncate(const char *reason);
 private:
     std::fstream m_stream;
     size_t m_cacheMaxSize;
@@ -123,15 +155,38 @@ private:
 
     File::Offset m_currentOffset;
     std::streampos m_endPos;
+
+    /*
+     * Flight recorder state.  The last segment is the one being written.
+     * Frames too long for a single segment span several, and only the last
+     * of those ends the frame.
+     */
+    struct Segment {
+        std::string data;
+        bool endOfFrame;
+
+        Segment() : endOfFrame(false) {}
+    };
+
+    size_t m_ringMaxSize;
+    unsigned m_ringMaxFrames;
+    std::string m_filename;
+    std::list<Segment> m_segments;
+    size_t m_segmentsSize;
 };
 
 SnappyFile::SnappyFile(const std::string &filename,
-                              File::Mode mode)
+                       File::Mode mode,
+                       size_t ringMaxSize,
+                       unsigned ringMaxFrames)
     : File(),
       m_cacheMaxSize(SNAPPY_CHUNK_SIZE),
       m_cacheSize(m_cacheMaxSize),
       m_cache(new char [m_cacheMaxSize]),
-      m_cachePtr(m_cache)
+      m_cachePtr(m_cache),
+      m_ringMaxSize(ringMaxSize),
+      m_ringMaxFrames(ringMaxFrames),
+      m_segmentsSize(0)
 {
     size_t maxCompressedLength =
         snappy::MaxCompressedLength(SNAPPY_CHUNK_SIZE);
@@ -151,6 +206,11 @@ bool SnappyFile::rawOpen(const std::string &filename, File::Mode mode)
     if (mode == File::Write) {
         fmode |= (std::fstream::out | std::fstream::trunc);
         createCache(SNAPPY_CHUNK_SIZE);
+        if (isRing()) {
+            m_filename = filename;
+            m_segments.assign(1, Segment());
+            m_segmentsSize = 0;
+        }
     } else if (mode == File::Read) {
         fmode |= std::fstream::in;
     }
@@ -208,6 +268,25 @@ bool SnappyFile::rawWrite(const void *buffer, size_t length)
     return true;
 }
 
+char *SnappyFile::rawReserve(size_t minLength, size_t &available)
+{
+    assert(minLength <= m_cacheMaxSize);
+    if (freeCacheSize() < minLength) {
+        flushWriteCache();
+    }
+    available = freeCacheSize();
+    return m_cachePtr;
+}
+
+void SnappyFile::rawCommit(size_t length)
+{
+    assert(length <= freeCacheSize());
+    m_cachePtr += length;
+    if (freeCacheSize() == 0) {
+        flushWriteCache();
+    }
+}
+
 size_t SnappyFile::rawRead(void *buffer, size_t length)
 {
     if (endOfData()) {
@@ -240,6 +319,11 @@ size_t SnappyFile::rawRead(void *buffer, size_t length)
 
 int SnappyFile::rawGetc()
 {
+    // Fast path, as the parser reads most of the trace one byte at a time
+    if (m_cachePtr < m_cache + m_cacheSize) {
+        return (unsigned char)*m_cachePtr++;
+    }
+
     unsigned char c = 0;
     if (rawRead(&c, 1) != 1)
         return -1;
@@ -249,7 +333,13 @@ int SnappyFile::rawGetc()
 void SnappyFile::rawClose()
 {
     if (m_mode == File::Write) {
-        flushWriteCache();
+        if (isRing()) {
+            writeSegments();
+            m_segments.clear();
+            m_segmentsSize = 0;
+        } else {
+            flushWriteCache();
+        }
     }
     m_stream.close();
     delete [] m_cache;
@@ -260,6 +350,10 @@ void SnappyFile::rawClose()
 void SnappyFile::rawFlush()
 {
     assert(m_mode == File::Write);
+    if (isRing()) {
+        writeSegments();
+        return;
+    }
     flushWriteCache();
     m_stream.flush();
 }
@@ -275,12 +369,96 @@ void SnappyFile::flushWriteCache()
                               m_compressedCache, &compressedLength);
 
         writeCompressedLength(compressedLength);
-        m_stream.write(m_compressedCache, compressedLength);
+        writeChunkData(m_compressedCache, compressedLength);
         m_cachePtr = m_cache;
     }
     assert(m_cachePtr == m_cache);
 }
 
+void SnappyFile::writeChunkData(const char *data, size_t length)
+{
+    if (isRing()) {
+        m_segments.back().data.append(data, length);
+        m_segmentsSize += length;
+    } else {
+        m_stream.write(data, length);
+    }
+}
+
+void SnappyFile::markSegment(bool endOfFrame)
+{
+    if (!isRing() || m_mode != File::Write) {
+        return;
+    }
+
+    flushWriteCache();
+    if (!m_segments.back().data.empty()) {
+        m_segments.back().endOfFrame = endOfFrame;
+        m_segments.push_back(Segment());
+        dropSegments();
+    } else if (endOfFrame && m_segments.size() > 1) {
+        std::list<Segment>::reverse_iterator previous = m_segments.rbegin();
+        ++previous;
+        previous->endOfFrame = true;
+    }
+}
+
+/**
+ * Drop the oldest segments beyond the limits, always keeping the first two
+ * and the last complete one.  The frame limit drops whole frames, i.e. all
+ * the segments up to and including the oldest one that ends a frame.
+ */
+void SnappyFile::dropSegments()
+{
+    while (m_segments.size() > 4) {
+        std::list<Segment>::iterator first = m_segments.begin();
+        std::advance(first, 2);
+
+        // Don't count the segment being written
+        std::list<Segment>::iterator last = m_segments.end();
+        --last;
+
+        unsigned frames = 0;
+        std::list<Segment>::iterator it;
+        for (it = first; it != last; ++it) {
+            frames += it->endOfFrame;
+        }
+
+        if (m_ringMaxFrames && frames > m_ringMaxFrames) {
+            bool endOfFrame;
+            do {
+                endOfFrame = first->endOfFrame;
+                m_segmentsSize -= first->data.size();
+                first = m_segments.erase(first);
+            } while (!endOfFrame);
+        } else if (m_ringMaxSize && m_segmentsSize > m_ringMaxSize) {
+            m_segmentsSize -= first->data.size();
+            m_segments.erase(first);
+        } else {
+            break;
+        }
+    }
+}
+
+/**
+ * Rewrite the file with the segments currently kept.
+ */
+void SnappyFile::writeSegments()
+{
+    flushWriteCache();
+
+    m_stream.close();
+    m_stream.open(m_filename.c_str(),
+                  std::fstream::binary | std::fstream::out | std::fstream::trunc);
+    m_stream << SNAPPY_BYTE1;
+    m_stream << SNAPPY_BYTE2;
+    std::list<Segment>::const_iterator it;
+    for (it = m_segments.begin(); it != m_segments.end(); ++it) {
+        m_stream.write(it->data.data(), it->data.size());
+    }
+    m_stream.flush();
+}
+
 void SnappyFile::flushReadCache(size_t skipLength)
 {
     //assert(m_cachePtr == m_cache + m_cacheSize);
@@ -289,19 +467,52 @@ void SnappyFile::flushReadCache(size_t skipLength)
     compressedLength = readCompressedLength();
 
     if (compressedLength) {
+        if (compressedLength > ::snappy::MaxCompressedLength(SNAPPY_CHUNK_SIZE)) {
+            truncate("invalid chunk length");
+            return;
+        }
         m_stream.read((char*)m_compressedCache, compressedLength);
-        ::snappy::GetUncompressedLength(m_compressedCache, compressedLength,
-                                        &m_cacheSize);
-        createCache(m_cacheSize);
+        if ((size_t)m_stream.gcount() != compressedLength) {
+            truncate("truncated chunk");
+            return;
+        }
+        size_t uncompressedLength;
+        if (!::snappy::GetUncompressedLength(m_compressedCache, compressedLength,
+                                             &uncompressedLength)) {
+            truncate("corrupt chunk");
+            return;
+        }
+        // We never write chunks this large, so make sure it is not garbage
+        // before allocating memory for it.
+        if (uncompressedLength > SNAPPY_CHUNK_SIZE &&
+            !::snappy::IsValidCompressedBuffer(m_compressedCache, compressedLength)) {
+            truncate("corrupt chunk");
+            return;
+        }
+        createCache(uncompressedLength);
         if (skipLength < m_cacheSize) {
-            ::snappy::RawUncompress(m_compressedCache, compressedLength,
-                                    m_cache);
+            if (!::snappy::RawUncompress(m_compressedCache, compressedLength,
+                                         m_cache)) {
+                truncate("corrupt chunk");
+                return;
+            }
         }
     } else {
         createCache(0);
     }
 }
 
+/**
+ * Stop reading at the current chunk, which is unusable.
+ */
+void SnappyFile::truncate(const char *reason)
+{
+    os::log("warning: %s at offset %llu; ignoring the rest of the trace\n",
+            reason, (unsigned long long)m_currentOffset.chunk);
+    m_isTruncated = true;
+    createCache(0);
+}
+
 void SnappyFile::createCache(size_t size)
 {
     if (size > m_cacheMaxSize) {
@@ -326,7 +537,7 @@ void SnappyFile::writeCompressedLength(size_t length)
     buf[2] = length & 0xff; length >>= 8;
     buf[3] = length & 0xff; length >>= 8;
     assert(length == 0);
-    m_stream.write((const char *)buf, sizeof buf);
+    writeChunkData((const char *)buf, sizeof buf);
 }
 
 size_t SnappyFile::readCompressedLength()
@@ -335,6 +546,9 @@ size_t SnappyFile::readCompressedLength()
     size_t length;
     m_stream.read((char *)buf, sizeof buf);
     if (m_stream.fail()) {
+        if (m_stream.gcount() > 0) {
+            truncate("truncated chunk length");
+        }
         length = 0;
     } else {
         length  =  (size_t)buf[0];
@@ -356,10 +570,16 @@ File::Offset SnappyFile::currentOffset()
     return m_currentOffset;
 }
 
+size_t SnappyFile::pendingWriteSize() const
+{
+    return m_mode == File::Write ? usedCacheSize() : 0;
+}
+
 void SnappyFile::setCurrentOffset(const File::Offset &offset)
 {
     // to remove eof bit
     m_stream.clear();
+    m_isTruncated = false;
     // seek to the start of a chunk
     m_stream.seekg(offset.chunk, std::ios::beg);
     // load the chunk
@@ -405,3 +625,8 @@ int SnappyFile::rawPercentRead()
 File* File::createSnappy(void) {
     return new SnappyFile;
 }
+
+File* File::createSnappyRing(size_t maxSize, unsigned maxFrames) {
+    assert(maxSize || maxFrames);
+    return new SnappyFile(std::string(), File::Read, maxSize, maxFrames);
+}
@@ -223,6 +223,10 @@ size_t UncompressedFile::rawRead(void *buffer, size_t length)
 
 int UncompressedFile::rawGetc()
 {
+    if (m_cachePtr < m_cache + m_cacheSize) {
+        return (unsigned char)*m_cachePtr++;
+    }
+
     unsigned char c = 0;
     if (rawRead(&c, 1) != 1)
         return -1;
@@ -72,8 +72,17 @@ namespace trace {
  *
  * - version 5:
  *   - new call detail flag CALL_BACKTRACE
+ *
+ * - version 6:
+ *   - new event EVENT_SEGMENT, for flight recorder traces
  */
-#define TRACE_VERSION 5
+#define TRACE_VERSION 6
+
+/*
+ * Version written for traces without segments, so that older readers can
+ * still read them.
+ */
+#define TRACE_VERSION_UNSEGMENTED 5
 
 
 /*
@@ -83,6 +92,7 @@ namespace trace {
  *
  *   event = EVENT_ENTER thread_id call_sig call_detail+
  *         | EVENT_LEAVE call_no call_detail+
+ *         | EVENT_SEGMENT call_no
  *
  *   call_sig = sig_id ( name arg_names )?
  *
@@ -129,12 +139,19 @@ namespace trace {
  *
  *   string = length (BYTE)*
  *
+ * EVENT_SEGMENT starts a self-contained stretch of the trace, so that the
+ * calls before it may be dropped, as done by the flight recorder.  The next
+ * call is numbered call_no, and signatures are defined again on their first
+ * use after it.  From the first segment on, every signature (and stack frame)
+ * id is written doubled, with the low bit set when its definition follows.
+ *
  */
 
 
 enum Event {
     EVENT_ENTER = 0,
     EVENT_LEAVE,
+    EVENT_SEGMENT,
 };
 
 enum CallDetail {
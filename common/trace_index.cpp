@@ -0,0 +1,600 @@
+/**************************************************************************
+ *
+ * Copyright 2014 VMware, Inc.
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ **************************************************************************/
+
+
+#include <assert.h>
+#include <ctype.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+
+#include "os.hpp"
+#include "trace_index.hpp"
+
+
+#define INDEX_MAGIC "apiindex"
+#define INDEX_VERSION 2
+
+
+namespace trace {
+
+
+/*
+ * Characters which separate words in the textual representation of calls.
+ */
+static inline bool
+isDelimiter(char c) {
+    switch (c) {
+    case ' ':
+    case '\t':
+    case '\r':
+    case '\n':
+    case '(':
+    case ')':
+    case '[':
+    case ']':
+    case '{':
+    case '}':
+    case ',':
+    case '=':
+    case '|':
+    case '"':
+        return true;
+    default:
+        return false;
+    }
+}
+
+
+static bool
+containsWord(const std::string &haystack, const std::string &needle, bool caseSensitive)
+{
+    if (caseSensitive) {
+        return haystack.find(needle) != std::string::npos;
+    }
+
+    // needle is expected to be in lower case already
+    size_t n = needle.size();
+    if (n > haystack.size()) {
+        return false;
+    }
+    size_t end = haystack.size() - n;
+    for (size_t i = 0; i <= end; ++i) {
+        size_t j = 0;
+        while (j < n && tolower((unsigned char)haystack[i + j]) == needle[j]) {
+            ++j;
+        }
+        if (j == n) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+static inline unsigned
+getTrigram(const char *s)
+{
+    return (unsigned)(unsigned char)tolower((unsigned char)s[0]) << 16 |
+           (unsigned)(unsigned char)tolower((unsigned char)s[1]) << 8 |
+           (unsigned)(unsigned char)tolower((unsigned char)s[2]);
+}
+
+
+static inline void
+writeVarUInt(std::string &buf, unsigned long long value)
+{
+    while (value >= 0x80) {
+        buf.push_back((char)(0x80 | (value & 0x7f)));
+        value >>= 7;
+    }
+    buf.push_back((char)value);
+}
+
+
+static inline bool
+readVarUInt(const char *&p, const char *end, unsigned long long &value)
+{
+    value = 0;
+    unsigned shift = 0;
+    while (p < end && shift < 64) {
+        unsigned char c = *p++;
+        value |= (unsigned long long)(c & 0x7f) << shift;
+        if (!(c & 0x80)) {
+            return true;
+        }
+        shift += 7;
+    }
+    return false;
+}
+
+
+class IndexVisitor : public Visitor
+{
+protected:
+    Index &index;
+    char buf[64];
+
+    void
+    addWord(const char *word) {
+        index.addWord(word);
+    }
+
+public:
+    IndexVisitor(Index &_index) :
+        index(_index)
+    {}
+
+    void visit(Null *) {
+        addWord("NULL");
+    }
+
+    void visit(Bool *node) {
+        addWord(node->value ? "true" : "false");
+    }
+
+    void visit(SInt *node) {
+        snprintf(buf, sizeof buf, "%lli", node->value);
+        addWord(buf);
+    }
+
+    void visit(UInt *node) {
+        snprintf(buf, sizeof buf, "%llu", node->value);
+        addWord(buf);
+    }
+
+    void visit(Float *node) {
+        snprintf(buf, sizeof buf, "%g", node->value);
+        addWord(buf);
+    }
+
+    void visit(Double *node) {
+        snprintf(buf, sizeof buf, "%g", node->value);
+        addWord(buf);
+    }
+
+    void visit(String *node) {
+        addWord(node->value);
+    }
+
+    void visit(Enum *node) {
+        const EnumValue *it = node->lookup();
+        if (it) {
+            addWord(it->name);
+        } else {
+            visit(static_cast<SInt *>(node));
+        }
+    }
+
+    void visit(Bitmask *node) {
+        const BitmaskSig *sig = node->sig;
+        unsigned long long value = node->value;
+        bool first = true;
+        for (const BitmaskFlag *it = sig->flags; it != sig->flags + sig->num_flags; ++it) {
+            if ((it->value && (value & it->value) == it->value) ||
+                (!it->value && value == 0)) {
+                addWord(it->name);
+                value &= ~it->value;
+                first = false;
+            }
+            if (value == 0) {
+                break;
+            }
+        }
+        if (value || first) {
+            snprintf(buf, sizeof buf, "0x%llx", value);
+            addWord(buf);
+        }
+    }
+
+    void visit(Struct *node) {
+        for (unsigned i = 0; i < node->members.size(); ++i) {
+            addWord(node->sig->member_names[i]);
+            _visit(node->members[i]);
+        }
+    }
+
+    void visit(Array *node) {
+        for (std::vector<Value *>::iterator it = node->values.begin(); it != node->values.end(); ++it) {
+            _visit(*it);
+        }
+    }
+
+    void visit(Blob *node) {
+        addWord("binary");
+        addWord("data");
+        addWord("size");
+        snprintf(buf, sizeof buf, "%lu", (unsigned long)node->size);
+        addWord(buf);
+    }
+
+    void visit(Pointer *node) {
+        if (node->value) {
+            snprintf(buf, sizeof buf, "0x%llx", node->value);
+            addWord(buf);
+        } else {
+            addWord("NULL");
+        }
+    }
+
+    void visit(Repr *node) {
+        _visit(node->humanValue);
+    }
+};
+
+
+Index::Index() :
+    trigramsValid(false),
+    currentCall(0)
+{
+}
+
+
+Index::~Index()
+{
+}
+
+
+void
+Index::clear(void)
+{
+    postings.clear();
+    sigPostings.clear();
+    vocabulary.clear();
+    trigrams.clear();
+    trigramsValid = false;
+    currentCall = 0;
+}
+
+
+Index::Posting *
+Index::getPosting(const std::string &word)
+{
+    trigramsValid = false;
+    return &postings[word];
+}
+
+
+void
+Index::addPosting(Posting *posting)
+{
+    if (posting->count && posting->last == currentCall) {
+        return;
+    }
+
+    // Calls from different threads may be slightly out of order, so encode
+    // signed deltas.
+    long long delta = (long long)currentCall - (long long)posting->last;
+    unsigned long long zigzag = delta < 0 ? ((unsigned long long)(-delta) << 1) - 1 : (unsigned long long)delta << 1;
+    writeVarUInt(posting->data, zigzag);
+
+    posting->last = currentCall;
+    ++posting->count;
+}
+
+
+void
+Index::addWord(const std::string &word)
+{
+    addPosting(getPosting(word));
+}
+
+
+void
+Index::add(Call *call)
+{
+    currentCall = call->no;
+
+    // The empty word lists every call
+    addWord(std::string());
+
+    const FunctionSig *sig = call->sig;
+    if (sig->id >= sigPostings.size()) {
+        sigPostings.resize(sig->id + 1);
+    }
+    std::vector<Posting *> &names = sigPostings[sig->id];
+    if (names.empty()) {
+        names.push_back(getPosting(sig->name));
+        for (unsigned i = 0; i < sig->num_args; ++i) {
+            names.push_back(getPosting(sig->arg_names[i]));
+        }
+    }
+    for (std::vector<Posting *>::iterator it = names.begin(); it != names.end(); ++it) {
+        addPosting(*it);
+    }
+
+    IndexVisitor visitor(*this);
+    for (std::vector<Arg>::iterator arg = call->args.begin(); arg != call->args.end(); ++arg) {
+        if (arg->value) {
+            arg->value->visit(visitor);
+        }
+    }
+    if (call->ret) {
+        call->ret->visit(visitor);
+    }
+}
+
+
+void
+Index::decode(const Posting &posting, std::vector<CallNo> &calls)
+{
+    const char *p = posting.data.data();
+    const char *end = p + posting.data.size();
+    CallNo callNo = 0;
+    unsigned long long zigzag;
+    while (readVarUInt(p, end, zigzag)) {
+        long long delta = zigzag & 1 ? -(long long)((zigzag + 1) >> 1) : (long long)(zigzag >> 1);
+        callNo = (CallNo)((long long)callNo + delta);
+        calls.push_back(callNo);
+    }
+}
+
+
+void
+Index::buildTrigrams(void) const
+{
+    vocabulary.clear();
+    trigrams.clear();
+
+    for (PostingMap::const_iterator it = postings.begin(); it != postings.end(); ++it) {
+        const std::string &word = it->first;
+        if (word.empty()) {
+            continue;
+        }
+        unsigned id = vocabulary.size();
+        vocabulary.push_back(&*it);
+        for (size_t i = 0; i + 3 <= word.size(); ++i) {
+            trigrams.push_back(Trigram(getTrigram(&word[i]), id));
+        }
+    }
+
+    std::sort(trigrams.begin(), trigrams.end());
+    trigrams.erase(std::unique(trigrams.begin(), trigrams.end()), trigrams.end());
+
+    trigramsValid = true;
+}
+
+
+/**
+ * Find the words of the vocabulary containing the needle.
+ */
+void
+Index::findWords(const std::string &needle, bool caseSensitive,
+                 std::vector<const PostingMap::value_type *> &words) const
+{
+    words.clear();
+
+    if (needle.size() < 3) {
+        for (PostingMap::const_iterator it = postings.begin(); it != postings.end(); ++it) {
+            if (!it->first.empty() &&
+                containsWord(it->first, needle, caseSensitive)) {
+                words.push_back(&*it);
+            }
+        }
+        return;
+    }
+
+    prepareLookups();
+
+    // Only the words having the needle's rarest trigram need to be checked
+    const std::vector<Trigram> &sorted = trigrams;
+    std::vector<Trigram>::const_iterator first = sorted.end();
+    std::vector<Trigram>::const_iterator last = sorted.end();
+    for (size_t i = 0; i + 3 <= needle.size(); ++i) {
+        unsigned trigram = getTrigram(&needle[i]);
+        std::vector<Trigram>::const_iterator lower =
+            std::lower_bound(sorted.begin(), sorted.end(), Trigram(trigram, 0));
+        std::vector<Trigram>::const_iterator upper =
+            std::upper_bound(lower, sorted.end(), Trigram(trigram, ~0U));
+        if (lower == upper) {
+            return;
+        }
+        if (first == sorted.end() || upper - lower < last - first) {
+            first = lower;
+            last = upper;
+        }
+    }
+
+    for (std::vector<Trigram>::const_iterator it = first; it != last; ++it) {
+        const PostingMap::value_type *word = vocabulary[it->second];
+        if (containsWord(word->first, needle, caseSensitive)) {
+            words.push_back(word);
+        }
+    }
+}
+
+
+bool
+Index::lookup(const char *text, bool caseSensitive,
+              std::vector<CallNo> &calls) const
+{
+    calls.clear();
+
+    // Split the text in words
+    std::vector<std::string> words;
+    bool delimited = false;
+    const char *p = text;
+    while (*p) {
+        while (*p && isDelimiter(*p)) {
+            delimited = true;
+            ++p;
+        }
+        const char *start = p;
+        while (*p && !isDelimiter(*p)) {
+            ++p;
+        }
+        if (p != start) {
+            std::string word(start, p);
+            if (!caseSensitive) {
+                std::transform(word.begin(), word.end(), word.begin(), ::tolower);
+            }
+            words.push_back(word);
+        }
+    }
+
+    if (words.empty()) {
+        PostingMap::const_iterator it = postings.find(std::string());
+        if (it != postings.end()) {
+            decode(it->second, calls);
+            std::sort(calls.begin(), calls.end());
+            calls.erase(std::unique(calls.begin(), calls.end()), calls.end());
+        }
+        return !delimited;
+    }
+
+    std::vector<const PostingMap::value_type *> matchingWords;
+    std::vector<CallNo> matches;
+    std::vector<CallNo> result;
+    for (unsigned i = 0; i < words.size(); ++i) {
+        findWords(words[i], caseSensitive, matchingWords);
+        matches.clear();
+        for (size_t j = 0; j < matchingWords.size(); ++j) {
+            decode(matchingWords[j]->second, matches);
+        }
+        std::sort(matches.begin(), matches.end());
+        matches.erase(std::unique(matches.begin(), matches.end()), matches.end());
+
+        if (i == 0) {
+            calls.swap(matches);
+        } else {
+            result.clear();
+            std::set_intersection(calls.begin(), calls.end(),
+                                  matches.begin(), matches.end(),
+                                  std::back_inserter(result));
+            calls.swap(result);
+        }
+        if (calls.empty()) {
+            break;
+        }
+    }
+
+    return calls.empty() || (!delimited && words.size() == 1);
+}
+
+
+bool
+Index::save(const char *filename,
+            unsigned long long traceSize,
+            unsigned long long traceTime) const
+{
+    std::ofstream stream(filename, std::ofstream::binary);
+    if (!stream.is_open()) {
+        return false;
+    }
+
+    std::string buf(INDEX_MAGIC);
+    writeVarUInt(buf, INDEX_VERSION);
+    writeVarUInt(buf, traceSize);
+    writeVarUInt(buf, traceTime);
+    writeVarUInt(buf, postings.size());
+    stream.write(buf.data(), buf.size());
+
+    for (PostingMap::const_iterator it = postings.begin(); it != postings.end(); ++it) {
+        const Posting &posting = it->second;
+        buf.clear();
+        writeVarUInt(buf, it->first.size());
+        buf.append(it->first);
+        writeVarUInt(buf, posting.last);
+        writeVarUInt(buf, posting.count);
+        writeVarUInt(buf, posting.data.size());
+        stream.write(buf.data(), buf.size());
+        stream.write(posting.data.data(), posting.data.size());
+    }
+
+    stream.close();
+    return !stream.fail();
+}
+
+
+bool
+Index::load(const char *filename,
+            unsigned long long traceSize,
+            unsigned long long traceTime)
+{
+    clear();
+
+    std::ifstream stream(filename, std::ifstream::binary);
+    if (!stream.is_open()) {
+        return false;
+    }
+    std::string contents;
+    stream.seekg(0, std::ifstream::end);
+    std::streamoff size = stream.tellg();
+    stream.seekg(0, std::ifstream::beg);
+    if (size <= 0) {
+        return false;
+    }
+    contents.resize(size);
+    stream.read(&contents[0], size);
+    if (stream.gcount() != size) {
+        return false;
+    }
+
+    const char *p = contents.data();
+    const char *end = p + contents.size();
+    size_t magicSize = strlen(INDEX_MAGIC);
+    if (contents.compare(0, magicSize, INDEX_MAGIC) != 0) {
+        return false;
+    }
+    p += magicSize;
+
+    unsigned long long version, indexedSize, indexedTime, count;
+    if (!readVarUInt(p, end, version) || version != INDEX_VERSION ||
+        !readVarUInt(p, end, indexedSize) || indexedSize != traceSize ||
+        !readVarUInt(p, end, indexedTime) || indexedTime != traceTime ||
+        !readVarUInt(p, end, count)) {
+        return false;
+    }
+
+    for (unsigned long long i = 0; i < count; ++i) {
+        unsigned long long length, last, calls, dataSize;
+        if (!readVarUInt(p, end, length) ||
+            (unsigned long long)(end - p) < length) {
+            clear();
+            return false;
+        }
+        Posting &posting = postings[std::string(p, length)];
+        p += length;
+        if (!readVarUInt(p, end, last) ||
+            !readVarUInt(p, end, calls) ||
+            !readVarUInt(p, end, dataSize) ||
+            (unsigned long long)(end - p) < dataSize) {
+            clear();
+            return false;
+        }
+        posting.last = last;
+        posting.count = calls;
+        posting.data.assign(p, dataSize);
+        p += dataSize;
+    }
+
+    return true;
+}
+
+
+} /* namespace trace */
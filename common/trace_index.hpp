@@ -0,0 +1,165 @@
+/**************************************************************************
+ *
+ * Copyright 2014 VMware, Inc.
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ **************************************************************************/
+
+/*
+ * Inverted index of the words appearing in a trace's calls, for fast
+ * full-text search.
+ *
+ * The words are the function and argument names, enum and bitmask flag
+ * names, integers, floats, pointers and strings -- that is, roughly the
+ * vocabulary of the calls' textual representation.  Each word maps to a
+ * posting list with the numbers of the calls it appears in, kept as
+ * variable length encoded deltas.
+ */
+
+#ifndef _TRACE_INDEX_HPP_
+#define _TRACE_INDEX_HPP_
+
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "trace_model.hpp"
+
+
+namespace trace {
+
+
+class Index
+{
+public:
+    Index();
+    ~Index();
+
+    void
+    clear(void);
+
+    /**
+     * Add the words of the given call.
+     */
+    void
+    add(Call *call);
+
+    /**
+     * Number of distinct words.
+     */
+    size_t
+    size(void) const {
+        return postings.size();
+    }
+
+    /**
+     * Find the calls whose text may contain the given string.
+     *
+     * The string is split in words, and a call matches when each word is a
+     * substring of some word of the call.  The result is a superset of the
+     * calls containing the exact string, sorted in ascending order.  Returns
+     * whether it is exact, i.e., the string is a single word.
+     *
+     * Words of three characters or more are looked up through the trigrams
+     * of the vocabulary, which are built on the first lookup after the index
+     * changed.  Hence lookups must not run concurrently.
+     */
+    bool
+    lookup(const char *text, bool caseSensitive,
+           std::vector<CallNo> &calls) const;
+
+    /**
+     * Build the trigrams now rather than on the first lookup.
+     */
+    void
+    prepareLookups(void) const {
+        if (!trigramsValid) {
+            buildTrigrams();
+        }
+    }
+
+    /**
+     * Save/load the index to/from a file.  The size and modification time
+     * (in any unit) of the indexed trace are recorded too, so that stale
+     * indices are not used.
+     */
+    bool
+    save(const char *filename,
+         unsigned long long traceSize,
+         unsigned long long traceTime) const;
+
+    bool
+    load(const char *filename,
+         unsigned long long traceSize,
+         unsigned long long traceTime);
+
+private:
+    struct Posting {
+        Posting() : last(0), count(0) {}
+
+        std::string data;
+        CallNo last;
+        unsigned count;
+    };
+
+    typedef std::map<std::string, Posting> PostingMap;
+    PostingMap postings;
+
+    // Postings of function and argument names, per signature id
+    std::vector< std::vector<Posting *> > sigPostings;
+
+    // Words of the vocabulary, and (trigram, word) pairs of their lower case
+    // versions, sorted
+    typedef std::pair<unsigned, unsigned> Trigram;
+    mutable std::vector<const PostingMap::value_type *> vocabulary;
+    mutable std::vector<Trigram> trigrams;
+    mutable bool trigramsValid;
+
+    CallNo currentCall;
+
+    friend class IndexVisitor;
+
+    Posting *
+    getPosting(const std::string &word);
+
+    void
+    addWord(const std::string &word);
+
+    void
+    addPosting(Posting *posting);
+
+    void
+    buildTrigrams(void) const;
+
+    void
+    findWords(const std::string &needle, bool caseSensitive,
+              std::vector<const PostingMap::value_type *> &words) const;
+
+    static void
+    decode(const Posting &posting, std::vector<CallNo> &calls);
+};
+
+
+} /* namespace trace */
+
+
+#endif /* _TRACE_INDEX_HPP_ */
@@ -1,3 +1,5 @@
+#include <string.h>
+
 #include "trace_loader.hpp"
 
 
@@ -91,20 +93,20 @@ void Loader::close()
 
 bool Loader::isCallAFrameMarker(const trace::Call *call) const
 {
-    std::string name = call->name();
+    const char *name = call->name();
 
     switch (m_frameMarker) {
     case FrameMarker_SwapBuffers:
         return call->flags & trace::CALL_FLAG_END_FRAME;
         break;
     case FrameMarker_Flush:
-        return name == "glFlush";
+        return strcmp(name, "glFlush") == 0;
         break;
     case FrameMarker_Finish:
-        return name == "glFinish";
+        return strcmp(name, "glFinish") == 0;
         break;
     case FrameMarker_Clear:
-        return name == "glClear";
+        return strcmp(name, "glClear") == 0;
         break;
     }
     return false;
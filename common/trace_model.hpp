@@ -100,6 +100,24 @@ class Array;
 class Value
 {
 public:
+    /**
+     * Concrete representation of the value, so that hot paths (such as the
+     * generated retrace code) can read scalars and arrays without going
+     * through virtual calls.  See the trace::toSInt() & co helpers below.
+     */
+    enum Kind {
+        KIND_OTHER = 0,
+        KIND_NULL,
+        KIND_SINT,
+        KIND_UINT,
+        KIND_FLOAT,
+        KIND_DOUBLE,
+        KIND_ARRAY
+    };
+
+    unsigned char kind;
+
+    Value(Kind _kind = KIND_OTHER) : kind(_kind) {}
     virtual ~Value() {}
     virtual void visit(Visitor &visitor) = 0;
 
@@ -130,6 +148,8 @@ public:
 class Null : public Value
 {
 public:
+    Null() : Value(KIND_NULL) {}
+
     bool toBool(void) const;
     signed long long toSInt(void) const;
     unsigned long long toUInt(void) const;
@@ -165,7 +185,7 @@ public:
 class SInt : public Value
 {
 public:
-    SInt(signed long long _value) : value(_value) {}
+    SInt(signed long long _value) : Value(KIND_SINT), value(_value) {}
 
     bool toBool(void) const;
     signed long long toSInt(void) const;
@@ -181,7 +201,7 @@ public:
 class UInt : public Value
 {
 public:
-    UInt(unsigned long long _value) : value(_value) {}
+    UInt(unsigned long long _value) : Value(KIND_UINT), value(_value) {}
 
     bool toBool(void) const;
     signed long long toSInt(void) const;
@@ -197,7 +217,7 @@ public:
 class Float : public Value
 {
 public:
-    Float(float _value) : value(_value) {}
+    Float(float _value) : Value(KIND_FLOAT), value(_value) {}
 
     bool toBool(void) const;
     signed long long toSInt(void) const;
@@ -213,7 +233,7 @@ public:
 class Double : public Value
 {
 public:
-    Double(double _value) : value(_value) {}
+    Double(double _value) : Value(KIND_DOUBLE), value(_value) {}
 
     bool toBool(void) const;
     signed long long toSInt(void) const;
@@ -293,7 +313,7 @@ public:
 class Array : public Value
 {
 public:
-    Array(size_t len) : values(len) {}
+    Array(size_t len) : Value(KIND_ARRAY), values(len) {}
     ~Array();
 
     bool toBool(void) const;
@@ -374,6 +394,60 @@ public:
     void visit(Visitor &visitor);
 };
 
+
+/*
+ * Non-virtual conversions for when the expected type is known statically,
+ * which is the common case when retracing.  They read the concrete value
+ * directly when the encoded type matches, and fall back to the virtual
+ * conversions otherwise.
+ */
+
+inline signed long long
+toSInt(const Value &value) {
+    if (value.kind == Value::KIND_SINT) {
+        return static_cast<const SInt &>(value).value;
+    }
+    return value.toSInt();
+}
+
+inline unsigned long long
+toUInt(const Value &value) {
+    if (value.kind == Value::KIND_UINT) {
+        return static_cast<const UInt &>(value).value;
+    }
+    return value.toUInt();
+}
+
+inline float
+toFloat(const Value &value) {
+    if (value.kind == Value::KIND_FLOAT) {
+        return static_cast<const Float &>(value).value;
+    }
+    return value.toFloat();
+}
+
+inline double
+toDouble(const Value &value) {
+    if (value.kind == Value::KIND_DOUBLE) {
+        return static_cast<const Double &>(value).value;
+    }
+    return value.toDouble();
+}
+
+inline bool
+toBool(const Value &value) {
+    return value.toBool();
+}
+
+inline const Array *
+toArray(const Value &value) {
+    if (value.kind == Value::KIND_ARRAY) {
+        return static_cast<const Array *>(&value);
+    }
+    return NULL;
+}
+
+
 struct RawStackFrame {
     Id id;
     const char * module;
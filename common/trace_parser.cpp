@@ -42,11 +42,15 @@ namespace trace {
 
 Parser::Parser() {
     file = NULL;
+    callFilter = NULL;
     next_call_no = 0;
+    last_complete_call_no = ~0U;
+    truncation_reported = false;
     version = 0;
     api = API_UNKNOWN;
 
     glGetErrorSig = NULL;
+    segmented = false;
 }
 
 
@@ -70,6 +74,9 @@ bool Parser::open(const char *filename) {
         return false;
     }
     api = API_UNKNOWN;
+    last_complete_call_no = ~0U;
+    truncation_reported = false;
+    segmented = false;
 
     return true;
 }
@@ -161,12 +168,14 @@ void Parser::close(void) {
 void Parser::getBookmark(ParseBookmark &bookmark) {
     bookmark.offset = file->currentOffset();
     bookmark.next_call_no = next_call_no;
+    bookmark.segmented = segmented;
 }
 
 
 void Parser::setBookmark(const ParseBookmark &bookmark) {
     file->setCurrentOffset(bookmark.offset);
     next_call_no = bookmark.next_call_no;
+    segmented = bookmark.segmented;
     
     // Simply ignore all pending calls
     deleteAll(calls);
@@ -191,13 +200,33 @@ Call *Parser::parse_call(Mode mode) {
             call = parse_leave(mode);
             if (call) {
                 adjust_call_flags(call);
+                last_complete_call_no = call->no;
                 return call;
             }
             break;
+        case trace::EVENT_SEGMENT:
+#if TRACE_VERBOSE
+            std::cerr << "\tSEGMENT\n";
+#endif
+            parse_segment();
+            break;
         default:
             std::cerr << "error: unknown event " << c << "\n";
             exit(1);
         case -1:
+            if (file->isTruncated() && !truncation_reported) {
+                /* The tail of the file is unusable, most likely because the
+                 * traced process was killed while writing it.  Everything
+                 * before it is still good.
+                 */
+                if (last_complete_call_no != ~0U) {
+                    std::cerr << "warning: trace is truncated; last complete call is "
+                              << last_complete_call_no << "\n";
+                } else {
+                    std::cerr << "warning: trace is truncated; no complete calls\n";
+                }
+                truncation_reported = true;
+            }
             if (!calls.empty()) {
                 call = calls.front();
                 call->flags |= CALL_FLAG_INCOMPLETE;
@@ -225,11 +254,44 @@ T *lookup(std::vector<T *> &map, size_t index) {
 }
 
 
+void Parser::parse_segment(void) {
+    next_call_no = read_uint();
+    segmented = true;
+}
+
+
+/**
+ * Read a signature id and look it up.  When the signature is known, sets
+ * redefined if its definition follows nonetheless, as happens when reparsing
+ * or on its first use in a new segment.
+ */
+template <class T>
+T *Parser::lookup_sig(std::vector<T *> &map, size_t &id, bool &redefined) {
+    id = read_uint();
+
+    bool definition = false;
+    if (segmented) {
+        definition = id & 1;
+        id >>= 1;
+    }
+
+    T *sig = lookup(map, id);
+    if (sig) {
+        if (segmented) {
+            redefined = definition;
+        } else {
+            redefined = file->currentOffset() < sig->fileOffset;
+        }
+    }
+    return sig;
+}
+
+
 Parser::FunctionSigFlags *
 Parser::parse_function_sig(void) {
-    size_t id = read_uint();
-
-    FunctionSigState *sig = lookup(functions, id);
+    size_t id;
+    bool redefined = false;
+    FunctionSigState *sig = lookup_sig(functions, id, redefined);
 
     if (!sig) {
         /* parse the signature */
@@ -281,7 +343,7 @@ Parser::parse_function_sig(void) {
             glGetErrorSig = sig;
         }
 
-    } else if (file->currentOffset() < sig->fileOffset) {
+    } else if (redefined) {
         /* skip over the signature */
         skip_string(); /* name */
         unsigned num_args = read_uint();
@@ -296,9 +358,9 @@ Parser::parse_function_sig(void) {
 
 
 StructSig *Parser::parse_struct_sig() {
-    size_t id = read_uint();
-
-    StructSigState *sig = lookup(structs, id);
+    size_t id;
+    bool redefined = false;
+    StructSigState *sig = lookup_sig(structs, id, redefined);
 
     if (!sig) {
         /* parse the signature */
@@ -313,7 +375,7 @@ StructSig *Parser::parse_struct_sig() {
         sig->member_names = member_names;
         sig->fileOffset = file->currentOffset();
         structs[id] = sig;
-    } else if (file->currentOffset() < sig->fileOffset) {
+    } else if (redefined) {
         /* skip over the signature */
         skip_string(); /* name */
         unsigned num_members = read_uint();
@@ -334,9 +396,9 @@ StructSig *Parser::parse_struct_sig() {
  *            | id
  */
 EnumSig *Parser::parse_old_enum_sig() {
-    size_t id = read_uint();
-
-    EnumSigState *sig = lookup(enums, id);
+    size_t id;
+    bool redefined = false;
+    EnumSigState *sig = lookup_sig(enums, id, redefined);
 
     if (!sig) {
         /* parse the signature */
@@ -349,7 +411,7 @@ EnumSig *Parser::parse_old_enum_sig() {
         sig->values = values;
         sig->fileOffset = file->currentOffset();
         enums[id] = sig;
-    } else if (file->currentOffset() < sig->fileOffset) {
+    } else if (redefined) {
         /* skip over the signature */
         skip_string(); /*name*/
         scan_value();
@@ -361,9 +423,9 @@ EnumSig *Parser::parse_old_enum_sig() {
 
 
 EnumSig *Parser::parse_enum_sig() {
-    size_t id = read_uint();
-
-    EnumSigState *sig = lookup(enums, id);
+    size_t id;
+    bool redefined = false;
+    EnumSigState *sig = lookup_sig(enums, id, redefined);
 
     if (!sig) {
         /* parse the signature */
@@ -378,7 +440,7 @@ EnumSig *Parser::parse_enum_sig() {
         sig->values = values;
         sig->fileOffset = file->currentOffset();
         enums[id] = sig;
-    } else if (file->currentOffset() < sig->fileOffset) {
+    } else if (redefined) {
         /* skip over the signature */
         int num_values = read_uint();
         for (int i = 0; i < num_values; ++i) {
@@ -393,9 +455,9 @@ EnumSig *Parser::parse_enum_sig() {
 
 
 BitmaskSig *Parser::parse_bitmask_sig() {
-    size_t id = read_uint();
-
-    BitmaskSigState *sig = lookup(bitmasks, id);
+    size_t id;
+    bool redefined = false;
+    BitmaskSigState *sig = lookup_sig(bitmasks, id, redefined);
 
     if (!sig) {
         /* parse the signature */
@@ -413,7 +475,7 @@ BitmaskSig *Parser::parse_bitmask_sig() {
         sig->flags = flags;
         sig->fileOffset = file->currentOffset();
         bitmasks[id] = sig;
-    } else if (file->currentOffset() < sig->fileOffset) {
+    } else if (redefined) {
         /* skip over the signature */
         int num_flags = read_uint();
         for (int i = 0; i < num_flags; ++i) {
@@ -442,6 +504,10 @@ void Parser::parse_enter(Mode mode) {
 
     call->no = next_call_no++;
 
+    if (mode == FULL && callFilter && !callFilter->contains(*call)) {
+        mode = SCAN;
+    }
+
     if (parse_call_details(call, mode)) {
         calls.push_back(call);
     } else {
@@ -472,6 +538,10 @@ Call *Parser::parse_leave(Mode mode) {
         return NULL;
     }
 
+    if (mode == FULL && callFilter && !callFilter->contains(*call)) {
+        mode = SCAN;
+    }
+
     if (parse_call_details(call, mode)) {
         return call;
     } else {
@@ -529,9 +599,9 @@ bool Parser::parse_call_backtrace(Call *call, Mode mode) {
 }
 
 StackFrame * Parser::parse_backtrace_frame(Mode mode) {
-    size_t id = read_uint();
-
-    StackFrameState *frame = lookup(frames, id);
+    size_t id;
+    bool redefined = false;
+    StackFrameState *frame = lookup_sig(frames, id, redefined);
 
     if (!frame) {
         frame = new StackFrameState;
@@ -564,7 +634,7 @@ StackFrame * Parser::parse_backtrace_frame(Mode mode) {
 
         frame->fileOffset = file->currentOffset();
         frames[id] = frame;
-    } else if (file->currentOffset() < frame->fileOffset) {
+    } else if (redefined) {
         int c = read_byte();
         while (c != trace::BACKTRACE_END &&
                c != -1) {
@@ -43,6 +43,24 @@ struct ParseBookmark
 {
     File::Offset offset;
     unsigned next_call_no;
+    bool segmented;
+};
+
+
+/**
+ * Selects which calls the parser should decode in full.
+ */
+class CallFilter
+{
+public:
+    virtual ~CallFilter() {}
+
+    /**
+     * Invoked before the call arguments are parsed, when only the call
+     * number, thread, signature and signature flags are known.  It must give
+     * the same answer every time it is asked about the same call.
+     */
+    virtual bool contains(const Call &call) const = 0;
 };
 
 
@@ -51,6 +69,8 @@ class Parser
 protected:
     File *file;
 
+    const CallFilter *callFilter;
+
     enum Mode {
         FULL = 0,
         SCAN,
@@ -94,8 +114,21 @@ protected:
 
     FunctionSig *glGetErrorSig;
 
+    /**
+     * Whether a segment event was seen, after which signature ids tell
+     * whether their definition follows.
+     */
+    bool segmented;
+
     unsigned next_call_no;
 
+    /**
+     * Number of the last call whose leave event was completely parsed, used
+     * to report how far a truncated trace could be recovered.
+     */
+    unsigned last_complete_call_no;
+    bool truncation_reported;
+
 public:
     unsigned long long version;
     API api;
@@ -130,17 +163,35 @@ public:
         return parse_call(SCAN);
     }
 
+    /**
+     * Only fully parse the calls accepted by the given filter (or all, when
+     * NULL).  parse_call() still returns the remaining calls, but without
+     * arguments or return value, as scan_call() does, which is much cheaper
+     * than constructing their values.
+     */
+    void setCallFilter(const CallFilter *filter) {
+        callFilter = filter;
+    }
+
+    /**
+     * Flags of the calls to the named function.
+     */
+    static CallFlags
+    lookupCallFlags(const char *name);
+
 protected:
     Call *parse_call(Mode mode);
 
+    void parse_segment(void);
+
+    template <class T>
+    T *lookup_sig(std::vector<T *> &map, size_t &id, bool &redefined);
+
     FunctionSigFlags *parse_function_sig(void);
     StructSig *parse_struct_sig();
     EnumSig *parse_old_enum_sig();
     EnumSig *parse_enum_sig();
     BitmaskSig *parse_bitmask_sig();
-    
-    static CallFlags
-    lookupCallFlags(const char *name);
 
     Call *parse_Call(Mode mode);
 
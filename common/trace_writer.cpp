@@ -39,8 +39,19 @@
 namespace trace {
 
 
+/*
+ * Writes up to this size are copied into the reserved span; larger ones are
+ * handed over to the file directly.
+ */
+#define WRITER_INLINE_MAX 4096
+
+
 Writer::Writer() :
-    call_no(0)
+    call_no(0),
+    m_reserveStart(NULL),
+    m_reservePtr(NULL),
+    m_reserveEnd(NULL),
+    m_segmented(false)
 {
     m_file = File::createSnappy();
     close();
@@ -55,11 +66,12 @@ Writer::~Writer()
 
 void
 Writer::close(void) {
+    _commit();
     m_file->close();
 }
 
 bool
-Writer::open(const char *filename) {
+Writer::open(const char *filename, bool segmented) {
     close();
 
     if (!m_file->open(filename, File::Write)) {
@@ -72,51 +84,92 @@ Writer::open(const char *filename) {
     enums.clear();
     bitmasks.clear();
     frames.clear();
+    m_segmented = false;
 
-    _writeUInt(TRACE_VERSION);
+    _writeUInt(segmented ? TRACE_VERSION : TRACE_VERSION_UNSEGMENTED);
+    _commit();
 
     return true;
 }
 
+/**
+ * Ensure there are at least length bytes left in the reserved span.
+ */
+void inline
+Writer::_reserve(size_t length) {
+    if (size_t(m_reserveEnd - m_reservePtr) < length) {
+        _reserveSlow(length);
+    }
+}
+
+void
+Writer::_reserveSlow(size_t length) {
+    _commit();
+    size_t available = 0;
+    m_reserveStart = m_file->reserve(length, available);
+    m_reservePtr = m_reserveStart;
+    m_reserveEnd = m_reserveStart + available;
+}
+
+/**
+ * Hand everything encoded so far over to the file.
+ */
+void
+Writer::_commit(void) {
+    if (m_reserveStart) {
+        m_file->commit(m_reservePtr - m_reserveStart);
+        m_reserveStart = NULL;
+        m_reservePtr = NULL;
+        m_reserveEnd = NULL;
+    }
+}
+
 void inline
 Writer::_write(const void *sBuffer, size_t dwBytesToWrite) {
-    m_file->write(sBuffer, dwBytesToWrite);
+    if (dwBytesToWrite <= WRITER_INLINE_MAX) {
+        _reserve(dwBytesToWrite);
+        memcpy(m_reservePtr, sBuffer, dwBytesToWrite);
+        m_reservePtr += dwBytesToWrite;
+    } else {
+        _commit();
+        m_file->write(sBuffer, dwBytesToWrite);
+    }
 }
 
 void inline
 Writer::_writeByte(char c) {
-    _write(&c, 1);
+    _reserve(1);
+    *m_reservePtr++ = c;
 }
 
 void inline
 Writer::_writeUInt(unsigned long long value) {
-    char buf[2 * sizeof value];
-    unsigned len;
+    _reserve(2 * sizeof value);
 
-    len = 0;
-    do {
-        assert(len < sizeof buf);
-        buf[len] = 0x80 | (value & 0x7f);
+    char *ptr = m_reservePtr;
+    while (value >= 0x80) {
+        *ptr++ = 0x80 | (value & 0x7f);
         value >>= 7;
-        ++len;
-    } while (value);
-
-    assert(len);
-    buf[len - 1] &= 0x7f;
+    }
+    *ptr++ = value;
 
-    _write(buf, len);
+    m_reservePtr = ptr;
 }
 
 void inline
 Writer::_writeFloat(float value) {
     assert(sizeof value == 4);
-    _write((const char *)&value, sizeof value);
+    _reserve(sizeof value);
+    memcpy(m_reservePtr, &value, sizeof value);
+    m_reservePtr += sizeof value;
 }
 
 void inline
 Writer::_writeDouble(double value) {
     assert(sizeof value == 8);
-    _write((const char *)&value, sizeof value);
+    _reserve(sizeof value);
+    memcpy(m_reservePtr, &value, sizeof value);
+    m_reservePtr += sizeof value;
 }
 
 void inline
@@ -135,6 +188,39 @@ inline bool lookup(std::vector<bool> &map, size_t index) {
     }
 }
 
+/**
+ * Write a signature id, returning whether its definition must follow.
+ */
+bool inline
+Writer::_writeSigId(std::vector<bool> &map, size_t id) {
+    bool definition = !lookup(map, id);
+    if (m_segmented) {
+        _writeUInt((id << 1) | definition);
+    } else {
+        _writeUInt(id);
+    }
+    if (definition) {
+        map[id] = true;
+    }
+    return definition;
+}
+
+void Writer::beginSegment(bool endOfFrame) {
+    _commit();
+    m_file->markSegment(endOfFrame);
+
+    _writeByte(trace::EVENT_SEGMENT);
+    _writeUInt(call_no);
+    _commit();
+
+    functions.clear();
+    structs.clear();
+    enums.clear();
+    bitmasks.clear();
+    frames.clear();
+    m_segmented = true;
+}
+
 void Writer::beginBacktrace(unsigned num_frames) {
     if (num_frames) {
         _writeByte(trace::CALL_BACKTRACE);
@@ -143,8 +229,7 @@ void Writer::beginBacktrace(unsigned num_frames) {
 }
 
 void Writer::writeStackFrame(const RawStackFrame *frame) {
-    _writeUInt(frame->id);
-    if (!lookup(frames, frame->id)) {
+    if (_writeSigId(frames, frame->id)) {
         if (frame->module != NULL) {
             _writeByte(trace::BACKTRACE_MODULE);
             _writeString(frame->module);
@@ -166,21 +251,18 @@ void Writer::writeStackFrame(const RawStackFrame *frame) {
             _writeUInt(frame->offset);
         }
         _writeByte(trace::BACKTRACE_END);
-        frames[frame->id] = true;
     }
 }
 
 unsigned Writer::beginEnter(const FunctionSig *sig, unsigned thread_id) {
     _writeByte(trace::EVENT_ENTER);
     _writeUInt(thread_id);
-    _writeUInt(sig->id);
-    if (!lookup(functions, sig->id)) {
+    if (_writeSigId(functions, sig->id)) {
         _writeString(sig->name);
         _writeUInt(sig->num_args);
         for (unsigned i = 0; i < sig->num_args; ++i) {
             _writeString(sig->arg_names[i]);
         }
-        functions[sig->id] = true;
     }
 
     return call_no++;
@@ -188,6 +270,7 @@ unsigned Writer::beginEnter(const FunctionSig *sig, unsigned thread_id) {
 
 void Writer::endEnter(void) {
     _writeByte(trace::CALL_END);
+    _commit();
 }
 
 void Writer::beginLeave(unsigned call) {
@@ -197,6 +280,7 @@ void Writer::beginLeave(unsigned call) {
 
 void Writer::endLeave(void) {
     _writeByte(trace::CALL_END);
+    _commit();
 }
 
 void Writer::beginArg(unsigned index) {
@@ -215,14 +299,12 @@ void Writer::beginArray(size_t length) {
 
 void Writer::beginStruct(const StructSig *sig) {
     _writeByte(trace::TYPE_STRUCT);
-    _writeUInt(sig->id);
-    if (!lookup(structs, sig->id)) {
+    if (_writeSigId(structs, sig->id)) {
         _writeString(sig->name);
         _writeUInt(sig->num_members);
         for (unsigned i = 0; i < sig->num_members; ++i) {
             _writeString(sig->member_names[i]);
         }
-        structs[sig->id] = true;
     }
 }
 
@@ -301,22 +383,19 @@ void Writer::writeBlob(const void *data, size_t size) {
 
 void Writer::writeEnum(const EnumSig *sig, signed long long value) {
     _writeByte(trace::TYPE_ENUM);
-    _writeUInt(sig->id);
-    if (!lookup(enums, sig->id)) {
+    if (_writeSigId(enums, sig->id)) {
         _writeUInt(sig->num_values);
         for (unsigned i = 0; i < sig->num_values; ++i) {
             _writeString(sig->values[i].name);
             writeSInt(sig->values[i].value);
         }
-        enums[sig->id] = true;
     }
     writeSInt(value);
 }
 
 void Writer::writeBitmask(const BitmaskSig *sig, unsigned long long value) {
     _writeByte(trace::TYPE_BITMASK);
-    _writeUInt(sig->id);
-    if (!lookup(bitmasks, sig->id)) {
+    if (_writeSigId(bitmasks, sig->id)) {
         _writeUInt(sig->num_flags);
         for (unsigned i = 0; i < sig->num_flags; ++i) {
             if (i != 0 && sig->flags[i].value == 0) {
@@ -325,7 +404,6 @@ void Writer::writeBitmask(const BitmaskSig *sig, unsigned long long value) {
             _writeString(sig->flags[i].name);
             _writeUInt(sig->flags[i].value);
         }
-        bitmasks[sig->id] = true;
     }
     _writeUInt(value);
 }
@@ -45,19 +45,42 @@ namespace trace {
         File *m_file;
         unsigned call_no;
 
+        /*
+         * Span reserved from m_file, which calls are encoded into directly and
+         * committed once complete.
+         */
+        char *m_reserveStart;
+        char *m_reservePtr;
+        char *m_reserveEnd;
+
         std::vector<bool> functions;
         std::vector<bool> structs;
         std::vector<bool> enums;
         std::vector<bool> bitmasks;
         std::vector<bool> frames;
 
+        // Whether beginSegment() was called since the trace was opened
+        bool m_segmented;
+
     public:
         Writer();
         ~Writer();
 
-        bool open(const char *filename);
+        /**
+         * Only traces opened as segmented may have segments, and get the
+         * format version which supports them.
+         */
+        bool open(const char *filename, bool segmented = false);
         void close(void);
 
+        /**
+         * Start a self-contained segment, which doesn't depend on anything
+         * written before it, so that what precedes it may be dropped.  Must be
+         * called between calls.  endOfFrame tells whether the previous segment
+         * ended with a frame.
+         */
+        void beginSegment(bool endOfFrame = false);
+
         unsigned beginEnter(const FunctionSig *sig, unsigned thread_id);
         void endEnter(void);
 
@@ -103,12 +126,16 @@ namespace trace {
         void writeCall(Call *call);
 
     protected:
+        void inline _reserve(size_t length);
+        void _reserveSlow(size_t length);
+        void _commit(void);
         void inline _write(const void *sBuffer, size_t dwBytesToWrite);
         void inline _writeByte(char c);
         void inline _writeUInt(unsigned long long value);
         void inline _writeFloat(float value);
         void inline _writeDouble(double value);
         void inline _writeString(const char *str);
+        bool inline _writeSigId(std::vector<bool> &map, size_t id);
 
     };
 
@@ -33,7 +33,9 @@
 #include "os.hpp"
 #include "os_thread.hpp"
 #include "os_string.hpp"
+#include "os_time.hpp"
 #include "trace_file.hpp"
+#include "trace_parser.hpp"
 #include "trace_writer_local.hpp"
 #include "trace_format.hpp"
 #include "os_backtrace.hpp"
@@ -55,6 +57,14 @@ static const char *realloc_args[2] = {"ptr", "size"};
 const FunctionSig realloc_sig = {3, "realloc", 2, realloc_args};
 
 
+/*
+ * Frames longer than this many calls are split into several flight recorder
+ * segments, so that TRACE_RING_SIZE can drop them piecemeal, namely in traces
+ * with no frames at all.  TRACE_RING_FRAMES still counts whole frames.
+ */
+#define RING_MAX_SEGMENT_CALLS 65536
+
+
 static void exceptionCallback(void)
 {
     localWriter.flush();
@@ -62,10 +72,27 @@ static void exceptionCallback(void)
 
 
 LocalWriter::LocalWriter() :
-    acquired(0)
+    acquired(0),
+    flushInterval(0),
+    flushSize(0),
+    lastFlushTime(0),
+    ringSize(0),
+    ringFrames(0),
+    ringFrameEnd(~0U),
+    ringSegmentDue(false),
+    ringSegmentCalls(0),
+    startFrame(0),
+    skippedFrames(0),
+    capturing(true)
 {
     os::log("apitrace: loaded\n");
 
+    const char *start_frame = getenv("TRACE_START_FRAME");
+    if (start_frame) {
+        startFrame = strtoul(start_frame, NULL, 0);
+        capturing = startFrame == 0;
+    }
+
     // Install the signal handlers as early as possible, to prevent
     // interfering with the application's signal handling.
     os::setExceptionCallback(exceptionCallback);
@@ -121,19 +148,65 @@ LocalWriter::open(void) {
 
     os::log("apitrace: tracing to %s\n", lpFileName);
 
-    if (!Writer::open(lpFileName)) {
+    const char *ring_size = getenv("TRACE_RING_SIZE");
+    if (ring_size) {
+        ringSize = strtoul(ring_size, NULL, 0);
+    }
+    const char *ring_frames = getenv("TRACE_RING_FRAMES");
+    if (ring_frames) {
+        ringFrames = strtoul(ring_frames, NULL, 0);
+    }
+    if (ringSize || ringFrames) {
+        // Nothing was written to the current file yet
+        delete m_file;
+        m_file = File::createSnappyRing(ringSize, ringFrames);
+        os::log("apitrace: flight recorder enabled\n");
+    }
+
+    if (!Writer::open(lpFileName, ringSize || ringFrames)) {
         os::log("apitrace: error: failed to open %s\n", lpFileName);
         os::abort();
     }
 
+    if (ringSize || ringFrames) {
+        beginSegment();
+        ringFrameEnd = ~0U;
+        ringSegmentDue = false;
+        ringSegmentCalls = 0;
+    }
+
     pid = os::getCurrentProcessId();
 
+    // Note that getTime() must be called before using timeFrequency, as
+    // the latter is lazily initialized on some platforms.
+    lastFlushTime = os::getTime();
+    const char *interval = getenv("TRACE_FLUSH_INTERVAL");
+    if (interval && !ringSize && !ringFrames) {
+        flushInterval = atoll(interval) * os::timeFrequency / 1000;
+    }
+    const char *size = getenv("TRACE_FLUSH_SIZE");
+    if (size && !ringSize && !ringFrames) {
+        flushSize = strtoul(size, NULL, 0);
+    }
+
 #if 0
     // For debugging the exception handler
     *((int *)0) = 0;
 #endif
 }
 
+bool LocalWriter::isFrameEnd(const FunctionSig *sig) {
+    if (sig->id >= frameEndSigs.size()) {
+        frameEndSigs.resize(sig->id + 1);
+    }
+    unsigned char &frameEnd = frameEndSigs[sig->id];
+    if (!frameEnd) {
+        CallFlags flags = Parser::lookupCallFlags(sig->name);
+        frameEnd = flags & CALL_FLAG_END_FRAME ? 2 : 1;
+    }
+    return frameEnd == 2;
+}
+
 static uintptr_t next_thread_num = 1;
 
 static OS_THREAD_SPECIFIC_PTR(void)
@@ -173,6 +246,9 @@ unsigned LocalWriter::beginEnter(const FunctionSig *sig, bool fake) {
     assert(this_thread_num);
     unsigned thread_id = this_thread_num - 1;
     unsigned call_no = Writer::beginEnter(sig, thread_id);
+    if ((ringSize || ringFrames) && isFrameEnd(sig)) {
+        ringFrameEnd = call_no;
+    }
     if (!fake && os::backtrace_is_needed(sig->name)) {
         std::vector<RawStackFrame> backtrace = os::get_backtrace();
         beginBacktrace(backtrace.size());
@@ -184,8 +260,23 @@ unsigned LocalWriter::beginEnter(const FunctionSig *sig, bool fake) {
     return call_no;
 }
 
+void LocalWriter::checkpoint(void) {
+    if (flushSize &&
+        m_file->pendingWriteSize() >= flushSize) {
+        m_file->flush();
+        lastFlushTime = os::getTime();
+    } else if (flushInterval) {
+        long long now = os::getTime();
+        if (now - lastFlushTime >= flushInterval) {
+            m_file->flush();
+            lastFlushTime = now;
+        }
+    }
+}
+
 void LocalWriter::endEnter(void) {
     Writer::endEnter();
+    checkpoint();
     --acquired;
     mutex.unlock();
 }
@@ -194,10 +285,22 @@ void LocalWriter::beginLeave(unsigned call) {
     mutex.lock();
     ++acquired;
     Writer::beginLeave(call);
+    if (call == ringFrameEnd) {
+        ringSegmentDue = true;
+    }
 }
 
 void LocalWriter::endLeave(void) {
     Writer::endLeave();
+    if (ringSize || ringFrames) {
+        if (ringSegmentDue || ++ringSegmentCalls >= RING_MAX_SEGMENT_CALLS) {
+            beginSegment(ringSegmentDue);
+            ringFrameEnd = ~0U;
+            ringSegmentDue = false;
+            ringSegmentCalls = 0;
+        }
+    }
+    checkpoint();
     --acquired;
     mutex.unlock();
 }
@@ -228,6 +331,37 @@ void LocalWriter::flush(void) {
 }
 
 
+void LocalWriter::dump(void) {
+    mutex.lock();
+    ++acquired;
+    if (m_file->isOpened()) {
+        os::log("apitrace: writing out the trace\n");
+        m_file->flush();
+    }
+    --acquired;
+    mutex.unlock();
+}
+
+
+void LocalWriter::skipFrame(void) {
+    mutex.lock();
+    if (!capturing && ++skippedFrames >= startFrame) {
+        startCapture();
+    }
+    mutex.unlock();
+}
+
+
+void LocalWriter::startCapture(void) {
+    mutex.lock();
+    if (!capturing) {
+        os::log("apitrace: starting capture at frame %u\n", skippedFrames);
+        capturing = true;
+    }
+    mutex.unlock();
+}
+
+
 LocalWriter localWriter;
 
 
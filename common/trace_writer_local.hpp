@@ -33,6 +33,8 @@
 
 #include <stdint.h>
 
+#include <vector>
+
 #include "os_thread.hpp"
 #include "os_process.hpp"
 #include "trace_writer.hpp"
@@ -76,8 +78,51 @@ namespace trace {
          */
         os::ProcessId pid;
 
+        /**
+         * Durable flush policy, read from the TRACE_FLUSH_INTERVAL (in
+         * milliseconds) and TRACE_FLUSH_SIZE (in bytes) environment
+         * variables.  Zero disables the respective criteria.
+         */
+        long long flushInterval;
+        size_t flushSize;
+        long long lastFlushTime;
+
+        /**
+         * Flight recorder limits, read from the TRACE_RING_SIZE (in bytes)
+         * and TRACE_RING_FRAMES environment variables.  When either is set,
+         * the trace is kept in memory, in one segment per frame, and only the
+         * start of the trace and its most recent frames are written out
+         * when the process exits, crashes, or is signaled.
+         */
+        size_t ringSize;
+        unsigned ringFrames;
+
+        // End of frame call whose leave ends the current segment
+        unsigned ringFrameEnd;
+        bool ringSegmentDue;
+        unsigned ringSegmentCalls;
+        std::vector<unsigned char> frameEndSigs;
+
+        /**
+         * Mid-stream capture, started after the number of frames given by
+         * the TRACE_START_FRAME environment variable, or when the
+         * application emits an "apitrace-start" marker.  Until then only
+         * the calls that define state are traced.
+         */
+        unsigned startFrame;
+        unsigned skippedFrames;
+        bool capturing;
+
+        bool isFrameEnd(const FunctionSig *sig);
+
         void checkProcessId();
 
+        /**
+         * Flush the trace at a call boundary if the flush policy says so, so
+         * that at most the last few calls are lost if the process is killed.
+         */
+        void checkpoint(void);
+
     public:
         /**
          * Should never called directly -- use localWriter singleton below
@@ -109,6 +154,26 @@ namespace trace {
         void endLeave(void);
 
         void flush(void);
+
+        /**
+         * Write out the trace kept by the flight recorder so far, on the
+         * application's request.
+         */
+        void dump(void);
+
+        /**
+         * Whether calls that do not define state should be traced.
+         */
+        bool isCapturing(void) const {
+            return capturing;
+        }
+
+        /**
+         * Called at the end of every frame while not capturing.
+         */
+        void skipFrame(void);
+
+        void startCapture(void);
     };
 
     /**
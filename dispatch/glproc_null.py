@@ -0,0 +1,206 @@
+##########################################################################
+#
+# Copyright 2014 VMware, Inc.
+# All Rights Reserved.
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in
+# all copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+# THE SOFTWARE.
+#
+##########################################################################/
+
+
+
+"""Generate glproc_null.cpp, a GL dispatch table where every entrypoint is a
+no-op, for measuring the CPU overhead of replaying traces without a GPU.
+""" 
+
+
+# Adjust path
+import os.path
+import sys
+sys.path.insert(0, os.path.join(os.path.dirname(__file__), '..'))
+
+
+import specs.stdapi as stdapi
+from specs.glapi import glapi
+from specs.glesapi import glesapi
+
+
+def resolve(type):
+    while isinstance(type, (stdapi.Const, stdapi.Alias)):
+        type = type.type
+    return type
+
+
+# Plausible return values for queries whose result the replayer relies on
+fixed_results = {
+    'glCheckFramebufferStatus': 'GL_FRAMEBUFFER_COMPLETE',
+    'glCheckFramebufferStatusEXT': 'GL_FRAMEBUFFER_COMPLETE',
+    'glCheckFramebufferStatusOES': 'GL_FRAMEBUFFER_COMPLETE',
+    'glCheckNamedFramebufferStatusEXT': 'GL_FRAMEBUFFER_COMPLETE',
+    'glClientWaitSync': 'GL_ALREADY_SIGNALED',
+    'glClientWaitSyncAPPLE': 'GL_ALREADY_SIGNALED',
+}
+
+
+class NullDispatcher:
+
+    def header(self):
+        print r'''
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "glproc.hpp"
+
+
+#if defined(_WIN32)
+HMODULE _libGlHandle = NULL;
+#else
+void *_libGlHandle = NULL;
+#endif
+
+
+/*
+ * Object names are handed out sequentially, and never reused.
+ */
+static GLuint _lastName = 0;
+
+static inline GLuint
+_genNames(GLuint range) {
+    GLuint first = _lastName + 1;
+    _lastName += range ? range : 1;
+    return first;
+}
+
+
+/*
+ * Mappings point to a zeroed scratch buffer.  Outgrown buffers are not freed
+ * as they might still be mapped.
+ */
+static void *_scratch = NULL;
+static size_t _scratchSize = 0;
+
+static void *
+_getScratch(size_t size) {
+    if (size > _scratchSize) {
+        _scratchSize = size > 1024*1024 ? size : 1024*1024;
+        _scratch = calloc(1, _scratchSize);
+    }
+    return _scratch;
+}
+'''
+
+    def defineFunction(self, function):
+        print 'static ' + function.prototype('_null_' + function.name) + ' {'
+
+        # Fill in the names of generated objects
+        for arg in function.args:
+            arg_type = resolve(arg.type)
+            if arg.output and isinstance(arg_type, stdapi.Array) \
+               and isinstance(resolve(arg_type.type), stdapi.Handle):
+                print '    if (%s) {' % arg.name
+                print '        for (GLint _i = 0; _i < (GLint)(%s); ++_i) {' % arg_type.length
+                print '            %s[_i] = (%s)(uintptr_t)_genNames(1);' % (arg.name, arg_type.type)
+                print '        }'
+                print '    }'
+
+        ret_type = resolve(function.type)
+        if function.type is stdapi.Void:
+            pass
+        elif function.name == 'glGetString':
+            print '    switch (name) {'
+            print '    case GL_VENDOR:'
+            print '        return (const GLubyte *)"apitrace";'
+            print '    case GL_RENDERER:'
+            print '        return (const GLubyte *)"null";'
+            print '    case GL_VERSION:'
+            print '        return (const GLubyte *)"4.4";'
+            print '    case GL_SHADING_LANGUAGE_VERSION:'
+            print '        return (const GLubyte *)"4.40";'
+            print '    default:'
+            print '        return (const GLubyte *)"";'
+            print '    }'
+        elif function.name in fixed_results:
+            print '    return %s;' % fixed_results[function.name]
+        elif isinstance(ret_type, stdapi.Handle):
+            range = ret_type.range
+            if range is None:
+                range = '1'
+            print '    return (%s)(uintptr_t)_genNames(%s);' % (function.type, range)
+        elif isinstance(ret_type, stdapi.LinearPointer):
+            if 'length' in function.argNames():
+                print '    return _getScratch(length);'
+            else:
+                print '    return _getScratch(0);'
+        elif isinstance(ret_type, stdapi.String):
+            print '    return (%s)"";' % (function.type,)
+        else:
+            print '    return (%s)0;' % (function.type,)
+        print '}'
+        print
+
+    def defineTable(self, functions):
+        functions = sorted(functions, key = lambda function: function.name)
+        print 'struct _NullProc {'
+        print '    const char *name;'
+        print '    void *proc;'
+        print '};'
+        print
+        print 'static const _NullProc _nullProcs[] = {'
+        for function in functions:
+            print '    {"%s", (void *)&_null_%s},' % (function.name, function.name)
+        print '};'
+        print
+        print r'''
+static int
+_compareProc(const void *key, const void *elem) {
+    return strcmp(static_cast<const char *>(key), static_cast<const _NullProc *>(elem)->name);
+}
+
+static void *
+_lookupProc(const char *procName) {
+    const _NullProc *proc = static_cast<const _NullProc *>(bsearch(procName,
+        _nullProcs, sizeof _nullProcs / sizeof _nullProcs[0], sizeof _nullProcs[0],
+        _compareProc));
+    return proc ? proc->proc : NULL;
+}
+
+
+void *
+_getPublicProcAddress(const char *procName)
+{
+    return _lookupProc(procName);
+}
+
+void *
+_getPrivateProcAddress(const char *procName)
+{
+    return _lookupProc(procName);
+}
+'''
+
+
+if __name__ == '__main__':
+    dispatcher = NullDispatcher()
+    dispatcher.header()
+    print
+    functions = glapi.functions + glesapi.functions
+    for function in functions:
+        dispatcher.defineFunction(function)
+    dispatcher.defineTable(functions)
@@ -32,6 +32,10 @@ ApiTrace::ApiTrace()
             SIGNAL(searchResult(ApiTrace::SearchRequest,ApiTrace::SearchResult,ApiTraceCall*)),
             this,
             SLOT(loaderSearchResult(ApiTrace::SearchRequest,ApiTrace::SearchResult,ApiTraceCall*)));
+    connect(this, SIGNAL(loaderCountMatches(QString,Qt::CaseSensitivity)),
+            m_loader, SLOT(countMatches(QString,Qt::CaseSensitivity)));
+    connect(m_loader, SIGNAL(matchesCounted(QString,int,bool)),
+            this, SIGNAL(matchesCounted(QString,int,bool)));
     connect(this, SIGNAL(loaderFindFrameStart(ApiTraceFrame*)),
             m_loader, SLOT(findFrameStart(ApiTraceFrame*)));
     connect(this, SIGNAL(loaderFindFrameEnd(ApiTraceFrame*)),
@@ -383,6 +387,12 @@ void ApiTrace::findPrev(ApiTraceFrame *frame,
     emit findResult(request, SearchResult_Wrapped, 0);
 }
 
+void ApiTrace::countMatches(const QString &str,
+                            Qt::CaseSensitivity sensitivity)
+{
+    emit loaderCountMatches(str, sensitivity);
+}
+
 void ApiTrace::loaderSearchResult(const ApiTrace::SearchRequest &request,
                                   ApiTrace::SearchResult result,
                                   ApiTraceCall *call)
@@ -89,6 +89,8 @@ public slots:
                   ApiTraceCall *call,
                   const QString &str,
                   Qt::CaseSensitivity sensitivity);
+    void countMatches(const QString &str,
+                      Qt::CaseSensitivity sensitivity);
     void findFrameStart(ApiTraceFrame *frame);
     void findFrameEnd(ApiTraceFrame *frame);
     void findCallIndex(int index);
@@ -110,6 +112,7 @@ signals:
     void findResult(const ApiTrace::SearchRequest &request,
                     ApiTrace::SearchResult result,
                     ApiTraceCall *call);
+    void matchesCounted(const QString &str, int count, bool exact);
 
     void beginAddingFrames(int oldCount, int numAdded);
     void endAddingFrames();
@@ -121,6 +124,8 @@ signals:
 
 signals:
     void loaderSearch(const ApiTrace::SearchRequest &request);
+    void loaderCountMatches(const QString &str,
+                            Qt::CaseSensitivity sensitivity);
     void loaderFindFrameStart(ApiTraceFrame *frame);
     void loaderFindFrameEnd(ApiTraceFrame *frame);
     void loaderFindCallIndex(int index);
@@ -4,13 +4,24 @@
 #include "traceloader.h"
 #include "trace_model.hpp"
 
+#include <QCache>
 #include <QDebug>
 #include <QLocale>
+#include <QMutex>
 #include <QObject>
 #define QT_USE_FAST_OPERATOR_PLUS
 #include <QStringBuilder>
 #include <QTextDocument>
 
+/*
+ * Number of calls whose rendered text is kept around for painting.
+ */
+#define STATIC_TEXT_CACHE_SIZE 4096
+
+static QMutex staticTextMutex;
+static QCache<const ApiTraceCall *, QStaticText>
+staticTextCache(STATIC_TEXT_CACHE_SIZE);
+
 const char * const styleSheet =
     ".call {\n"
     "    font-weight:bold;\n"
@@ -194,7 +205,7 @@ void VariantVisitor::visit(trace::Enum *e)
     if (!sig) {
         sig = new ApiTraceEnumSignature(e->sig);
         if (m_loader) {
-            m_loader->addEnumSignature(e->sig->id, sig);
+            sig = m_loader->addEnumSignature(e->sig->id, sig);
         }
     }
 
@@ -233,6 +244,43 @@ void VariantVisitor::visit(trace::Repr *repr)
     repr->humanValue->visit(*this);
 }
 
+class BinaryDataVisitor : public trace::Visitor
+{
+public:
+    BinaryDataVisitor()
+        : m_found(false),
+          m_size(0)
+    {}
+    virtual void visit(trace::Blob *blob)
+    {
+        m_found = true;
+        m_size = blob->size;
+    }
+
+    bool m_found;
+    quint64 m_size;
+};
+
+int binaryDataArgument(const trace::Call *call, quint64 *size)
+{
+    int index = -1;
+    quint64 dataSize = 0;
+    for (unsigned i = 0; i < call->args.size(); ++i) {
+        if (call->args[i].value) {
+            BinaryDataVisitor visitor;
+            call->args[i].value->visit(visitor);
+            if (visitor.m_found) {
+                index = i;
+                dataSize = visitor.m_size;
+            }
+        }
+    }
+    if (size) {
+        *size = dataSize;
+    }
+    return index;
+}
+
 ApiTraceEnumSignature::ApiTraceEnumSignature(const trace::EnumSig *sig)
 {
     for (const trace::EnumValue *it = sig->values;
@@ -605,8 +653,7 @@ ApiTraceEvent::ApiTraceEvent()
     : m_type(ApiTraceEvent::None),
       m_hasBinaryData(false),
       m_binaryDataIndex(0),
-      m_state(0),
-      m_staticText(0)
+      m_state(0)
 {
 }
 
@@ -614,15 +661,13 @@ ApiTraceEvent::ApiTraceEvent(Type t)
     : m_type(t),
       m_hasBinaryData(false),
       m_binaryDataIndex(0),
-      m_state(0),
-      m_staticText(0)
+      m_state(0)
 {
 }
 
 ApiTraceEvent::~ApiTraceEvent()
 {
     delete m_state;
-    delete m_staticText;
 }
 
 QVariantMap ApiTraceEvent::stateParameters() const
@@ -646,33 +691,42 @@ void ApiTraceEvent::setState(ApiTraceState *state)
 
 ApiTraceCall::ApiTraceCall(ApiTraceFrame *parentFrame,
                            TraceLoader *loader,
-                           const trace::Call *call)
+                           const trace::Call *call,
+                           const trace::ParseBookmark *bookmark)
     : ApiTraceEvent(ApiTraceEvent::Call),
       m_parentFrame(parentFrame),
-      m_parentCall(0)
+      m_parentCall(0),
+      m_loader(loader),
+      m_data(0)
 {
-    loadData(loader, call);
+    loadData(loader, call, bookmark);
 }
 
 ApiTraceCall::ApiTraceCall(ApiTraceCall *parentCall,
                            TraceLoader *loader,
-                           const trace::Call *call)
+                           const trace::Call *call,
+                           const trace::ParseBookmark *bookmark)
     : ApiTraceEvent(ApiTraceEvent::Call),
       m_parentFrame(parentCall->parentFrame()),
-      m_parentCall(parentCall)
+      m_parentCall(parentCall),
+      m_loader(loader),
+      m_data(0)
 {
-    loadData(loader, call);
+    loadData(loader, call, bookmark);
 }
 
 
 ApiTraceCall::~ApiTraceCall()
 {
+    invalidateText();
+    delete m_data;
 }
 
 
 void
 ApiTraceCall::loadData(TraceLoader *loader,
-                       const trace::Call *call)
+                       const trace::Call *call,
+                       const trace::ParseBookmark *bookmark)
 {
     m_index = call->no;
 
@@ -686,29 +740,45 @@ ApiTraceCall::loadData(TraceLoader *loader,
             argNames += QString::fromStdString(call->sig->arg_names[i]);
         }
         m_signature = new ApiTraceCallSignature(name, argNames);
-        loader->addSignature(call->sig->id, m_signature);
+        m_signature = loader->addSignature(call->sig->id, m_signature);
+    }
+    m_flags = call->flags;
+
+    int binaryDataIndex = binaryDataArgument(call);
+    if (binaryDataIndex >= 0) {
+        m_hasBinaryData = true;
+        m_binaryDataIndex = binaryDataIndex;
     }
+
+    if (bookmark) {
+        m_bookmark = *bookmark;
+    } else {
+        m_data = new ApiTraceCallData;
+        decode(loader, call, *m_data);
+    }
+}
+
+void
+ApiTraceCall::decode(TraceLoader *loader,
+                     const trace::Call *call,
+                     ApiTraceCallData &data)
+{
     if (call->ret) {
         VariantVisitor retVisitor(loader);
         call->ret->visit(retVisitor);
-        m_returnValue = retVisitor.variant();
+        data.returnValue = retVisitor.variant();
     }
-    m_argValues.reserve(call->args.size());
+    data.argValues.reserve(call->args.size());
     for (int i = 0; i < call->args.size(); ++i) {
         if (call->args[i].value) {
             VariantVisitor argVisitor(loader);
             call->args[i].value->visit(argVisitor);
-            m_argValues.append(argVisitor.variant());
-            if (m_argValues[i].type() == QVariant::ByteArray) {
-                m_hasBinaryData = true;
-                m_binaryDataIndex = i;
-            }
+            data.argValues.append(argVisitor.variant());
         } else {
-            m_argValues.append(QVariant());
+            data.argValues.append(QVariant());
         }
     }
-    m_argValues.squeeze();
-    m_flags = call->flags;
+    data.argValues.squeeze();
     if (call->backtrace != NULL) {
         QString qbacktrace;
         for (int i = 0; i < call->backtrace->size(); i++) {
@@ -732,10 +802,29 @@ ApiTraceCall::loadData(TraceLoader *loader,
             }
             qbacktrace += "\n";
         }
-        this->setBacktrace(qbacktrace);
+        data.backtrace = qbacktrace;
     }
 }
 
+ApiTraceCallData ApiTraceCall::data() const
+{
+    if (m_data) {
+        return *m_data;
+    }
+    return m_loader->callData(this);
+}
+
+const trace::ParseBookmark &ApiTraceCall::bookmark() const
+{
+    return m_bookmark;
+}
+
+void ApiTraceCall::invalidateText()
+{
+    QMutexLocker locker(&staticTextMutex);
+    staticTextCache.remove(this);
+}
+
 ApiTraceCall *
 ApiTraceCall::parentCall() const
 {
@@ -791,7 +880,6 @@ void ApiTraceCall::setError(const QString &msg)
 {
     if (m_error != msg) {
         m_error = msg;
-        m_richText = QString();
     }
 }
 
@@ -804,7 +892,7 @@ ApiTrace * ApiTraceCall::parentTrace() const
 
 QVector<QVariant> ApiTraceCall::originalValues() const
 {
-    return m_argValues;
+    return data().argValues;
 }
 
 void ApiTraceCall::setEditedValues(const QVector<QVariant> &lst)
@@ -813,10 +901,7 @@ void ApiTraceCall::setEditedValues(const QVector<QVariant> &lst)
 
     m_editedValues = lst;
     //lets regenerate data
-    m_richText = QString();
-    m_searchText = QString();
-    delete m_staticText;
-    m_staticText = 0;
+    invalidateText();
 
     if (trace) {
         if (!lst.isEmpty()) {
@@ -875,7 +960,7 @@ QStringList ApiTraceCall::argNames() const
 QVector<QVariant> ApiTraceCall::arguments() const
 {
     if (m_editedValues.isEmpty())
-        return m_argValues;
+        return data().argValues;
     else
         return m_editedValues;
 }
@@ -891,7 +976,7 @@ ApiTraceCall::eventAtRow(int row) const
 
 QVariant ApiTraceCall::returnValue() const
 {
-    return m_returnValue;
+    return data().returnValue;
 }
 
 trace::CallFlags ApiTraceCall::flags() const
@@ -916,20 +1001,22 @@ int ApiTraceCall::binaryDataIndex() const
 
 QString ApiTraceCall::backtrace() const
 {
-    return m_backtrace;
-}
-
-void ApiTraceCall::setBacktrace(QString backtrace)
-{
-    m_backtrace = backtrace;
+    return data().backtrace;
 }
 
 QStaticText ApiTraceCall::staticText() const
 {
-    if (m_staticText && !m_staticText->text().isEmpty())
-        return *m_staticText;
+    {
+        QMutexLocker locker(&staticTextMutex);
+        QStaticText *staticText = staticTextCache.object(this);
+        if (staticText) {
+            return *staticText;
+        }
+    }
 
+    // Don't hold the lock while decoding, which may need the loader
     QVector<QVariant> argValues = arguments();
+    QVariant returnValue = this->returnValue();
 
     QString richText = QString::fromLatin1(
         "<span style=\"font-weight:bold\">%1</span>(").arg(
@@ -957,35 +1044,35 @@ QStaticText ApiTraceCall::staticText() const
             richText += QLatin1String(", ");
     }
     richText += QLatin1String(")");
-    if (m_returnValue.isValid()) {
+    if (returnValue.isValid()) {
         richText +=
             QLatin1Literal(" = ") %
             QLatin1Literal("<span style=\"color:#0000ff\">") %
-            apiVariantToString(m_returnValue) %
+            apiVariantToString(returnValue) %
             QLatin1Literal("</span>");
     }
 
-    if (!m_staticText)
-        m_staticText = new QStaticText(richText);
-    else
-        m_staticText->setText(richText);
+    QStaticText *staticText = new QStaticText(richText);
     QTextOption opt;
     opt.setWrapMode(QTextOption::NoWrap);
-    m_staticText->setTextOption(opt);
-    m_staticText->prepare();
+    staticText->setTextOption(opt);
+    staticText->prepare();
 
-    return *m_staticText;
+    QStaticText result = *staticText;
+    QMutexLocker locker(&staticTextMutex);
+    staticTextCache.insert(this, staticText);
+    return result;
 }
 
 QString ApiTraceCall::toHtml() const
 {
-    if (!m_richText.isEmpty())
-        return m_richText;
+    QString richText;
+    QVariant returnValue = this->returnValue();
 
-    m_richText += QLatin1String("<div class=\"call\">");
+    richText += QLatin1String("<div class=\"call\">");
 
 
-    m_richText +=
+    richText +=
         QString::fromLatin1("%1) ")
         .arg(m_index);
     QString parentTip;
@@ -996,12 +1083,12 @@ QString ApiTraceCall::toHtml() const
     }
     QUrl helpUrl = m_signature->helpUrl();
     if (helpUrl.isEmpty()) {
-        m_richText += QString::fromLatin1(
+        richText += QString::fromLatin1(
             "<span class=\"callName\" title=\"%1\">%2</span>(")
                       .arg(parentTip)
                       .arg(m_signature->name());
     } else {
-        m_richText += QString::fromLatin1(
+        richText += QString::fromLatin1(
          "<span class=\"callName\" title=\"%1\"><a href=\"%2\">%3</a></span>(")
                       .arg(parentTip)
                       .arg(helpUrl.toString())
@@ -1011,7 +1098,7 @@ QString ApiTraceCall::toHtml() const
     QVector<QVariant> argValues = arguments();
     QStringList argNames = m_signature->argNames();
     for (int i = 0; i < argNames.count(); ++i) {
-        m_richText +=
+        richText +=
             QLatin1String("<span class=\"arg-name\">") +
             argNames[i] +
             QLatin1String("</span>") +
@@ -1020,62 +1107,61 @@ QString ApiTraceCall::toHtml() const
             apiVariantToString(argValues[i], true) +
             QLatin1Literal("</span>");
         if (i < argNames.count() - 1)
-            m_richText += QLatin1String(", ");
+            richText += QLatin1String(", ");
     }
-    m_richText += QLatin1String(")");
+    richText += QLatin1String(")");
 
-    if (m_returnValue.isValid()) {
-        m_richText +=
+    if (returnValue.isValid()) {
+        richText +=
             QLatin1String(" = ") +
             QLatin1String("<span style=\"color:#0000ff\">") +
-            apiVariantToString(m_returnValue, true) +
+            apiVariantToString(returnValue, true) +
             QLatin1String("</span>");
     }
-    m_richText += QLatin1String("</div>");
+    richText += QLatin1String("</div>");
 
     if (hasError()) {
         QString errorStr =
             QString::fromLatin1(
                 "<div class=\"error\">%1</div>")
             .arg(m_error);
-        m_richText += errorStr;
+        richText += errorStr;
     }
 
-    m_richText =
+    richText =
         QString::fromLatin1(
             "<html><head><style type=\"text/css\" media=\"all\">"
             "%1</style></head><body>%2</body></html>")
         .arg(styleSheet)
-        .arg(m_richText);
-    m_richText.squeeze();
+        .arg(richText);
+    richText.squeeze();
 
-    //qDebug()<<m_richText;
-    return m_richText;
+    //qDebug()<<richText;
+    return richText;
 }
 
 QString ApiTraceCall::searchText() const
 {
-    if (!m_searchText.isEmpty())
-        return m_searchText;
-
+    QString searchText;
     QVector<QVariant> argValues = arguments();
-    m_searchText = m_signature->name() + QLatin1Literal("(");
+    QVariant returnValue = this->returnValue();
+    searchText = m_signature->name() + QLatin1Literal("(");
     QStringList argNames = m_signature->argNames();
     for (int i = 0; i < argNames.count(); ++i) {
-        m_searchText += argNames[i] +
+        searchText += argNames[i] +
                         QLatin1Literal(" = ") +
                         apiVariantToString(argValues[i]);
         if (i < argNames.count() - 1)
-            m_searchText += QLatin1String(", ");
+            searchText += QLatin1String(", ");
     }
-    m_searchText += QLatin1String(")");
+    searchText += QLatin1String(")");
 
-    if (m_returnValue.isValid()) {
-        m_searchText += QLatin1Literal(" = ") +
-                        apiVariantToString(m_returnValue);
+    if (returnValue.isValid()) {
+        searchText += QLatin1Literal(" = ") +
+                        apiVariantToString(returnValue);
     }
-    m_searchText.squeeze();
-    return m_searchText;
+    searchText.squeeze();
+    return searchText;
 }
 
 int ApiTraceCall::numChildren() const
@@ -1097,13 +1183,15 @@ ApiTraceFrame::ApiTraceFrame(ApiTrace *parentTrace)
       m_binaryDataSize(0),
       m_loaded(false),
       m_callsToLoad(0),
-      m_lastCallIndex(0)
+      m_lastCallIndex(0),
+      m_staticText(0)
 {
 }
 
 ApiTraceFrame::~ApiTraceFrame()
 {
     qDeleteAll(m_calls);
+    delete m_staticText;
 }
 
 QStaticText ApiTraceFrame::staticText() const
@@ -9,6 +9,7 @@
 #include <QVariant>
 
 #include "trace_model.hpp"
+#include "trace_parser.hpp"
 
 
 class ApiTrace;
@@ -154,6 +155,12 @@ Q_DECLARE_METATYPE(ApiArray);
 
 QString apiVariantToString(const QVariant &variant, bool multiLine = false);
 
+/*
+ * Index of the first binary data argument of the call, or -1 if there is
+ * none.  The data size is returned in size.
+ */
+int binaryDataArgument(const trace::Call *call, quint64 *size = 0);
+
 class ApiTraceFrame;
 
 class ApiTraceState {
@@ -203,6 +210,19 @@ private:
     QUrl m_helpUrl;
 };
 
+/*
+ * The decoded arguments of a call.
+ *
+ * Calls only keep a bookmark to their position in the trace file, and the
+ * TraceLoader decodes these on demand, caching the most recently used ones.
+ */
+struct ApiTraceCallData
+{
+    QVector<QVariant> argValues;
+    QVariant returnValue;
+    QString backtrace;
+};
+
 class ApiTraceCall;
 
 class ApiTraceEvent
@@ -238,20 +258,28 @@ protected:
     mutable bool m_hasBinaryData;
     mutable int m_binaryDataIndex:8;
     ApiTraceState *m_state;
-
-    mutable QStaticText *m_staticText;
 };
 Q_DECLARE_METATYPE(ApiTraceEvent*);
 
 class ApiTraceCall : public ApiTraceEvent
 {
 public:
+    /*
+     * When a bookmark is given the arguments are not kept, but re-read from
+     * the trace as needed.
+     */
     ApiTraceCall(ApiTraceCall *parentCall, TraceLoader *loader,
-                 const trace::Call *tcall);
+                 const trace::Call *tcall,
+                 const trace::ParseBookmark *bookmark = 0);
     ApiTraceCall(ApiTraceFrame *parentFrame, TraceLoader *loader,
-                 const trace::Call *tcall);
+                 const trace::Call *tcall,
+                 const trace::ParseBookmark *bookmark = 0);
     ~ApiTraceCall();
 
+    static void decode(TraceLoader *loader,
+                       const trace::Call *tcall,
+                       ApiTraceCallData &data);
+
     int index() const;
     QString name() const;
     QStringList argNames() const;
@@ -296,15 +324,17 @@ public:
     int binaryDataIndex() const;
 
     QString backtrace() const;
-    void setBacktrace(QString backtrace);
+
+    const trace::ParseBookmark &bookmark() const;
+    ApiTraceCallData data() const;
 private:
     void loadData(TraceLoader *loader,
-                  const trace::Call *tcall);
+                  const trace::Call *tcall,
+                  const trace::ParseBookmark *bookmark);
+    void invalidateText();
 private:
     int m_index;
     ApiTraceCallSignature *m_signature;
-    QVector<QVariant> m_argValues;
-    QVariant m_returnValue;
     trace::CallFlags m_flags;
     ApiTraceFrame *m_parentFrame;
     ApiTraceCall *m_parentCall;
@@ -314,10 +344,11 @@ private:
 
     QString m_error;
 
-    QString m_backtrace;
+    TraceLoader *m_loader;
+    trace::ParseBookmark m_bookmark;
 
-    mutable QString m_richText;
-    mutable QString m_searchText;
+    // Only set for calls which can't be re-read from the trace
+    ApiTraceCallData *m_data;
 };
 Q_DECLARE_METATYPE(ApiTraceCall*);
 
@@ -374,6 +405,8 @@ private:
     unsigned m_callsToLoad;
     unsigned m_lastCallIndex;
     QImage m_thumbnail;
+
+    mutable QStaticText *m_staticText;
 };
 Q_DECLARE_METATYPE(ApiTraceFrame*);
 
@@ -917,6 +917,12 @@ void MainWindow::initConnections()
     connect(m_searchWidget,
             SIGNAL(searchPrev(const QString&, Qt::CaseSensitivity)),
             SLOT(slotSearchPrev(const QString&, Qt::CaseSensitivity)));
+    connect(m_searchWidget,
+            SIGNAL(searchChanged(const QString&, Qt::CaseSensitivity)),
+            m_trace,
+            SLOT(countMatches(const QString&, Qt::CaseSensitivity)));
+    connect(m_trace, SIGNAL(matchesCounted(const QString&, int, bool)),
+            m_searchWidget, SLOT(setMatchCount(const QString&, int, bool)));
 
     connect(m_traceProcess, SIGNAL(tracedFile(const QString&)),
             SLOT(createdTrace(const QString&)));
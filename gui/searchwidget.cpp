@@ -10,6 +10,7 @@ SearchWidget::SearchWidget(QWidget *parent)
     m_ui.setupUi(this);
 
     m_ui.notFoundLabel->hide();
+    m_ui.matchesLabel->hide();
     m_origPalette = m_ui.lineEdit->palette();
 
     connect(m_ui.nextButton, SIGNAL(clicked()),
@@ -20,6 +21,10 @@ SearchWidget::SearchWidget(QWidget *parent)
             SLOT(slotCancel()));
     connect(m_ui.lineEdit, SIGNAL(returnPressed()),
             SLOT(slotSearchNext()));
+    connect(m_ui.lineEdit, SIGNAL(textChanged(const QString&)),
+            SLOT(slotSearchChanged()));
+    connect(m_ui.caseSensitiveBox, SIGNAL(toggled(bool)),
+            SLOT(slotSearchChanged()));
 
     m_ui.nextButton->setShortcut(
         QKeySequence::FindNext);
@@ -43,6 +48,16 @@ void SearchWidget::slotSearchPrev()
         emit searchPrev(txt, caseSensitivity());
 }
 
+void SearchWidget::slotSearchChanged()
+{
+    QString txt = m_ui.lineEdit->text();
+    if (txt.isEmpty()) {
+        m_ui.matchesLabel->hide();
+    } else {
+        emit searchChanged(txt, caseSensitivity());
+    }
+}
+
 void SearchWidget::slotCancel()
 {
     hide();
@@ -80,12 +95,31 @@ void SearchWidget::setFound(bool found)
     m_ui.notFoundLabel->setVisible(!found);
 }
 
+void SearchWidget::setMatchCount(const QString &str, int count, bool exact)
+{
+    // Ignore counts for text that was edited meanwhile
+    if (str != m_ui.lineEdit->text()) {
+        return;
+    }
+
+    if (count < 0) {
+        m_ui.matchesLabel->hide();
+    } else if (exact) {
+        m_ui.matchesLabel->setText(tr("%n match(es)", "", count));
+        m_ui.matchesLabel->show();
+    } else {
+        m_ui.matchesLabel->setText(tr("at most %n match(es)", "", count));
+        m_ui.matchesLabel->show();
+    }
+}
+
 void SearchWidget::show()
 {
     QWidget::show();
     m_ui.lineEdit->selectAll();
     m_ui.lineEdit->setFocus(Qt::ShortcutFocusReason);
     m_ui.lineEdit->setPalette(m_origPalette);
+    slotSearchChanged();
 }
 
 #include "searchwidget.moc"
@@ -15,14 +15,20 @@ public:
 
     void setFound(bool f);
     void show();
+
+public slots:
+    void setMatchCount(const QString &str, int count, bool exact);
+
 signals:
     void searchNext(const QString &str, Qt::CaseSensitivity cs = Qt::CaseInsensitive);
     void searchPrev(const QString &str, Qt::CaseSensitivity cs = Qt::CaseInsensitive);
+    void searchChanged(const QString &str, Qt::CaseSensitivity cs = Qt::CaseInsensitive);
 
 private slots:
     void slotSearchNext();
     void slotSearchPrev();
     void slotCancel();
+    void slotSearchChanged();
 
 protected:
     virtual bool eventFilter(QObject *object, QEvent* event);
@@ -0,0 +1,84 @@
+#include "traceindexer.h"
+
+#include "trace_index.hpp"
+#include "trace_parser.hpp"
+
+#include <QDateTime>
+#include <QDebug>
+#include <QFileInfo>
+
+TraceIndexer::TraceIndexer(const QString &fileName, QObject *parent)
+    : QThread(parent),
+      m_fileName(fileName),
+      m_index(0),
+      m_stop(false)
+{
+}
+
+TraceIndexer::~TraceIndexer()
+{
+    stop();
+    wait();
+    delete m_index;
+}
+
+QString TraceIndexer::fileName() const
+{
+    return m_fileName;
+}
+
+trace::Index *TraceIndexer::takeIndex()
+{
+    Q_ASSERT(isFinished());
+    trace::Index *index = m_index;
+    m_index = 0;
+    return index;
+}
+
+void TraceIndexer::stop()
+{
+    m_stop = true;
+}
+
+void TraceIndexer::run()
+{
+    QString indexFileName = m_fileName + QLatin1String(".idx");
+    QFileInfo traceInfo(m_fileName);
+    quint64 traceSize = traceInfo.size();
+    quint64 traceTime = traceInfo.lastModified().toMSecsSinceEpoch();
+
+    trace::Index *index = new trace::Index();
+
+    if (index->load(indexFileName.toLocal8Bit(), traceSize, traceTime)) {
+        index->prepareLookups();
+        m_index = index;
+        return;
+    }
+
+    trace::Parser parser;
+    if (!parser.open(m_fileName.toLocal8Bit())) {
+        delete index;
+        return;
+    }
+
+    trace::Call *call;
+    while (!m_stop && (call = parser.parse_call())) {
+        index->add(call);
+        delete call;
+    }
+
+    if (m_stop) {
+        delete index;
+        return;
+    }
+
+    if (!index->save(indexFileName.toLocal8Bit(), traceSize, traceTime)) {
+        qDebug() << "warning: could not save search index to "
+                 << indexFileName;
+    }
+
+    index->prepareLookups();
+    m_index = index;
+}
+
+#include "traceindexer.moc"
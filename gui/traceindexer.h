@@ -0,0 +1,41 @@
+#ifndef TRACEINDEXER_H
+#define TRACEINDEXER_H
+
+
+#include <QThread>
+#include <QString>
+
+namespace trace {
+    class Index;
+}
+
+/*
+ * Builds the full-text search index of a trace in the background, or loads
+ * it from the "<trace>.idx" file saved by a previous run.
+ */
+class TraceIndexer : public QThread
+{
+    Q_OBJECT
+public:
+    TraceIndexer(const QString &fileName, QObject *parent=0);
+    ~TraceIndexer();
+
+    QString fileName() const;
+
+    /*
+     * Take ownership of the index, once the thread has finished.
+     */
+    trace::Index *takeIndex();
+
+    void stop();
+
+protected:
+    virtual void run();
+
+private:
+    QString m_fileName;
+    trace::Index *m_index;
+    volatile bool m_stop;
+};
+
+#endif
@@ -1,25 +1,42 @@
 #include "traceloader.h"
 
 #include "apitrace.h"
+#include "traceindexer.h"
+#include "trace_index.hpp"
 #include <QDebug>
 #include <QFile>
 #include <QStack>
 
+#include <algorithm>
+
 #define FRAMES_TO_CACHE 100
 
+/*
+ * Cost limit of the decoded calls cache, where each call costs one plus
+ * its binary data size in KB.
+ */
+#define CALL_DATA_CACHE_SIZE (16*1024)
+
+/*
+ * How many calls to parse past a call's bookmark when looking for it, as
+ * calls from other threads may be interleaved.
+ */
+#define MAX_INTERLEAVED_CALLS 64
+
 static ApiTraceCall *
 apiCallFromTraceCall(const trace::Call *call,
                      const QHash<QString, QUrl> &helpHash,
                      ApiTraceFrame *frame,
                      ApiTraceCall *parentCall,
-                     TraceLoader *loader)
+                     TraceLoader *loader,
+                     const trace::ParseBookmark *bookmark = 0)
 {
     ApiTraceCall *apiCall;
 
     if (parentCall)
-        apiCall = new ApiTraceCall(parentCall, loader, call);
+        apiCall = new ApiTraceCall(parentCall, loader, call, bookmark);
     else
-        apiCall = new ApiTraceCall(frame, loader, call);
+        apiCall = new ApiTraceCall(frame, loader, call, bookmark);
 
     apiCall->setHelpUrl(helpHash.value(apiCall->name()));
 
@@ -27,42 +44,79 @@ apiCallFromTraceCall(const trace::Call *call,
 }
 
 TraceLoader::TraceLoader(QObject *parent)
-    : QObject(parent)
+    : QObject(parent),
+      m_mutex(QMutex::Recursive),
+      m_callData(CALL_DATA_CACHE_SIZE),
+      m_indexer(0),
+      m_index(0),
+      m_matchesCs(Qt::CaseInsensitive),
+      m_matchesValid(false),
+      m_matchesExact(false)
 {
 }
 
 TraceLoader::~TraceLoader()
 {
+    stopIndexer();
+    delete m_index;
     m_parser.close();
+    m_dataParser.close();
     qDeleteAll(m_signatures);
     qDeleteAll(m_enumSignatures);
 }
 
 void TraceLoader::loadTrace(const QString &filename)
 {
+    QMutexLocker locker(&m_mutex);
+
     if (m_helpHash.isEmpty()) {
         loadHelpFile();
     }
 
     if (!m_frameBookmarks.isEmpty()) {
-        qDeleteAll(m_signatures);
-        qDeleteAll(m_enumSignatures);
-        m_signatures.clear();
-        m_enumSignatures.clear();
-        m_frameBookmarks.clear();
+        {
+            QMutexLocker dataLocker(&m_dataMutex);
+            m_callData.clear();
+            m_dataParser.close();
+        }
+        {
+            QMutexLocker tablesLocker(&m_tablesMutex);
+            qDeleteAll(m_signatures);
+            qDeleteAll(m_enumSignatures);
+            m_signatures.clear();
+            m_enumSignatures.clear();
+            m_frameBookmarks.clear();
+        }
         m_createdFrames.clear();
         m_parser.close();
     }
 
+    stopIndexer();
+    delete m_index;
+    m_index = 0;
+    m_matchesValid = false;
+
     if (!m_parser.open(filename.toLatin1())) {
         qDebug() << "error: failed to open " << filename;
         return;
     }
 
+    if (m_parser.supportsOffsets()) {
+        // Calls are decoded on demand through a parser of their own, so
+        // that doing so never waits for this thread.
+        QMutexLocker dataLocker(&m_dataMutex);
+        if (!m_dataParser.open(filename.toLatin1())) {
+            qDebug() << "error: failed to open " << filename;
+            m_parser.close();
+            return;
+        }
+    }
+
     emit startedParsing();
 
     if (m_parser.supportsOffsets()) {
         scanTrace();
+        startIndexer(filename);
     } else {
         //Load the entire file into memory
         parseTrace();
@@ -73,6 +127,7 @@ void TraceLoader::loadTrace(const QString &filename)
 
 void TraceLoader::loadFrame(ApiTraceFrame *currentFrame)
 {
+    QMutexLocker locker(&m_mutex);
     fetchFrameContents(currentFrame);
 }
 
@@ -119,16 +174,22 @@ void TraceLoader::scanTrace()
     trace::ParseBookmark startBookmark;
     int numOfFrames = 0;
     int numOfCalls = 0;
+    unsigned minCallNo = ~0U;
+    unsigned maxCallNo = 0;
     int lastPercentReport = 0;
 
     m_parser.getBookmark(startBookmark);
 
     while ((call = m_parser.scan_call())) {
         ++numOfCalls;
+        minCallNo = std::min(minCallNo, call->no);
+        maxCallNo = std::max(maxCallNo, call->no);
 
         if (call->flags & trace::CALL_FLAG_END_FRAME) {
             FrameBookmark frameBookmark(startBookmark);
             frameBookmark.numberOfCalls = numOfCalls;
+            frameBookmark.minCallNo = minCallNo;
+            frameBookmark.maxCallNo = maxCallNo;
 
             currentFrame = new ApiTraceFrame();
             currentFrame->number = numOfFrames;
@@ -137,15 +198,29 @@ void TraceLoader::scanTrace()
             frames.append(currentFrame);
 
             m_createdFrames.append(currentFrame);
-            m_frameBookmarks[numOfFrames] = frameBookmark;
+            {
+                QMutexLocker tablesLocker(&m_tablesMutex);
+                m_frameBookmarks[numOfFrames] = frameBookmark;
+            }
             ++numOfFrames;
 
             if (m_parser.percentRead() - lastPercentReport >= 5) {
                 emit parsed(m_parser.percentRead());
                 lastPercentReport = m_parser.percentRead();
+
+                // Hand over the frames scanned so far, so that the
+                // beginning of the trace shows up without waiting for the
+                // whole file to be scanned.
+                trace::ParseBookmark bookmark;
+                m_parser.getBookmark(bookmark);
+                scanDataParser(bookmark);
+                emit framesLoaded(frames);
+                frames.clear();
             }
             m_parser.getBookmark(startBookmark);
             numOfCalls = 0;
+            minCallNo = ~0U;
+            maxCallNo = 0;
         }
         delete call;
     }
@@ -154,6 +229,8 @@ void TraceLoader::scanTrace()
         //trace::File::Bookmark endBookmark = m_parser.currentBookmark();
         FrameBookmark frameBookmark(startBookmark);
         frameBookmark.numberOfCalls = numOfCalls;
+        frameBookmark.minCallNo = minCallNo;
+        frameBookmark.maxCallNo = maxCallNo;
 
         currentFrame = new ApiTraceFrame();
         currentFrame->number = numOfFrames;
@@ -161,13 +238,44 @@ void TraceLoader::scanTrace()
         frames.append(currentFrame);
 
         m_createdFrames.append(currentFrame);
-        m_frameBookmarks[numOfFrames] = frameBookmark;
+        {
+            QMutexLocker tablesLocker(&m_tablesMutex);
+            m_frameBookmarks[numOfFrames] = frameBookmark;
+        }
         ++numOfFrames;
     }
 
+    trace::ParseBookmark endBookmark;
+    m_parser.getBookmark(endBookmark);
+    scanDataParser(endBookmark);
+
     emit parsed(100);
 
-    emit framesLoaded(frames);
+    if (!frames.isEmpty()) {
+        emit framesLoaded(frames);
+    }
+}
+
+void TraceLoader::scanDataParser(const trace::ParseBookmark &bookmark)
+{
+    // Signatures are only defined on their first use, so the data parser
+    // must have seen everything up to the calls it decodes.  Lock for each
+    // call, so that decoding a call waits for one at most.
+    while (true) {
+        QMutexLocker locker(&m_dataMutex);
+
+        trace::ParseBookmark current;
+        m_dataParser.getBookmark(current);
+        if (!(current.offset < bookmark.offset)) {
+            break;
+        }
+
+        trace::Call *call = m_dataParser.scan_call();
+        if (!call) {
+            break;
+        }
+        delete call;
+    }
 }
 
 void TraceLoader::parseTrace()
@@ -206,9 +314,9 @@ void TraceLoader::parseTrace()
             groups.top()->addChild(apiCall);
         }
         if (apiCall->hasBinaryData()) {
-            QByteArray data =
-                apiCall->arguments()[apiCall->binaryDataIndex()].toByteArray();
-            binaryDataSize += data.size();
+            quint64 size;
+            binaryDataArgument(call, &size);
+            binaryDataSize += size;
         }
         if (call->flags & trace::CALL_FLAG_END_FRAME) {
             allCalls.squeeze();
@@ -258,6 +366,7 @@ void TraceLoader::parseTrace()
 
 ApiTraceCallSignature * TraceLoader::signature(unsigned id)
 {
+    QMutexLocker locker(&m_tablesMutex);
     if (id >= m_signatures.count()) {
         m_signatures.resize(id + 1);
         return NULL;
@@ -266,13 +375,24 @@ ApiTraceCallSignature * TraceLoader::signature(unsigned id)
     }
 }
 
-void TraceLoader::addSignature(unsigned id, ApiTraceCallSignature *signature)
+ApiTraceCallSignature *
+TraceLoader::addSignature(unsigned id, ApiTraceCallSignature *signature)
 {
+    QMutexLocker locker(&m_tablesMutex);
+    if (id >= m_signatures.count()) {
+        m_signatures.resize(id + 1);
+    }
+    if (m_signatures[id]) {
+        delete signature;
+        return m_signatures[id];
+    }
     m_signatures[id] = signature;
+    return signature;
 }
 
 ApiTraceEnumSignature * TraceLoader::enumSignature(unsigned id)
 {
+    QMutexLocker locker(&m_tablesMutex);
     if (id >= m_enumSignatures.count()) {
         m_enumSignatures.resize(id + 1);
         return NULL;
@@ -281,9 +401,19 @@ ApiTraceEnumSignature * TraceLoader::enumSignature(unsigned id)
     }
 }
 
-void TraceLoader::addEnumSignature(unsigned id, ApiTraceEnumSignature *signature)
+ApiTraceEnumSignature *
+TraceLoader::addEnumSignature(unsigned id, ApiTraceEnumSignature *signature)
 {
+    QMutexLocker locker(&m_tablesMutex);
+    if (id >= m_enumSignatures.count()) {
+        m_enumSignatures.resize(id + 1);
+    }
+    if (m_enumSignatures[id]) {
+        delete signature;
+        return m_enumSignatures[id];
+    }
     m_enumSignatures[id] = signature;
+    return signature;
 }
 
 void TraceLoader::searchNext(const ApiTrace::SearchRequest &request)
@@ -439,11 +569,14 @@ TraceLoader::fetchFrameContents(ApiTraceFrame *currentFrame)
             m_parser.setBookmark(frameBookmark.start);
 
             trace::Call *call;
+            trace::ParseBookmark callBookmark;
             int parsedCalls = 0;
+            m_parser.getBookmark(callBookmark);
             while ((call = m_parser.parse_call())) {
                 ApiTraceCall *apiCall =
                     apiCallFromTraceCall(call, m_helpHash,
-                                         currentFrame, groups.isEmpty() ? 0 : groups.top(), this);
+                                         currentFrame, groups.isEmpty() ? 0 : groups.top(), this,
+                                         &callBookmark);
                 Q_ASSERT(apiCall);
                 Q_ASSERT(parsedCalls < allCalls.size());
                 allCalls[parsedCalls++] = apiCall;
@@ -460,10 +593,9 @@ TraceLoader::fetchFrameContents(ApiTraceFrame *currentFrame)
                     groups.pop();
                 }
                 if (apiCall->hasBinaryData()) {
-                    QByteArray data =
-                        apiCall->arguments()[
-                            apiCall->binaryDataIndex()].toByteArray();
-                    binaryDataSize += data.size();
+                    quint64 size;
+                    binaryDataArgument(call, &size);
+                    binaryDataSize += size;
                 }
 
                 delete call;
@@ -472,6 +604,8 @@ TraceLoader::fetchFrameContents(ApiTraceFrame *currentFrame)
                     break;
                 }
 
+                m_parser.getBookmark(callBookmark);
+
             }
             // There can be fewer parsed calls when call in different
             // threads cross the frame boundary
@@ -496,6 +630,7 @@ TraceLoader::fetchFrameContents(ApiTraceFrame *currentFrame)
 
 void TraceLoader::findFrameStart(ApiTraceFrame *frame)
 {
+    QMutexLocker locker(&m_mutex);
     if (!frame->isLoaded()) {
         loadFrame(frame);
     }
@@ -504,6 +639,7 @@ void TraceLoader::findFrameStart(ApiTraceFrame *frame)
 
 void TraceLoader::findFrameEnd(ApiTraceFrame *frame)
 {
+    QMutexLocker locker(&m_mutex);
     if (!frame->isLoaded()) {
         loadFrame(frame);
     }
@@ -512,6 +648,7 @@ void TraceLoader::findFrameEnd(ApiTraceFrame *frame)
 
 void TraceLoader::findCallIndex(int index)
 {
+    QMutexLocker locker(&m_mutex);
     int frameIdx = callInFrame(index);
     ApiTraceFrame *frame = m_createdFrames[frameIdx];
     QVector<ApiTraceCall*> calls = fetchFrameContents(frame);
@@ -529,6 +666,12 @@ void TraceLoader::findCallIndex(int index)
 
 void TraceLoader::search(const ApiTrace::SearchRequest &request)
 {
+    QMutexLocker locker(&m_mutex);
+
+    if (indexedSearch(request)) {
+        return;
+    }
+
     if (request.direction == ApiTrace::SearchRequest::Next) {
         searchNext(request);
     } else {
@@ -536,4 +679,234 @@ void TraceLoader::search(const ApiTrace::SearchRequest &request)
     }
 }
 
+trace::Call *TraceLoader::parseCallAt(trace::Parser &parser,
+                                      const trace::ParseBookmark &bookmark,
+                                      unsigned callNo, int maxCalls)
+{
+    parser.setBookmark(bookmark);
+
+    trace::Call *call;
+    while (maxCalls-- > 0 && (call = parser.parse_call())) {
+        if (call->no == callNo) {
+            return call;
+        }
+        delete call;
+    }
+    return 0;
+}
+
+ApiTraceCallData TraceLoader::callData(const ApiTraceCall *call)
+{
+    // Never take m_mutex here: the loader thread holds it for whole passes
+    // over the trace, and this is called from the GUI thread.
+    QMutexLocker locker(&m_dataMutex);
+
+    ApiTraceCallData *data = m_callData.object(call->index());
+    if (data) {
+        return *data;
+    }
+
+    data = new ApiTraceCallData;
+
+    // Resume scanning from where it was left afterwards
+    trace::ParseBookmark bookmark;
+    m_dataParser.getBookmark(bookmark);
+
+    trace::Call *tcall = parseCallAt(m_dataParser, call->bookmark(),
+                                     call->index(), MAX_INTERLEAVED_CALLS);
+    if (!tcall && call->parentFrame()) {
+        // Fallback to parsing the whole frame
+        FrameBookmark frameBookmark;
+        {
+            QMutexLocker tablesLocker(&m_tablesMutex);
+            frameBookmark =
+                m_frameBookmarks.value(call->parentFrame()->number);
+        }
+        tcall = parseCallAt(m_dataParser, frameBookmark.start, call->index(),
+                            frameBookmark.numberOfCalls);
+    }
+
+    m_dataParser.setBookmark(bookmark);
+
+    int cost = 1;
+    if (tcall) {
+        ApiTraceCall::decode(this, tcall, *data);
+        quint64 size;
+        binaryDataArgument(tcall, &size);
+        cost += size / 1024;
+        delete tcall;
+    } else {
+        qDebug() << "error: failed to re-read call " << call->index();
+    }
+
+    ApiTraceCallData result = *data;
+    m_callData.insert(call->index(), data, cost);
+    return result;
+}
+
+void TraceLoader::startIndexer(const QString &filename)
+{
+    Q_ASSERT(!m_indexer);
+    m_indexer = new TraceIndexer(filename);
+    connect(m_indexer, SIGNAL(finished()),
+            this, SLOT(indexerFinished()));
+    m_indexer->start(QThread::LowPriority);
+}
+
+void TraceLoader::stopIndexer()
+{
+    if (m_indexer) {
+        disconnect(m_indexer, 0, this, 0);
+        m_indexer->stop();
+        m_indexer->wait();
+        delete m_indexer;
+        m_indexer = 0;
+    }
+}
+
+void TraceLoader::indexerFinished()
+{
+    if (sender() != m_indexer) {
+        return;
+    }
+
+    delete m_index;
+    m_index = m_indexer->takeIndex();
+    m_indexer->deleteLater();
+    m_indexer = 0;
+    m_matchesValid = false;
+
+    // Update the count of whatever is being searched for
+    if (m_index && !m_matchesText.isEmpty()) {
+        countMatches(m_matchesText, m_matchesCs);
+    }
+}
+
+const std::vector<unsigned> &
+TraceLoader::indexMatches(const QString &text, Qt::CaseSensitivity cs)
+{
+    Q_ASSERT(m_index);
+    if (!m_matchesValid || text != m_matchesText || cs != m_matchesCs) {
+        m_matchesExact = m_index->lookup(text.toUtf8(),
+                                         cs == Qt::CaseSensitive, m_matches);
+        m_matchesValid = true;
+    }
+    m_matchesText = text;
+    m_matchesCs = cs;
+    return m_matches;
+}
+
+void TraceLoader::countMatches(const QString &text, Qt::CaseSensitivity cs)
+{
+    if (!m_index) {
+        // Remember the text, to count it once the index is built
+        m_matchesText = text;
+        m_matchesCs = cs;
+        emit matchesCounted(text, -1, false);
+        return;
+    }
+
+    /*
+     * The index gives a superset of the matching calls, which is exact for
+     * the usual single word searches.
+     */
+    int count = indexMatches(text, cs).size();
+    emit matchesCounted(text, count, m_matchesExact);
+}
+
+/*
+ * Search using the index, by only parsing the frames with candidate calls.
+ */
+bool TraceLoader::indexedSearch(const ApiTrace::SearchRequest &request)
+{
+    if (!m_index || !m_parser.supportsOffsets()) {
+        return false;
+    }
+
+    const std::vector<unsigned> &matches =
+            indexMatches(request.text, request.cs);
+
+    /*
+     * Frames are visited in file order, as call numbers are not ordered
+     * across threads, and each frame's calls are checked by number.
+     */
+    int frameIdx = m_createdFrames.indexOf(request.frame);
+    if (request.direction == ApiTrace::SearchRequest::Next) {
+        for (; frameIdx < numberOfFrames(); ++frameIdx) {
+            if (frameHasMatches(frameIdx, matches) &&
+                searchFrameMatches(frameIdx, matches, request)) {
+                return true;
+            }
+        }
+    } else {
+        for (; frameIdx >= 0; --frameIdx) {
+            if (frameHasMatches(frameIdx, matches) &&
+                searchFrameMatches(frameIdx, matches, request)) {
+                return true;
+            }
+        }
+    }
+
+    emit searchResult(request, ApiTrace::SearchResult_NotFound, 0);
+    return true;
+}
+
+/*
+ * Whether any candidate call number falls in the range of the frame.
+ */
+bool TraceLoader::frameHasMatches(int frameIdx,
+                                  const std::vector<unsigned> &matches) const
+{
+    const FrameBookmark &frameBookmark = m_frameBookmarks[frameIdx];
+    std::vector<unsigned>::const_iterator it =
+            std::lower_bound(matches.begin(), matches.end(),
+                             frameBookmark.minCallNo);
+    return it != matches.end() && *it <= frameBookmark.maxCallNo;
+}
+
+/*
+ * Check the candidate calls of a frame against the exact search text, and
+ * report the first (or last, when searching backwards) one that matches.
+ */
+bool TraceLoader::searchFrameMatches(int frameIdx,
+                                     const std::vector<unsigned> &matches,
+                                     const ApiTrace::SearchRequest &request)
+{
+    const FrameBookmark &frameBookmark = m_frameBookmarks[frameIdx];
+    int numCallsToParse = frameBookmark.numberOfCalls;
+    bool backwards = request.direction == ApiTrace::SearchRequest::Prev;
+    int foundCallNo = -1;
+
+    m_parser.setBookmark(frameBookmark.start);
+
+    trace::Call *call;
+    while (numCallsToParse > 0 && (call = m_parser.parse_call())) {
+        --numCallsToParse;
+        if (std::binary_search(matches.begin(), matches.end(), call->no) &&
+            callContains(call, request.text, request.cs)) {
+            foundCallNo = call->no;
+            if (!backwards) {
+                delete call;
+                break;
+            }
+        }
+        delete call;
+    }
+
+    if (foundCallNo < 0) {
+        return false;
+    }
+
+    ApiTraceFrame *frame = m_createdFrames[frameIdx];
+    const QVector<ApiTraceCall*> calls = fetchFrameContents(frame);
+    for (int i = 0; i < calls.count(); ++i) {
+        if (calls[i]->index() == foundCallNo) {
+            emit searchResult(request, ApiTrace::SearchResult_Found,
+                              calls[i]);
+            return true;
+        }
+    }
+    return false;
+}
+
 #include "traceloader.moc"
@@ -7,8 +7,18 @@
 #include "trace_parser.hpp"
 
 #include <QObject>
+#include <QCache>
 #include <QList>
 #include <QMap>
+#include <QMutex>
+
+#include <vector>
+
+class TraceIndexer;
+
+namespace trace {
+    class Index;
+}
 
 class TraceLoader : public QObject
 {
@@ -18,11 +28,25 @@ public:
     ~TraceLoader();
 
 
+    /*
+     * The add methods return the signature that ends up in the table, which
+     * is an earlier one when another thread got there first, in which case
+     * the given signature is deleted.
+     */
     ApiTraceCallSignature *signature(unsigned id);
-    void addSignature(unsigned id, ApiTraceCallSignature *signature);
+    ApiTraceCallSignature *addSignature(unsigned id,
+                                        ApiTraceCallSignature *signature);
 
     ApiTraceEnumSignature *enumSignature(unsigned id);
-    void addEnumSignature(unsigned id, ApiTraceEnumSignature *signature);
+    ApiTraceEnumSignature *addEnumSignature(unsigned id,
+                                            ApiTraceEnumSignature *signature);
+
+    /*
+     * Decode the arguments of a call from the trace.  Can be called from any
+     * thread, and never waits for the loader thread, as it reads the call
+     * through a parser of its own.
+     */
+    ApiTraceCallData callData(const ApiTraceCall *call);
 
 public slots:
     void loadTrace(const QString &filename);
@@ -31,6 +55,7 @@ public slots:
     void findFrameEnd(ApiTraceFrame *frame);
     void findCallIndex(int index);
     void search(const ApiTrace::SearchRequest &request);
+    void countMatches(const QString &text, Qt::CaseSensitivity cs);
 
 signals:
     void startedParsing();
@@ -50,18 +75,41 @@ signals:
     void foundFrameStart(ApiTraceFrame *frame);
     void foundFrameEnd(ApiTraceFrame *frame);
     void foundCallIndex(ApiTraceCall *call);
+
+    /*
+     * Number of calls matching the text, or -1 while the search index
+     * is not available.  When not exact, it is the number of candidate
+     * calls, which is an upper bound.
+     */
+    void matchesCounted(const QString &text, int count, bool exact);
+
+private slots:
+    void indexerFinished();
+
 private:
     struct FrameBookmark {
         FrameBookmark()
-            : numberOfCalls(0)
+            : numberOfCalls(0),
+              minCallNo(0),
+              maxCallNo(0)
         {}
         FrameBookmark(const trace::ParseBookmark &s)
             : start(s),
-              numberOfCalls(0)
+              numberOfCalls(0),
+              minCallNo(0),
+              maxCallNo(0)
         {}
 
         trace::ParseBookmark start;
         int numberOfCalls;
+
+        /*
+         * Range of the call numbers in the frame.  Calls of different
+         * threads are numbered on entry but written on exit, so the ranges
+         * of consecutive frames may overlap.
+         */
+        unsigned minCallNo;
+        unsigned maxCallNo;
     };
     int numberOfFrames() const;
     int numberOfCallsInFrame(int frameIdx) const;
@@ -69,12 +117,27 @@ private:
     void loadHelpFile();
     void guessApi(const trace::Call *call);
     void scanTrace();
+    void scanDataParser(const trace::ParseBookmark &bookmark);
     void parseTrace();
 
     void searchNext(const ApiTrace::SearchRequest &request);
     void searchPrev(const ApiTrace::SearchRequest &request);
 
+    void startIndexer(const QString &filename);
+    void stopIndexer();
+    const std::vector<unsigned> &indexMatches(const QString &text,
+                                              Qt::CaseSensitivity cs);
+    bool indexedSearch(const ApiTrace::SearchRequest &request);
+    bool frameHasMatches(int frameIdx,
+                         const std::vector<unsigned> &matches) const;
+    bool searchFrameMatches(int frameIdx,
+                            const std::vector<unsigned> &matches,
+                            const ApiTrace::SearchRequest &request);
+
     int callInFrame(int callIdx) const;
+    static trace::Call *parseCallAt(trace::Parser &parser,
+                                    const trace::ParseBookmark &bookmark,
+                                    unsigned callNo, int maxCalls);
     bool callContains(trace::Call *call,
                       const QString &str,
                       Qt::CaseSensitivity sensitivity);
@@ -84,8 +147,28 @@ private:
                                const ApiTrace::SearchRequest &request);
 
 private:
+    /*
+     * Serializes the loader thread's slots, which may hold it for a whole
+     * pass over the trace.
+     */
+    QMutex m_mutex;
     trace::Parser m_parser;
 
+    /*
+     * Guards the parser and cache used to decode calls on demand.  The
+     * loader thread scans the data parser along with its own, as it must
+     * see the signatures of the calls it decodes first.
+     */
+    QMutex m_dataMutex;
+    trace::Parser m_dataParser;
+    QCache<int, ApiTraceCallData> m_callData;
+
+    /*
+     * Guards the signature tables, and the frame bookmarks when read from
+     * other threads than the loader's.  Only ever held briefly.
+     */
+    QMutex m_tablesMutex;
+
     typedef QMap<int, FrameBookmark> FrameBookmarks;
     FrameBookmarks m_frameBookmarks;
     QList<ApiTraceFrame*> m_createdFrames;
@@ -94,6 +177,16 @@ private:
 
     QVector<ApiTraceCallSignature*> m_signatures;
     QVector<ApiTraceEnumSignature*> m_enumSignatures;
+
+    TraceIndexer *m_indexer;
+    trace::Index *m_index;
+
+    // Last index lookup
+    QString m_matchesText;
+    Qt::CaseSensitivity m_matchesCs;
+    bool m_matchesValid;
+    bool m_matchesExact;
+    std::vector<unsigned> m_matches;
 };
 
 #endif
@@ -111,6 +111,9 @@ public:
     void
     writeMD5(std::ostream &os) const;
 
+    void
+    writeTileHashes(std::ostream &os, const char *comment = NULL, unsigned tileSize = 64) const;
+
     bool
     writePNG(std::ostream &os) const;
 
@@ -125,6 +128,20 @@ public:
 };
 
 
+/*
+ * Pixel span conversions, vectorized where the CPU allows.
+ */
+
+void
+convertRGBAToRGB(unsigned char *dst, const unsigned char *src, unsigned width);
+
+void
+convertRGBAToBGRA(unsigned char *dst, const unsigned char *src, unsigned width);
+
+void
+convertFloatToUnorm8(unsigned char *dst, const float *src, unsigned count);
+
+
 Image *
 readPNG(std::istream &is);
 
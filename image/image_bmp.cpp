@@ -60,14 +60,6 @@ struct InfoHeader {
     uint32_t biClrImportant;
 };
 
-struct Pixel {
-    uint8_t rgbBlue;
-    uint8_t rgbGreen;
-    uint8_t rgbRed;
-    uint8_t rgbAlpha;
-};
-
-
 bool
 Image::writeBMP(const char *filename) const {
     assert(channels == 4);
@@ -75,7 +67,7 @@ Image::writeBMP(const char *filename) const {
 
     struct FileHeader bmfh;
     struct InfoHeader bmih;
-    unsigned x, y;
+    unsigned y;
 
     bmfh.bfType = 0x4d42;
     bmfh.bfSize = 14 + 40 + height*width*4;
@@ -105,34 +97,24 @@ Image::writeBMP(const char *filename) const {
     stream.write((const char *)&bmih, 40);
 
     unsigned stride = width*4;
+    unsigned char *tmp = new unsigned char[stride];
 
+    // BMP rows go bottom-up
     if (flipped) {
         for (y = 0; y < height; ++y) {
-            const unsigned char *ptr = pixels + y * stride;
-            for (x = 0; x < width; ++x) {
-                struct Pixel pixel;
-                pixel.rgbRed   = ptr[x*4 + 0];
-                pixel.rgbGreen = ptr[x*4 + 1];
-                pixel.rgbBlue  = ptr[x*4 + 2];
-                pixel.rgbAlpha = ptr[x*4 + 3];
-                stream.write((const char *)&pixel, 4);
-            }
+            convertRGBAToBGRA(tmp, pixels + y * stride, width);
+            stream.write((const char *)tmp, stride);
         }
     } else {
         y = height;
         while (y--) {
-            const unsigned char *ptr = pixels + y * stride;
-            for (x = 0; x < width; ++x) {
-                struct Pixel pixel;
-                pixel.rgbRed   = ptr[x*4 + 0];
-                pixel.rgbGreen = ptr[x*4 + 1];
-                pixel.rgbBlue  = ptr[x*4 + 2];
-                pixel.rgbAlpha = ptr[x*4 + 3];
-                stream.write((const char *)&pixel, 4);
-            }
+            convertRGBAToBGRA(tmp, pixels + y * stride, width);
+            stream.write((const char *)tmp, stride);
         }
     }
 
+    delete [] tmp;
+
     stream.close();
 
     return true;
@@ -0,0 +1,271 @@
+/**************************************************************************
+ *
+ * Copyright 2014 VMware, Inc.
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ **************************************************************************/
+
+
+/*
+ * Pixel span conversions.
+ *
+ * Each conversion has a portable implementation, and on x86 vectorized ones
+ * which are picked at run time according to the CPU, so that the binaries
+ * still run on processors without them.
+ */
+
+
+#include "image.hpp"
+
+
+#if ((defined(__GNUC__) && __GNUC__ >= 5) || defined(__clang__)) && \
+    (defined(__i386__) || defined(__x86_64__))
+#  define HAVE_SSE_KERNELS 1
+#  define TARGET(isa) __attribute__((target(isa)))
+#  include <emmintrin.h>
+#  include <tmmintrin.h>
+#elif defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+#  define HAVE_SSE_KERNELS 1
+#  define TARGET(isa)
+#  include <intrin.h>
+#  include <emmintrin.h>
+#  include <tmmintrin.h>
+#else
+#  define HAVE_SSE_KERNELS 0
+#endif
+
+
+namespace image {
+
+
+#if HAVE_SSE_KERNELS
+
+/*
+ * These run from static initializers, possibly before the constructor which
+ * initializes the data behind __builtin_cpu_supports, hence the explicit
+ * __builtin_cpu_init calls.
+ */
+
+static bool
+haveSSE2(void) {
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 1);
+    return (info[3] & (1 << 26)) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse2");
+#endif
+}
+
+static bool
+haveSSSE3(void) {
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 1);
+    return (info[2] & (1 << 9)) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("ssse3");
+#endif
+}
+
+#endif /* HAVE_SSE_KERNELS */
+
+
+/*
+ * RGBA -> RGB
+ */
+
+static void
+convertRGBAToRGB_c(unsigned char *dst, const unsigned char *src, unsigned width) {
+    for (unsigned x = 0; x < width; ++x) {
+        dst[0] = src[0];
+        dst[1] = src[1];
+        dst[2] = src[2];
+        dst += 3;
+        src += 4;
+    }
+}
+
+#if HAVE_SSE_KERNELS
+
+TARGET("ssse3") static void
+convertRGBAToRGB_ssse3(unsigned char *dst, const unsigned char *src, unsigned width) {
+    // Pack the RGB of four pixels in the low 12 bytes
+    const __m128i mask = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+    unsigned x = 0;
+    for (; x + 16 <= width; x += 16) {
+        __m128i p0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(src +  0)), mask);
+        __m128i p1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(src + 16)), mask);
+        __m128i p2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(src + 32)), mask);
+        __m128i p3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(src + 48)), mask);
+        _mm_storeu_si128((__m128i *)(dst +  0), _mm_or_si128(p0, _mm_slli_si128(p1, 12)));
+        _mm_storeu_si128((__m128i *)(dst + 16), _mm_or_si128(_mm_srli_si128(p1, 4), _mm_slli_si128(p2, 8)));
+        _mm_storeu_si128((__m128i *)(dst + 32), _mm_or_si128(_mm_srli_si128(p2, 8), _mm_slli_si128(p3, 4)));
+        dst += 48;
+        src += 64;
+    }
+    convertRGBAToRGB_c(dst, src, width - x);
+}
+
+#endif /* HAVE_SSE_KERNELS */
+
+
+/*
+ * RGBA -> BGRA
+ */
+
+static void
+convertRGBAToBGRA_c(unsigned char *dst, const unsigned char *src, unsigned width) {
+    for (unsigned x = 0; x < width; ++x) {
+        dst[0] = src[2];
+        dst[1] = src[1];
+        dst[2] = src[0];
+        dst[3] = src[3];
+        dst += 4;
+        src += 4;
+    }
+}
+
+#if HAVE_SSE_KERNELS
+
+TARGET("ssse3") static void
+convertRGBAToBGRA_ssse3(unsigned char *dst, const unsigned char *src, unsigned width) {
+    const __m128i mask = _mm_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+    unsigned x = 0;
+    for (; x + 4 <= width; x += 4) {
+        __m128i p = _mm_loadu_si128((const __m128i *)src);
+        _mm_storeu_si128((__m128i *)dst, _mm_shuffle_epi8(p, mask));
+        dst += 16;
+        src += 16;
+    }
+    convertRGBAToBGRA_c(dst, src, width - x);
+}
+
+#endif /* HAVE_SSE_KERNELS */
+
+
+/*
+ * float -> unorm8, clamping to [0, 1], and mapping NaN to zero.
+ */
+
+static void
+convertFloatToUnorm8_c(unsigned char *dst, const float *src, unsigned count) {
+    for (unsigned i = 0; i < count; ++i) {
+        float value = src[i];
+        if (!(value > 0.0f)) {
+            value = 0.0f;
+        } else if (value > 1.0f) {
+            value = 1.0f;
+        }
+        dst[i] = (unsigned char)(value * 255.0f + 0.5f);
+    }
+}
+
+#if HAVE_SSE_KERNELS
+
+TARGET("sse2") static void
+convertFloatToUnorm8_sse2(unsigned char *dst, const float *src, unsigned count) {
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 scale = _mm_set1_ps(255.0f);
+    const __m128 half = _mm_set1_ps(0.5f);
+    unsigned i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m128i v[4];
+        for (unsigned j = 0; j < 4; ++j) {
+            // maxps returns the second operand for NaNs
+            __m128 f = _mm_max_ps(_mm_loadu_ps(src + 4*j), zero);
+            f = _mm_min_ps(f, one);
+            v[j] = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(f, scale), half));
+        }
+        __m128i lo = _mm_packs_epi32(v[0], v[1]);
+        __m128i hi = _mm_packs_epi32(v[2], v[3]);
+        _mm_storeu_si128((__m128i *)dst, _mm_packus_epi16(lo, hi));
+        dst += 16;
+        src += 16;
+    }
+    convertFloatToUnorm8_c(dst, src, count - i);
+}
+
+#endif /* HAVE_SSE_KERNELS */
+
+
+/*
+ * Dispatch
+ */
+
+typedef void (*ConvertSpanFunc)(unsigned char *dst, const unsigned char *src, unsigned width);
+typedef void (*ConvertFloatFunc)(unsigned char *dst, const float *src, unsigned count);
+
+static ConvertSpanFunc
+chooseRGBAToRGB(void) {
+#if HAVE_SSE_KERNELS
+    if (haveSSSE3()) {
+        return convertRGBAToRGB_ssse3;
+    }
+#endif
+    return convertRGBAToRGB_c;
+}
+
+static ConvertSpanFunc
+chooseRGBAToBGRA(void) {
+#if HAVE_SSE_KERNELS
+    if (haveSSSE3()) {
+        return convertRGBAToBGRA_ssse3;
+    }
+#endif
+    return convertRGBAToBGRA_c;
+}
+
+static ConvertFloatFunc
+chooseFloatToUnorm8(void) {
+#if HAVE_SSE_KERNELS
+    if (haveSSE2()) {
+        return convertFloatToUnorm8_sse2;
+    }
+#endif
+    return convertFloatToUnorm8_c;
+}
+
+static const ConvertSpanFunc convertRGBAToRGBFunc = chooseRGBAToRGB();
+static const ConvertSpanFunc convertRGBAToBGRAFunc = chooseRGBAToBGRA();
+static const ConvertFloatFunc convertFloatToUnorm8Func = chooseFloatToUnorm8();
+
+
+void
+convertRGBAToRGB(unsigned char *dst, const unsigned char *src, unsigned width) {
+    convertRGBAToRGBFunc(dst, src, width);
+}
+
+void
+convertRGBAToBGRA(unsigned char *dst, const unsigned char *src, unsigned width) {
+    convertRGBAToBGRAFunc(dst, src, width);
+}
+
+void
+convertFloatToUnorm8(unsigned char *dst, const float *src, unsigned count) {
+    convertFloatToUnorm8Func(dst, src, count);
+}
+
+
+} /* namespace image */
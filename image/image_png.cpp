@@ -53,8 +53,6 @@ pngWriteCallback(png_structp png_ptr, png_bytep data, png_size_t length)
 bool
 Image::writePNG(std::ostream &os) const
 {
-    assert(channelType == TYPE_UNORM8);
-
     png_structp png_ptr;
     png_infop info_ptr;
     int color_type;
@@ -102,17 +100,24 @@ Image::writePNG(std::ostream &os) const
 
     png_write_info(png_ptr, info_ptr);
 
-    if (!flipped) {
-        for (unsigned y = 0; y < height; ++y) {
-            png_bytep row = (png_bytep)(pixels + y*width*channels);
-            png_write_rows(png_ptr, &row, 1);
+    if (channelType == TYPE_UNORM8) {
+        for (const unsigned char *row = start(); row != end(); row += stride()) {
+            png_bytep png_row = (png_bytep)row;
+            png_write_rows(png_ptr, &png_row, 1);
         }
     } else {
-        unsigned y = height;
-        while (y--) {
-            png_bytep row = (png_bytep)(pixels + y*width*channels);
-            png_write_rows(png_ptr, &row, 1);
+        /*
+         * Float images are clamped to 8bit unorms.
+         */
+
+        assert(channelType == TYPE_FLOAT);
+
+        png_bytep png_row = new png_byte[width*channels];
+        for (const unsigned char *row = start(); row != end(); row += stride()) {
+            convertFloatToUnorm8(png_row, (const float *)row, width*channels);
+            png_write_rows(png_ptr, &png_row, 1);
         }
+        delete [] png_row;
     }
 
     png_write_end(png_ptr, info_ptr);
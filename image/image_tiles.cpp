@@ -0,0 +1,107 @@
+/**************************************************************************
+ *
+ * Copyright 2014 VMware, Inc.
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ **************************************************************************/
+
+
+/*
+ * Per-tile hashes of images.
+ *
+ * Images are split in square tiles, each hashed with a fast non-cryptographic
+ * hash, so that comparing the hashes of two runs tells not only whether but
+ * also where the images differ, without keeping the images themselves.
+ *
+ * Each image is written as a single line:
+ *
+ *   COMMENT WIDTH HEIGHT TILE_SIZE IMAGE_HASH TILE_HASH...
+ *
+ * with the 64-bit hashes in hexadecimal, and the tiles in row-major order
+ * starting from the top-left corner.
+ */
+
+
+#include <algorithm>
+#include <vector>
+
+#include "fast_hash.hpp"
+#include "image.hpp"
+
+
+namespace image {
+
+
+static void
+writeHash(std::ostream &os, unsigned long long hash) {
+    const char hex[] = "0123456789abcdef";
+    char chash[17];
+    for (int i = 15; i >= 0; --i) {
+        chash[i] = hex[hash & 0xf];
+        hash >>= 4;
+    }
+    chash[16] = '\0';
+    os << chash;
+}
+
+
+void
+Image::writeTileHashes(std::ostream &os, const char *comment, unsigned tileSize) const {
+    unsigned columns = (width + tileSize - 1) / tileSize;
+    unsigned rows = (height + tileSize - 1) / tileSize;
+    std::vector<unsigned long long> tileHashes(columns * rows, fasthash::basis);
+
+    const unsigned char *row = start();
+    for (unsigned y = 0; y < height; ++y, row += stride()) {
+        unsigned long long *rowHashes = &tileHashes[(y / tileSize) * columns];
+        for (unsigned x = 0; x < width; x += tileSize) {
+            unsigned tileWidth = std::min(tileSize, width - x);
+            *rowHashes = fasthash::update(*rowHashes,
+                                          row + x*bytesPerPixel,
+                                          tileWidth*bytesPerPixel);
+            ++rowHashes;
+        }
+    }
+
+    unsigned long long imageHash = fasthash::basis;
+    unsigned header[4] = {width, height, channels, channelType};
+    imageHash = fasthash::update(imageHash, header, sizeof header);
+    for (unsigned i = 0; i < tileHashes.size(); ++i) {
+        tileHashes[i] = fasthash::finish(tileHashes[i]);
+        imageHash = fasthash::update(imageHash, &tileHashes[i], sizeof tileHashes[i]);
+    }
+    imageHash = fasthash::finish(imageHash);
+
+    os << (comment && comment[0] ? comment : "-")
+       << ' ' << width
+       << ' ' << height
+       << ' ' << tileSize
+       << ' ';
+    writeHash(os, imageHash);
+    for (unsigned i = 0; i < tileHashes.size(); ++i) {
+        os << ' ';
+        writeHash(os, tileHashes[i]);
+    }
+    os << '\n';
+}
+
+
+} /* namespace image */
@@ -26,6 +26,8 @@
 
 #include <string.h>
 
+#include <iostream>
+
 #include "os_string.hpp"
 
 #include "d3dstate.hpp"
@@ -53,6 +55,13 @@ retrace::addCallbacks(retrace::Retracer &retracer)
 }
 
 
+void
+retrace::precompile(const char *filename)
+{
+    std::cerr << "warning: --precompile is not supported for Direct3D traces, ignoring\n";
+}
+
+
 void
 retrace::flushRendering(void) {
 }
@@ -61,6 +70,10 @@ void
 retrace::finishRendering(void) {
 }
 
+void
+retrace::releaseRendering(void) {
+}
+
 void
 retrace::waitForInput(void) {
     /* TODO */
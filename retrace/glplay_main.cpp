@@ -144,13 +144,11 @@ getTimeFrequency(void) {
 }
 
 static inline void
-getCurrentVsize(int64_t& vsize) {
-    vsize = os::getVsize();
-}
-
-static inline void
-getCurrentRss(int64_t& rss) {
-    rss = os::getRss();
+getCurrentMemoryUsage(int64_t& vsize, int64_t& rss) {
+    long long currentVsize, currentRss;
+    os::getMemoryUsage(currentVsize, currentRss);
+    vsize = currentVsize;
+    rss = currentRss;
 }
 
 static void
@@ -237,8 +235,7 @@ beginProfile(trace::Call &call, bool isDraw) {
 
     if (play::profilingMemoryUsage) {
         CallQuery& query = callQueries.back();
-        query.vsizeStart = os::getVsize();
-        query.rssStart = os::getRss();
+        getCurrentMemoryUsage(query.vsizeStart, query.rssStart);
     }
 }
 
@@ -264,8 +261,7 @@ endProfile(trace::Call &call, bool isDraw) {
 
     if (play::profilingMemoryUsage) {
         CallQuery& query = callQueries.back();
-        query.vsizeEnd = os::getVsize();
-        query.rssEnd = os::getRss();
+        getCurrentMemoryUsage(query.vsizeEnd, query.rssEnd);
     }
 }
 
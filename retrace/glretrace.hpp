@@ -26,6 +26,8 @@
 #ifndef _GLRETRACE_HPP_
 #define _GLRETRACE_HPP_
 
+#include <vector>
+
 #include "glws.hpp"
 #include "retrace.hpp"
 
@@ -37,7 +39,9 @@ struct Context {
         : wsContext(context),
           drawable(0),
           activeProgram(0),
-          used(false)
+          used(false),
+          lastQuery(0),
+          pendingFrames(0)
     {
     }
 
@@ -50,7 +54,12 @@ struct Context {
 
     GLuint activeProgram;
     bool used;
-    
+
+    // Profiling queries of this context, see glretrace_main.cpp
+    std::vector<GLuint> freeQueries;
+    GLuint lastQuery;
+    unsigned pendingFrames;
+
     // Context must be current
     inline bool
     hasExtension(const char *extension) const {
@@ -60,10 +69,26 @@ struct Context {
 
 extern glws::Profile defaultProfile;
 
-extern bool insideList;
-extern bool insideGlBeginEnd;
 extern bool supportsARBShaderObjects;
 
+/**
+ * Replay state of each thread, as threads replay calls concurrently with
+ * --concurrent.
+ */
+struct ThreadState {
+    ThreadState()
+        : insideList(false),
+          insideGlBeginEnd(false)
+    {
+    }
+
+    bool insideList;
+    bool insideGlBeginEnd;
+};
+
+ThreadState *
+getThreadState(void);
+
 Context *
 getCurrentContext(void);
 
@@ -90,6 +115,9 @@ createContext(Context *shareContext = 0);
 bool
 makeCurrent(trace::Call &call, glws::Drawable *drawable, Context *context);
 
+void
+clearCurrentContext(void);
+
 
 void
 checkGlError(trace::Call &call);
@@ -107,9 +135,18 @@ void initContext();
 void updateDrawable(int width, int height);
 
 void flushQueries();
+void releaseQueries(Context *context);
 void beginProfile(trace::Call &call, bool isDraw);
 void endProfile(trace::Call &call, bool isDraw);
 
+/**
+ * Program binary cache.
+ */
+void addProgramLinkInput(trace::Call &call, GLuint program);
+void deleteProgramLinkInputs(GLuint program);
+void linkProgram(GLuint program);
+void precompilePrograms(const char *filename);
+
 } /* namespace glretrace */
 
 
@@ -27,6 +27,8 @@
 """GL retracer generator."""
 
 
+import re
+
 from retrace import Retracer
 import specs.stdapi as stdapi
 import specs.glapi as glapi
@@ -184,6 +186,52 @@ class GlRetracer(Retracer):
         'glUnmapObjectBufferATI',
     ])
 
+    # Calls which affect how programs get linked
+    program_link_input_function_names = set([
+        'glBindAttribLocation',
+        'glBindFragDataLocation',
+        'glBindFragDataLocationEXT',
+        'glBindFragDataLocationIndexed',
+        'glTransformFeedbackVaryings',
+        'glTransformFeedbackVaryingsEXT',
+        'glProgramParameteri',
+        'glProgramParameteriARB',
+        'glProgramParameteriEXT',
+    ])
+
+    # Calls which modify the objects bound to the current context, and so
+    # possibly shared with other contexts, without naming them, or which
+    # synchronize with other contexts.
+    bound_object_write_function_regex = re.compile(r'^gl(' + r'|'.join([
+        r'(Copy|Compressed)?Tex(Sub)?Image[123]D',
+        r'TexImage[23]DMultisample',
+        r'TexStorage[123]D',
+        r'TexBuffer',
+        r'TexParameter',
+        r'GenerateMipmap',
+        r'Buffer(Sub)?Data',
+        r'BufferStorage',
+        r'CopyBufferSubData',
+        r'ClearBuffer(Sub)?Data',
+        r'EGLImageTarget',
+        r'EndList',
+        r'Flush',
+        r'Finish',
+    ]) + r')')
+
+    def isSharedHandle(self, handle):
+        # Handles keyed by context, such as vertex arrays, name objects
+        # which are never shared
+        return handle.key != glapi.contextKey
+
+    def isConcurrentFunction(self, function):
+        if function.name in self.map_function_names or \
+           function.name in self.unmap_function_names or \
+           function.name in self.pack_function_names or \
+           self.bound_object_write_function_regex.match(function.name):
+            return False
+        return Retracer.isConcurrentFunction(self, function)
+
     def retraceFunctionBody(self, function):
         is_array_pointer = function.name in self.array_pointer_function_names
         is_draw_array = function.name in self.draw_array_function_names
@@ -238,6 +286,8 @@ class GlRetracer(Retracer):
 
 
     def invokeFunction(self, function):
+        print r'    glretrace::ThreadState *_threadState = glretrace::getThreadState();'
+
         # Infer the drawable size from GL calls
         if function.name == "glViewport":
             print '    glretrace::updateDrawable(x + width, y + height);'
@@ -262,7 +312,7 @@ class GlRetracer(Retracer):
             print '    glretrace::updateDrawable(std::max(dstX0, dstX1), std::max(dstY0, dstY1));'
 
         if function.name == "glEnd":
-            print '    glretrace::insideGlBeginEnd = false;'
+            print '    _threadState->insideGlBeginEnd = false;'
 
         if function.name.startswith('gl') and not function.name.startswith('glX'):
             print r'    if (retrace::debug && !glretrace::getCurrentContext()) {'
@@ -321,13 +371,13 @@ class GlRetracer(Retracer):
 
         # Only profile if not inside a list as the queries get inserted into list
         if function.name == 'glNewList':
-            print r'    glretrace::insideList = true;'
+            print r'    _threadState->insideList = true;'
 
         if function.name == 'glEndList':
-            print r'    glretrace::insideList = false;'
+            print r'    _threadState->insideList = false;'
 
         if function.name != 'glEnd':
-            print r'    if (!glretrace::insideList && !glretrace::insideGlBeginEnd && retrace::profiling) {'
+            print r'    if (!_threadState->insideList && !_threadState->insideGlBeginEnd && retrace::profiling) {'
             if profileDraw:
                 print r'        glretrace::beginProfile(call, true);'
             else:
@@ -362,13 +412,21 @@ class GlRetracer(Retracer):
             print r'    } else {'
             Retracer.invokeFunction(self, function)
             print r'    }'
+        elif function.name == 'glLinkProgram':
+            # Possibly load the program from the program binary cache
+            print r'    glretrace::linkProgram(program);'
         else:
             Retracer.invokeFunction(self, function)
 
+        if function.name in self.program_link_input_function_names:
+            print r'    glretrace::addProgramLinkInput(call, program);'
+        if function.name == 'glDeleteProgram':
+            print r'    glretrace::deleteProgramLinkInputs(program);'
+
         if function.name == "glBegin":
-            print '    glretrace::insideGlBeginEnd = true;'
+            print '    _threadState->insideGlBeginEnd = true;'
 
-        print r'    if (!glretrace::insideList && !glretrace::insideGlBeginEnd && retrace::profiling) {'
+        print r'    if (!_threadState->insideList && !_threadState->insideGlBeginEnd && retrace::profiling) {'
         if profileDraw:
             print r'        glretrace::endProfile(call, true);'
         else:
@@ -378,7 +436,7 @@ class GlRetracer(Retracer):
         # Error checking
         if function.name.startswith('gl'):
             # glGetError is not allowed inside glBegin/glEnd
-            print '    if (retrace::debug && !glretrace::insideGlBeginEnd && glretrace::getCurrentContext()) {'
+            print '    if (retrace::debug && !_threadState->insideGlBeginEnd && glretrace::getCurrentContext()) {'
             print '        glretrace::checkGlError(call);'
             if function.name in ('glProgramStringARB', 'glProgramStringNV'):
                 print r'        GLint error_position = -1;'
@@ -493,7 +551,7 @@ class GlRetracer(Retracer):
            and 'program' not in function.argNames():
             # Determine the active program for uniforms swizzling
             print '    GLint program = -1;'
-            print '    if (glretrace::insideList) {'
+            print '    if (glretrace::getThreadState()->insideList) {'
             print '        // glUseProgram & glUseProgramObjectARB are display-list-able'
             print r'    glretrace::Context *currentContext = glretrace::getCurrentContext();'
             print '        program = _program_map[currentContext->activeProgram];'
@@ -0,0 +1,621 @@
+/**************************************************************************
+ *
+ * Copyright 2014 VMware, Inc.
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ **************************************************************************/
+
+/*
+ * On-disk cache of linked program binaries.
+ *
+ * Programs are keyed by a hash of the GL implementation, the type and source
+ * of every attached shader, and the calls which affect linking (attribute and
+ * fragment data locations, transform feedback varyings, program parameters).
+ * On a hit, glLinkProgram is replaced with glProgramBinary, falling back to
+ * linking normally if the implementation rejects the binary.
+ *
+ * The cache can also be filled ahead of the replay, by compiling every
+ * program in the trace concurrently.
+ */
+
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <iostream>
+#include <map>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "os_process.hpp"
+#include "os_string.hpp"
+#include "os_thread.hpp"
+#include "os_time.hpp"
+#include "trace_parser.hpp"
+#include "glproc.hpp"
+#include "glretrace.hpp"
+#include "retrace_swizzle.hpp"
+
+extern "C" {
+    #include "md5.h"
+}
+
+
+namespace glretrace {
+
+
+// Link inputs other than the attached shaders, indexed by program
+typedef std::map<GLuint, std::string> LinkInputMap;
+static LinkInputMap linkInputs;
+
+
+static std::string
+serializeLinkInput(trace::Call &call) {
+    std::ostringstream os;
+    os << call.name();
+    for (unsigned i = 1; i < call.args.size(); ++i) {
+        os << ' ';
+        trace::dump(call.args[i].value, os, trace::DUMP_FLAG_NO_COLOR);
+    }
+    os << '\n';
+    return os.str();
+}
+
+
+void
+addProgramLinkInput(trace::Call &call, GLuint program) {
+    if (!retrace::programCacheDir) {
+        return;
+    }
+
+    std::string linkInput = serializeLinkInput(call);
+
+    retrace::MapLock lock;
+    linkInputs[program] += linkInput;
+}
+
+
+void
+deleteProgramLinkInputs(GLuint program) {
+    retrace::MapLock lock;
+    linkInputs.erase(program);
+}
+
+
+static void
+hashString(struct MD5Context *md5c, const char *s) {
+    if (!s) {
+        s = "";
+    }
+    // Include the terminator, so that strings cannot run into each other
+    MD5Update(md5c, (unsigned char *)s, strlen(s) + 1);
+}
+
+
+static std::string
+describeShader(GLenum type, const std::string &source) {
+    std::ostringstream os;
+    os << type << '\n' << source;
+    return os.str();
+}
+
+
+/*
+ * The key deliberately leaves out GL_VERSION, as the precompilation contexts
+ * need not have the same profile as the traced ones, and sorts the shaders,
+ * as glGetAttachedShaders returns them in no particular order.  Binaries the
+ * implementation cannot use are rejected by glProgramBinary anyway.
+ */
+static os::String
+getCacheFilename(std::vector<std::string> &shaders, const std::string &programLinkInputs) {
+    struct MD5Context md5c;
+    MD5Init(&md5c);
+
+    hashString(&md5c, (const char *)glGetString(GL_VENDOR));
+    hashString(&md5c, (const char *)glGetString(GL_RENDERER));
+
+    std::sort(shaders.begin(), shaders.end());
+    for (unsigned i = 0; i < shaders.size(); ++i) {
+        hashString(&md5c, shaders[i].c_str());
+    }
+
+    hashString(&md5c, programLinkInputs.c_str());
+
+    unsigned char signature[16];
+    MD5Final(signature, &md5c);
+
+    const char hex[] = "0123456789abcdef";
+    char csig[33];
+    for (unsigned i = 0; i < sizeof signature; ++i) {
+        csig[2*i    ] = hex[signature[i] >> 4];
+        csig[2*i + 1] = hex[signature[i] & 0xf];
+    }
+    csig[32] = '\0';
+
+    os::String filename(retrace::programCacheDir);
+    filename.join(csig);
+    filename.append(".bin");
+    return filename;
+}
+
+
+static os::String
+getCacheFilename(GLuint program) {
+    GLint count = 0;
+    glGetProgramiv(program, GL_ATTACHED_SHADERS, &count);
+    std::vector<GLuint> attachedShaders(count + 1);
+    glGetAttachedShaders(program, count, &count, &attachedShaders[0]);
+
+    std::vector<std::string> shaders;
+    for (GLint i = 0; i < count; ++i) {
+        GLint type = 0;
+        glGetShaderiv(attachedShaders[i], GL_SHADER_TYPE, &type);
+
+        GLint length = 0;
+        glGetShaderiv(attachedShaders[i], GL_SHADER_SOURCE_LENGTH, &length);
+        std::vector<GLchar> source(length + 1);
+        glGetShaderSource(attachedShaders[i], length + 1, NULL, &source[0]);
+
+        shaders.push_back(describeShader(type, &source[0]));
+    }
+
+    std::string programLinkInputs;
+    {
+        retrace::MapLock lock;
+        LinkInputMap::const_iterator it = linkInputs.find(program);
+        if (it != linkInputs.end()) {
+            programLinkInputs = it->second;
+        }
+    }
+
+    return getCacheFilename(shaders, programLinkInputs);
+}
+
+
+static bool
+loadProgramBinary(GLuint program, const char *filename) {
+    FILE *file = fopen(filename, "rb");
+    if (!file) {
+        return false;
+    }
+
+    std::vector<char> binary;
+    GLenum format = 0;
+    bool read = fread(&format, sizeof format, 1, file) == 1;
+    if (read) {
+        char buffer[65536];
+        size_t length;
+        while ((length = fread(buffer, 1, sizeof buffer, file)) > 0) {
+            binary.insert(binary.end(), buffer, buffer + length);
+        }
+        read = !ferror(file) && !binary.empty();
+    }
+    fclose(file);
+    if (!read) {
+        return false;
+    }
+
+    glProgramBinary(program, format, &binary[0], binary.size());
+
+    GLint linkStatus = GL_FALSE;
+    glGetProgramiv(program, GL_LINK_STATUS, &linkStatus);
+    if (!linkStatus) {
+        // Clear any error due to an unsupported format
+        while (glGetError() != GL_NO_ERROR)
+            ;
+        if (retrace::verbosity >= 1) {
+            std::cerr << "warning: cached program binary " << filename << " rejected, relinking\n";
+        }
+        return false;
+    }
+
+    return true;
+}
+
+
+static os::mutex tempMutex;
+static unsigned tempCount = 0;
+
+
+static void
+storeProgramBinary(GLuint program, const char *filename) {
+    GLint linkStatus = GL_FALSE;
+    glGetProgramiv(program, GL_LINK_STATUS, &linkStatus);
+    GLint length = 0;
+    glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+    if (!linkStatus || length <= 0) {
+        return;
+    }
+
+    std::vector<char> binary(length);
+    GLenum format = 0;
+    glGetProgramBinary(program, length, &length, &format, &binary[0]);
+    if (length <= 0) {
+        return;
+    }
+
+    // Write to a temporary file first, so that neither other threads nor
+    // other processes sharing the cache ever see a partially written binary
+    unsigned count;
+    {
+        os::unique_lock<os::mutex> lock(tempMutex);
+        count = tempCount++;
+    }
+    os::String tempFilename = os::String::format("%s.%lu.%u.tmp", filename, (unsigned long)os::getCurrentProcessId(), count);
+
+    FILE *file = fopen(tempFilename, "wb");
+    if (!file) {
+        return;
+    }
+    bool written = fwrite(&format, sizeof format, 1, file) == 1 &&
+                   fwrite(&binary[0], 1, length, file) == (size_t)length;
+    if (fclose(file) != 0 || !written ||
+        rename(tempFilename, filename) != 0) {
+        // Renaming fails on Windows when another thread stored it already
+        remove(tempFilename);
+    }
+}
+
+
+void
+linkProgram(GLuint program) {
+    Context *currentContext = getCurrentContext();
+    if (!retrace::programCacheDir ||
+        !currentContext ||
+        !currentContext->hasExtension("GL_ARB_get_program_binary")) {
+        glLinkProgram(program);
+        return;
+    }
+
+    os::String filename = getCacheFilename(program);
+    if (loadProgramBinary(program, filename)) {
+        return;
+    }
+
+    glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+    glLinkProgram(program);
+    storeProgramBinary(program, filename);
+}
+
+
+
+/*
+ * Precompilation pre-pass.
+ *
+ * The trace is scanned for every program it links, and those not yet in the
+ * cache are compiled and linked up front on worker threads, each with its own
+ * context, so that the replay finds them all in the cache.
+ */
+
+
+// Only the calls which define programs need their arguments parsed
+class PrecompileFilter : public trace::CallFilter
+{
+protected:
+    mutable std::vector<signed char> cache;
+
+    static bool
+    isRelevant(const char *name) {
+        return strcmp(name, "glCreateShader") == 0 ||
+               strcmp(name, "glShaderSource") == 0 ||
+               strcmp(name, "glCreateProgram") == 0 ||
+               strcmp(name, "glAttachShader") == 0 ||
+               strcmp(name, "glDetachShader") == 0 ||
+               strcmp(name, "glLinkProgram") == 0 ||
+               strcmp(name, "glDeleteProgram") == 0 ||
+               isLinkInput(name);
+    }
+
+public:
+    static bool
+    isLinkInput(const char *name) {
+        return strncmp(name, "glBindAttribLocation", 20) == 0 ||
+               strncmp(name, "glBindFragDataLocation", 22) == 0 ||
+               strncmp(name, "glTransformFeedbackVaryings", 27) == 0 ||
+               strncmp(name, "glProgramParameteri", 19) == 0;
+    }
+
+    bool
+    contains(const trace::Call &call) const {
+        unsigned id = call.sig->id;
+        if (id >= cache.size()) {
+            cache.resize(id + 1, -1);
+        }
+        if (cache[id] < 0) {
+            cache[id] = isRelevant(call.sig->name);
+        }
+        return cache[id];
+    }
+};
+
+
+struct PrecompileShader {
+    GLenum type;
+    std::string source;
+};
+
+
+struct PrecompileProgram {
+    std::set<GLuint> shaders;
+    std::string linkInputs;
+    std::vector<trace::Call *> linkInputCalls;
+};
+
+
+struct PrecompileJob {
+    std::vector<PrecompileShader> shaders;
+    std::string linkInputs;
+    std::vector<trace::Call *> linkInputCalls;
+    os::String filename;
+};
+
+
+static std::vector<PrecompileJob> precompileJobs;
+static unsigned nextPrecompileJob;
+static os::mutex precompileMutex;
+
+
+// The kept calls refer to the parser's signatures, so the parser must stay
+// open for as long as they are in use.
+static void
+scanPrograms(trace::Parser &parser, std::vector<trace::Call *> &keptCalls) {
+    PrecompileFilter filter;
+    parser.setCallFilter(&filter);
+
+    std::map<GLuint, PrecompileShader> shaders;
+    std::map<GLuint, PrecompileProgram> programs;
+
+    trace::Call *call;
+    while ((call = parser.parse_call())) {
+        const char *name = call->name();
+        bool keep = false;
+
+        if (!filter.contains(*call)) {
+            // skip
+        } else if (strcmp(name, "glCreateProgram") == 0) {
+            if (call->ret) {
+                programs[call->ret->toUInt()] = PrecompileProgram();
+            }
+        } else if (call->args.empty()) {
+            // skip
+        } else if (strcmp(name, "glCreateShader") == 0) {
+            if (call->ret) {
+                PrecompileShader &shader = shaders[call->ret->toUInt()];
+                shader.type = call->arg(0).toUInt();
+                shader.source.clear();
+            }
+        } else if (strcmp(name, "glShaderSource") == 0) {
+            std::string source;
+            const trace::Array *strings = call->arg(2).toArray();
+            if (strings) {
+                for (unsigned i = 0; i < strings->size(); ++i) {
+                    const char *string = strings->values[i]->toString();
+                    if (string) {
+                        source += string;
+                    }
+                }
+            }
+            shaders[call->arg(0).toUInt()].source = source;
+        } else if (strcmp(name, "glDeleteProgram") == 0) {
+            programs.erase(call->arg(0).toUInt());
+        } else if (strcmp(name, "glAttachShader") == 0) {
+            programs[call->arg(0).toUInt()].shaders.insert(call->arg(1).toUInt());
+        } else if (strcmp(name, "glDetachShader") == 0) {
+            programs[call->arg(0).toUInt()].shaders.erase(call->arg(1).toUInt());
+        } else if (strcmp(name, "glLinkProgram") == 0) {
+            PrecompileProgram &program = programs[call->arg(0).toUInt()];
+            PrecompileJob job;
+            std::set<GLuint>::const_iterator it;
+            for (it = program.shaders.begin(); it != program.shaders.end(); ++it) {
+                job.shaders.push_back(shaders[*it]);
+            }
+            job.linkInputs = program.linkInputs;
+            job.linkInputCalls = program.linkInputCalls;
+            precompileJobs.push_back(job);
+        } else if (PrecompileFilter::isLinkInput(name)) {
+            PrecompileProgram &program = programs[call->arg(0).toUInt()];
+            program.linkInputs += serializeLinkInput(*call);
+            program.linkInputCalls.push_back(call);
+            keep = true;
+        }
+
+        if (keep) {
+            keptCalls.push_back(call);
+        } else {
+            delete call;
+        }
+    }
+
+    parser.setCallFilter(NULL);
+}
+
+
+static void
+applyLinkInput(trace::Call &call, GLuint program) {
+    const char *name = call.name();
+    if (strncmp(name, "glBindAttribLocation", 20) == 0) {
+        glBindAttribLocation(program, call.arg(1).toUInt(), call.arg(2).toString());
+    } else if (strncmp(name, "glBindFragDataLocationIndexed", 29) == 0) {
+        glBindFragDataLocationIndexed(program, call.arg(1).toUInt(), call.arg(2).toUInt(), call.arg(3).toString());
+    } else if (strncmp(name, "glBindFragDataLocation", 22) == 0) {
+        glBindFragDataLocation(program, call.arg(1).toUInt(), call.arg(2).toString());
+    } else if (strncmp(name, "glTransformFeedbackVaryings", 27) == 0) {
+        std::vector<const GLchar *> varyings;
+        const trace::Array *names = call.arg(2).toArray();
+        if (names) {
+            for (unsigned i = 0; i < names->size(); ++i) {
+                varyings.push_back(names->values[i]->toString());
+            }
+        }
+        varyings.push_back(NULL);
+        glTransformFeedbackVaryings(program, varyings.size() - 1, &varyings[0], call.arg(3).toUInt());
+    } else if (strncmp(name, "glProgramParameteri", 19) == 0) {
+        glProgramParameteri(program, call.arg(1).toUInt(), call.arg(2).toSInt());
+    }
+}
+
+
+static void
+precompileProgram(const PrecompileJob &job) {
+    GLuint program = glCreateProgram();
+
+    std::vector<GLuint> shaders;
+    for (unsigned i = 0; i < job.shaders.size(); ++i) {
+        GLuint shader = glCreateShader(job.shaders[i].type);
+        const GLchar *source = job.shaders[i].source.c_str();
+        glShaderSource(shader, 1, &source, NULL);
+        glCompileShader(shader);
+        glAttachShader(program, shader);
+        shaders.push_back(shader);
+    }
+
+    for (unsigned i = 0; i < job.linkInputCalls.size(); ++i) {
+        applyLinkInput(*job.linkInputCalls[i], program);
+    }
+
+    glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+    glLinkProgram(program);
+    storeProgramBinary(program, job.filename);
+
+    for (unsigned i = 0; i < shaders.size(); ++i) {
+        glDeleteShader(shaders[i]);
+    }
+    glDeleteProgram(program);
+}
+
+
+struct PrecompileWorker {
+    Context *context;
+    glws::Drawable *drawable;
+    os::thread thread;
+};
+
+
+static void *
+precompileThread(PrecompileWorker *worker) {
+    glws::makeCurrent(worker->drawable, worker->context->wsContext);
+
+    while (true) {
+        unsigned index;
+        {
+            os::unique_lock<os::mutex> lock(precompileMutex);
+            index = nextPrecompileJob++;
+        }
+        if (index >= precompileJobs.size()) {
+            break;
+        }
+        precompileProgram(precompileJobs[index]);
+    }
+
+    glws::makeCurrent(NULL, NULL);
+    return 0;
+}
+
+
+void
+precompilePrograms(const char *filename) {
+    assert(retrace::programCacheDir);
+
+    long long startTime = os::getTime();
+
+    trace::Parser parser;
+    if (!parser.open(filename)) {
+        return;
+    }
+
+    std::vector<trace::Call *> keptCalls;
+    scanPrograms(parser, keptCalls);
+
+    std::vector<PrecompileWorker> workers(1);
+    workers[0].context = createContext();
+    workers[0].drawable = createPbuffer(32, 32);
+    glws::makeCurrent(workers[0].drawable, workers[0].context->wsContext);
+
+    std::vector<PrecompileJob> jobs;
+    if (workers[0].context->hasExtension("GL_ARB_get_program_binary")) {
+        // Drop programs linked more than once and those already cached
+        std::set<std::string> filenames;
+        for (unsigned i = 0; i < precompileJobs.size(); ++i) {
+            PrecompileJob &job = precompileJobs[i];
+            std::vector<std::string> shaders;
+            for (unsigned j = 0; j < job.shaders.size(); ++j) {
+                shaders.push_back(describeShader(job.shaders[j].type, job.shaders[j].source));
+            }
+            job.filename = getCacheFilename(shaders, job.linkInputs);
+            if (filenames.insert(std::string(job.filename)).second &&
+                !job.filename.exists()) {
+                jobs.push_back(job);
+            }
+        }
+    } else if (retrace::verbosity >= 0) {
+        std::cerr << "warning: GL_ARB_get_program_binary not supported, skipping precompilation\n";
+    }
+    precompileJobs.swap(jobs);
+    nextPrecompileJob = 0;
+
+    glws::makeCurrent(NULL, NULL);
+
+    // Contexts and drawables are created on this thread, as their creation
+    // is not thread-safe.
+    unsigned numWorkers = std::max(os::thread::hardware_concurrency(), 1U);
+    numWorkers = std::min(numWorkers, (unsigned)precompileJobs.size());
+    for (unsigned i = 1; i < numWorkers; ++i) {
+        PrecompileWorker worker;
+        worker.context = createContext();
+        worker.drawable = createPbuffer(32, 32);
+        workers.push_back(worker);
+    }
+
+    for (unsigned i = 0; i < numWorkers; ++i) {
+        workers[i].thread = os::thread(precompileThread, &workers[i]);
+    }
+    for (unsigned i = 0; i < numWorkers; ++i) {
+        workers[i].thread.join();
+    }
+
+    for (unsigned i = 0; i < workers.size(); ++i) {
+        delete workers[i].drawable;
+        delete workers[i].context;
+    }
+
+    for (unsigned i = 0; i < keptCalls.size(); ++i) {
+        delete keptCalls[i];
+    }
+    parser.close();
+
+    // Keep stdout clean for profiles
+    if (retrace::verbosity >= 0) {
+        double elapsed = (os::getTime() - startTime) / (double)os::timeFrequency;
+        std::cout <<
+            "Precompiled " << precompileJobs.size() << " programs"
+            " on " << numWorkers << " threads"
+            " in " << elapsed << " secs\n";
+    }
+
+    precompileJobs.clear();
+}
+
+
+} /* namespace glretrace */
@@ -369,7 +369,7 @@ static void retrace_CGLTexImageIOSurface2D(trace::Call &call) {
 
     glTexImage2D(target, level, internalformat, width, height, border, format, type, pixels);
 
-    if (retrace::debug && !glretrace::insideGlBeginEnd) {
+    if (retrace::debug && !glretrace::getThreadState()->insideGlBeginEnd) {
         glretrace::checkGlError(call);
     }
 }
@@ -28,12 +28,15 @@
 
 #include <string.h>
 
+#include <vector>
+
 #include "retrace.hpp"
 #include "glproc.hpp"
 #include "glstate.hpp"
 #include "glretrace.hpp"
 #include "os_time.hpp"
 #include "os_memory.hpp"
+#include "os_thread.hpp"
 
 /* Synchronous debug output may reduce performance however,
  * without it the callNo in the callback may be inaccurate
@@ -45,10 +48,20 @@ namespace glretrace {
 
 glws::Profile defaultProfile = glws::PROFILE_COMPAT;
 
-bool insideList = false;
-bool insideGlBeginEnd = false;
 bool supportsARBShaderObjects = false;
 
+static OS_THREAD_SPECIFIC_PTR(ThreadState)
+threadStatePtr;
+
+ThreadState *
+getThreadState(void) {
+    ThreadState *threadState = threadStatePtr;
+    if (!threadState) {
+        threadStatePtr = threadState = new ThreadState;
+    }
+    return threadState;
+}
+
 enum {
     GPU_START = 0,
     GPU_DURATION,
@@ -56,6 +69,21 @@ enum {
     NUM_QUERIES,
 };
 
+/* Number of frames queries are left pending for, before waiting for their
+ * results. */
+#define MAX_PENDING_FRAMES 3
+
+/* Number of query objects to create at once when the pool runs dry. */
+#define QUERY_POOL_GROWTH 256
+
+/*
+ * Pending profiled call.  Entries with a NULL sig mark the end of a frame of
+ * their context, and hold the last query of that frame in ids[0].
+ *
+ * Query results can only be read while the context owning them is current,
+ * so they are read into the entry (resolved) as soon as possible, but entries
+ * are only added to the profile once all preceding entries were resolved.
+ */
 struct CallQuery
 {
     GLuint ids[NUM_QUERIES];
@@ -63,6 +91,11 @@ struct CallQuery
     bool isDraw;
     GLuint program;
     const trace::FunctionSig *sig;
+    Context *context;
+    bool resolved;
+    int64_t gpuStart;
+    int64_t gpuDuration;
+    int64_t pixels;
     int64_t cpuStart;
     int64_t cpuEnd;
     int64_t vsizeStart;
@@ -76,7 +109,10 @@ static bool supportsTimestamp = true;
 static bool supportsOcclusion = true;
 static bool supportsDebugOutput = true;
 
-static std::list<CallQuery> callQueries;
+/* Calls not added to the profile yet, in call order, starting at
+ * firstPendingQuery. */
+static std::vector<CallQuery> callQueries;
+static size_t firstPendingQuery = 0;
 
 static void APIENTRY
 debugOutputCallback(GLenum source, GLenum type, GLuint id, GLenum severity, GLsizei length, const GLchar* message, const void* userParam);
@@ -148,36 +184,62 @@ getTimeFrequency(void) {
 }
 
 static inline void
-getCurrentVsize(int64_t& vsize) {
-    vsize = os::getVsize();
+getCurrentMemoryUsage(int64_t& vsize, int64_t& rss) {
+    long long currentVsize, currentRss;
+    os::getMemoryUsage(currentVsize, currentRss);
+    vsize = currentVsize;
+    rss = currentRss;
 }
 
-static inline void
-getCurrentRss(int64_t& rss) {
-    rss = os::getRss();
+static inline GLuint
+allocQuery(Context *context) {
+    std::vector<GLuint> &freeQueries = context->freeQueries;
+    if (freeQueries.empty()) {
+        freeQueries.resize(QUERY_POOL_GROWTH);
+        glGenQueries(QUERY_POOL_GROWTH, &freeQueries[0]);
+    }
+    GLuint id = freeQueries.back();
+    freeQueries.pop_back();
+    return id;
 }
 
+/**
+ * Read the results of a call's queries, which must belong to the current
+ * context, and recycle them.  Without read, the results are dropped.
+ */
 static void
-completeCallQuery(CallQuery& query) {
-    /* Get call start and duration */
-    int64_t gpuStart = 0, gpuDuration = 0, cpuDuration = 0, pixels = 0, vsizeDuration = 0, rssDuration = 0;
-
-    if (query.isDraw) {
-        if (retrace::profilingGpuTimes) {
-            if (supportsTimestamp) {
-                glGetQueryObjecti64vEXT(query.ids[GPU_START], GL_QUERY_RESULT, &gpuStart);
-            }
+resolveCallQuery(CallQuery& query, bool read) {
+    query.resolved = true;
+    if (!query.isDraw || !read) {
+        return;
+    }
 
-            glGetQueryObjecti64vEXT(query.ids[GPU_DURATION], GL_QUERY_RESULT, &gpuDuration);
+    std::vector<GLuint> &freeQueries = query.context->freeQueries;
+    if (retrace::profilingGpuTimes) {
+        if (supportsTimestamp) {
+            glGetQueryObjecti64vEXT(query.ids[GPU_START], GL_QUERY_RESULT, &query.gpuStart);
+            freeQueries.push_back(query.ids[GPU_START]);
         }
 
-        if (retrace::profilingPixelsDrawn) {
-            glGetQueryObjecti64vEXT(query.ids[OCCLUSION], GL_QUERY_RESULT, &pixels);
-        }
+        glGetQueryObjecti64vEXT(query.ids[GPU_DURATION], GL_QUERY_RESULT, &query.gpuDuration);
+        freeQueries.push_back(query.ids[GPU_DURATION]);
+    }
 
-    } else {
-        pixels = -1;
+    if (retrace::profilingPixelsDrawn) {
+        glGetQueryObjecti64vEXT(query.ids[OCCLUSION], GL_QUERY_RESULT, &query.pixels);
+        freeQueries.push_back(query.ids[OCCLUSION]);
     }
+}
+
+static void
+completeCallQuery(CallQuery& query) {
+    if (!query.sig) {
+        retrace::profiler.addFrameEnd();
+        return;
+    }
+
+    /* Get call start and duration */
+    int64_t cpuDuration = 0, vsizeDuration = 0, rssDuration = 0;
 
     if (retrace::profilingCpuTimes) {
         double cpuTimeScale = 1.0E9 / getTimeFrequency();
@@ -190,19 +252,169 @@ completeCallQuery(CallQuery& query) {
         rssDuration = query.rssEnd - query.rssStart;
     }
 
-    glDeleteQueries(NUM_QUERIES, query.ids);
-
     /* Add call to profile */
-    retrace::profiler.addCall(query.call, query.sig->name, query.program, pixels, gpuStart, gpuDuration, query.cpuStart, cpuDuration, query.vsizeStart, vsizeDuration, query.rssStart, rssDuration);
+    retrace::profiler.addCall(query.call, query.sig->name, query.program, query.pixels, query.gpuStart, query.gpuDuration, query.cpuStart, cpuDuration, query.vsizeStart, vsizeDuration, query.rssStart, rssDuration);
+}
+
+/**
+ * Add the resolved calls at the head of the pending ones to the profile.
+ */
+static void
+completeCallQueries(void) {
+    while (firstPendingQuery < callQueries.size() &&
+           callQueries[firstPendingQuery].resolved) {
+        completeCallQuery(callQueries[firstPendingQuery++]);
+    }
+
+    if (firstPendingQuery == callQueries.size()) {
+        callQueries.clear();
+        firstPendingQuery = 0;
+    } else if (firstPendingQuery > callQueries.size() / 2) {
+        callQueries.erase(callQueries.begin(), callQueries.begin() + firstPendingQuery);
+        firstPendingQuery = 0;
+    }
+}
+
+/**
+ * Resolve the calls of the context's oldest pending frame, or all of its
+ * calls when wholeContext is set.
+ */
+static void
+resolveFrame(Context *context, bool read, bool wholeContext = false) {
+    for (size_t i = firstPendingQuery; i < callQueries.size(); ++i) {
+        CallQuery &query = callQueries[i];
+        if (query.context != context || query.resolved) {
+            continue;
+        }
+        resolveCallQuery(query, read);
+        if (!query.sig) {
+            --context->pendingFrames;
+            if (!wholeContext) {
+                break;
+            }
+        }
+    }
+}
+
+/**
+ * Whether the results of the context's oldest pending frame can be read
+ * without stalling.  Queries complete in order, so it suffices to check its
+ * last one.
+ */
+static bool
+isFrameAvailable(Context *context) {
+    for (size_t i = firstPendingQuery; i < callQueries.size(); ++i) {
+        const CallQuery &query = callQueries[i];
+        if (!query.sig && query.context == context && !query.resolved) {
+            GLuint available = GL_TRUE;
+            if (query.ids[0]) {
+                glGetQueryObjectuiv(query.ids[0], GL_QUERY_RESULT_AVAILABLE, &available);
+            }
+            return available != GL_FALSE;
+        }
+    }
+    return false;
+}
+
+/**
+ * Mark the end of a frame, and resolve the previous frames of the current
+ * context which are available, waiting only when too many frames are pending.
+ */
+static void
+endFrameQueries(void) {
+    Context *currentContext = getCurrentContext();
+
+    CallQuery marker;
+    memset(&marker, 0, sizeof marker);
+    marker.context = currentContext;
+    if (currentContext) {
+        marker.ids[0] = currentContext->lastQuery;
+        currentContext->lastQuery = 0;
+        ++currentContext->pendingFrames;
+    } else {
+        marker.resolved = true;
+    }
+    callQueries.push_back(marker);
+
+    if (currentContext) {
+        while (currentContext->pendingFrames > MAX_PENDING_FRAMES ||
+               (currentContext->pendingFrames && isFrameAvailable(currentContext))) {
+            resolveFrame(currentContext, true);
+        }
+    }
+
+    completeCallQueries();
+}
+
+static bool
+hasPendingQueries(Context *context) {
+    for (size_t i = firstPendingQuery; i < callQueries.size(); ++i) {
+        const CallQuery &query = callQueries[i];
+        if (query.context == context && query.isDraw && !query.resolved) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Resolve all the pending calls of the context, and release its query
+ * objects.  Their results are lost unless the context is current on this
+ * thread, which the caller tells, as glretrace's notion of the current
+ * context is not updated when switching contexts only temporarily.
+ */
+static void
+finishContextQueries(Context *context, bool current) {
+    if (!current && hasPendingQueries(context)) {
+        std::cerr << "warning: lost the profiling results of a context which could not be made current\n";
+    }
+
+    resolveFrame(context, current, true);
+    assert(context->pendingFrames == 0);
+    context->lastQuery = 0;
+
+    if (current && !context->freeQueries.empty()) {
+        glDeleteQueries(context->freeQueries.size(), &context->freeQueries[0]);
+    }
+    context->freeQueries.clear();
 }
 
+void
+releaseQueries(Context *context) {
+    finishContextQueries(context, context == getCurrentContext());
+    completeCallQueries();
+}
+
+/**
+ * Resolve all pending calls, making their contexts current in turn, and add
+ * them to the profile.
+ */
 void
 flushQueries() {
-    for (std::list<CallQuery>::iterator itr = callQueries.begin(); itr != callQueries.end(); ++itr) {
-        completeCallQuery(*itr);
+    Context *currentContext = getCurrentContext();
+
+    for (size_t i = firstPendingQuery; i < callQueries.size(); ++i) {
+        Context *context = callQueries[i].context;
+        if (callQueries[i].resolved || context == currentContext) {
+            continue;
+        }
+        // Contexts current on other threads were released by them already,
+        // see retrace::releaseRendering()
+        if (context->drawable &&
+            glws::makeCurrent(context->drawable, context->wsContext)) {
+            finishContextQueries(context, true);
+            glws::makeCurrent(currentContext ? currentContext->drawable : NULL,
+                              currentContext ? currentContext->wsContext : NULL);
+        } else {
+            finishContextQueries(context, false);
+        }
+    }
+
+    if (currentContext) {
+        finishContextQueries(currentContext, true);
     }
 
-    callQueries.clear();
+    completeCallQueries();
 }
 
 void
@@ -211,25 +423,32 @@ beginProfile(trace::Call &call, bool isDraw) {
 
     /* Create call query */
     CallQuery query;
-    query.isDraw = isDraw;
+    memset(&query, 0, sizeof query);
+    query.isDraw = isDraw && currentContext;
     query.call = call.no;
     query.sig = call.sig;
+    query.context = currentContext;
+    query.resolved = !query.isDraw;
     query.program = currentContext ? currentContext->activeProgram : 0;
-
-    glGenQueries(NUM_QUERIES, query.ids);
+    query.pixels = query.isDraw ? 0 : -1;
 
     /* GPU profiling only for draw calls */
-    if (isDraw) {
+    if (query.isDraw) {
         if (retrace::profilingGpuTimes) {
             if (supportsTimestamp) {
+                query.ids[GPU_START] = allocQuery(currentContext);
                 glQueryCounter(query.ids[GPU_START], GL_TIMESTAMP);
             }
 
+            query.ids[GPU_DURATION] = allocQuery(currentContext);
             glBeginQuery(GL_TIME_ELAPSED, query.ids[GPU_DURATION]);
+            currentContext->lastQuery = query.ids[GPU_DURATION];
         }
 
         if (retrace::profilingPixelsDrawn) {
+            query.ids[OCCLUSION] = allocQuery(currentContext);
             glBeginQuery(GL_SAMPLES_PASSED, query.ids[OCCLUSION]);
+            currentContext->lastQuery = query.ids[OCCLUSION];
         }
     }
 
@@ -243,8 +462,7 @@ beginProfile(trace::Call &call, bool isDraw) {
 
     if (retrace::profilingMemoryUsage) {
         CallQuery& query = callQueries.back();
-        query.vsizeStart = os::getVsize();
-        query.rssStart = os::getRss();
+        getCurrentMemoryUsage(query.vsizeStart, query.rssStart);
     }
 }
 
@@ -258,7 +476,7 @@ endProfile(trace::Call &call, bool isDraw) {
     }
 
     /* GPU profiling only for draw calls */
-    if (isDraw) {
+    if (callQueries.back().isDraw) {
         if (retrace::profilingGpuTimes) {
             glEndQuery(GL_TIME_ELAPSED);
         }
@@ -270,8 +488,7 @@ endProfile(trace::Call &call, bool isDraw) {
 
     if (retrace::profilingMemoryUsage) {
         CallQuery& query = callQueries.back();
-        query.vsizeEnd = os::getVsize();
-        query.rssEnd = os::getRss();
+        getCurrentMemoryUsage(query.vsizeEnd, query.rssEnd);
     }
 }
 
@@ -332,9 +549,8 @@ initContext() {
 
     if (retrace::profilingMemoryUsage) {
         GLint64 currentVsize, currentRss;
-        getCurrentVsize(currentVsize);
+        getCurrentMemoryUsage(currentVsize, currentRss);
         retrace::profiler.setBaseVsizeUsage(currentVsize);
-        getCurrentRss(currentRss);
         retrace::profiler.setBaseRssUsage(currentRss);
     }
 }
@@ -342,11 +558,8 @@ initContext() {
 void
 frame_complete(trace::Call &call) {
     if (retrace::profiling) {
-        /* Complete any remaining queries */
-        flushQueries();
-
-        /* Indicate end of current frame */
-        retrace::profiler.addFrameEnd();
+        /* Indicate end of current frame, once its queries complete */
+        endFrameQueries();
     }
 
     retrace::frameComplete(call);
@@ -434,7 +647,7 @@ debugOutputCallback(GLenum source, GLenum type, GLuint id, GLenum severity, GLsi
     if (severity == GL_DEBUG_SEVERITY_LOW_ARB &&
         --maxLowSeverityMessages <= 0) {
         if (maxLowSeverityMessages == 0) {
-            std::cerr << retrace::callNo << ": ";
+            std::cerr << retrace::getCallNo() << ": ";
             std::cerr << "glDebugOutputCallback: ";
             std::cerr << "too many low severity messages";
             std::cerr << std::endl;
@@ -442,7 +655,7 @@ debugOutputCallback(GLenum source, GLenum type, GLuint id, GLenum severity, GLsi
         return;
     }
 
-    std::cerr << retrace::callNo << ": ";
+    std::cerr << retrace::getCallNo() << ": ";
     std::cerr << "glDebugOutputCallback: ";
     std::cerr << getDebugOutputSeverity(severity) << " severity ";
     std::cerr << getDebugOutputSource(source) << " " << getDebugOutputType(type);
@@ -464,14 +677,27 @@ public:
         return glstate::getDrawBufferImage();
     }
 
+    bool
+    beginSnapshot(void) {
+        if (!glretrace::getCurrentContext()) {
+            return false;
+        }
+        return glstate::beginDrawBufferImage();
+    }
+
+    image::Image *
+    endSnapshot(void) {
+        return glstate::endDrawBufferImage();
+    }
+
     bool
     dumpState(std::ostream &os) {
         glretrace::Context *currentContext = glretrace::getCurrentContext();
-        if (glretrace::insideGlBeginEnd ||
+        if (glretrace::getThreadState()->insideGlBeginEnd ||
             !currentContext) {
             return false;
         }
-        glstate::dumpCurrentContext(os);
+        glstate::dumpCurrentContext(os, retrace::dumpStateDelta);
         return true;
     }
 };
@@ -504,22 +730,41 @@ retrace::addCallbacks(retrace::Retracer &retracer)
 }
 
 
+void
+retrace::precompile(const char *filename)
+{
+    glretrace::precompilePrograms(filename);
+}
+
+
 void
 retrace::flushRendering(void) {
     glretrace::Context *currentContext = glretrace::getCurrentContext();
     if (currentContext) {
-        glretrace::flushQueries();
+        glFlush();
     }
 }
 
 void
 retrace::finishRendering(void) {
+    glretrace::flushQueries();
+
     glretrace::Context *currentContext = glretrace::getCurrentContext();
     if (currentContext) {
         glFinish();
     }
 }
 
+void
+retrace::releaseRendering(void) {
+    glretrace::Context *currentContext = glretrace::getCurrentContext();
+    if (currentContext) {
+        glretrace::finishContextQueries(currentContext, true);
+        glretrace::completeCallQueries();
+        glretrace::clearCurrentContext();
+    }
+}
+
 void
 retrace::waitForInput(void) {
     flushRendering();
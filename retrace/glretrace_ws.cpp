@@ -117,6 +117,8 @@ createContext(Context *shareContext) {
 
 Context::~Context()
 {
+    releaseQueries(this);
+
     //assert(this != getCurrentContext());
     if (this != getCurrentContext()) {
         delete wsContext;
@@ -145,7 +147,10 @@ makeCurrent(trace::Call &call, glws::Drawable *drawable, Context *context)
         }
     }
 
-    flushQueries();
+    if (currentContext && context != currentContext) {
+        // Pending snapshot readbacks belong to the current context
+        glstate::flushDrawBufferImages();
+    }
 
     bool success = glws::makeCurrent(drawable, context ? context->wsContext : NULL);
 
@@ -176,6 +181,20 @@ getCurrentContext(void) {
 }
 
 
+/**
+ * Release the current context from this thread, without it counting as a
+ * frame, so that other threads may make it current.
+ */
+void
+clearCurrentContext(void) {
+    if (currentContextPtr) {
+        glFlush();
+        glws::makeCurrent(NULL, NULL);
+        currentContextPtr = NULL;
+    }
+}
+
+
 /**
  * Grow the current drawble.
  *
@@ -67,6 +67,9 @@ Context::Context(void) {
     }
 
     ARB_draw_buffers = !ES;
+    ARB_pixel_buffer_object = !ES &&
+        (version_major > 2 ||
+         (version_major == 2 && version_minor >= 1));
 
     // Check extensions we use.
 
@@ -92,6 +95,8 @@ Context::Context(void) {
             ARB_sampler_objects = glws::checkExtension("GL_ARB_sampler_objects", extensions);
             KHR_debug = glws::checkExtension("GL_KHR_debug", extensions);
             EXT_debug_label = glws::checkExtension("GL_EXT_debug_label", extensions);
+            ARB_pixel_buffer_object = ARB_pixel_buffer_object ||
+                glws::checkExtension("GL_ARB_pixel_buffer_object", extensions);
         }
     } else {
         const char *extensions = (const char *)glGetString(GL_EXTENSIONS);
@@ -262,9 +267,9 @@ static const GLenum bindings[] = {
 #define NUM_BINDINGS sizeof(bindings)/sizeof(bindings[0])
 
 
-void dumpCurrentContext(std::ostream &os)
+void dumpCurrentContext(std::ostream &os, JSONDelta *delta)
 {
-    JSONWriter json(os);
+    JSONWriter json(os, delta);
 
 #ifndef NDEBUG
     GLint old_bindings[NUM_BINDINGS];
@@ -32,6 +32,8 @@
 #include "glimports.hpp"
 
 
+class JSONDelta;
+
 namespace image {
     class Image;
 }
@@ -42,11 +44,32 @@ namespace glstate {
 
 const char *enumToString(GLenum pname);
 
-void dumpCurrentContext(std::ostream &os);
+void dumpCurrentContext(std::ostream &os, JSONDelta *delta = NULL);
 
 image::Image *
 getDrawBufferImage(void);
 
+/**
+ * Start reading back the draw buffer into a pixel pack buffer, without
+ * waiting for it.  Returns false if that is not possible.
+ */
+bool
+beginDrawBufferImage(void);
+
+/**
+ * Get the image of the oldest readback started with beginDrawBufferImage(),
+ * or NULL if it failed.
+ */
+image::Image *
+endDrawBufferImage(void);
+
+/**
+ * Complete all pending readbacks, which must be done before the current
+ * context is released.
+ */
+void
+flushDrawBufferImages(void);
+
 
 } /* namespace glstate */
 
@@ -28,7 +28,9 @@
 #include <string.h>
 
 #include <algorithm>
+#include <deque>
 #include <iostream>
+#include <vector>
 
 #include "image.hpp"
 #include "json.hpp"
@@ -875,16 +877,11 @@ getFramebufferAttachmentDesc(Context &context, GLenum target, GLenum attachment,
 
 
 
-image::Image *
-getDrawBufferImage() {
-    GLenum format = GL_RGB;
-    GLint channels = _gl_format_channels(format);
-    if (channels > 4) {
-        return NULL;
-    }
-
-    Context context;
-
+/**
+ * Describe the current draw buffer, which snapshots are taken from.
+ */
+static bool
+getDrawBufferDesc(Context &context, GLint &draw_framebuffer, GLint &draw_buffer, ImageDesc &desc) {
     GLenum framebuffer_binding;
     GLenum framebuffer_target;
     if (context.ES) {
@@ -895,16 +892,15 @@ getDrawBufferImage() {
         framebuffer_target = GL_DRAW_FRAMEBUFFER;
     }
 
-    GLint draw_framebuffer = 0;
+    draw_framebuffer = 0;
     glGetIntegerv(framebuffer_binding, &draw_framebuffer);
 
-    GLint draw_buffer = GL_NONE;
-    ImageDesc desc;
+    draw_buffer = GL_NONE;
     if (draw_framebuffer) {
         if (context.ARB_draw_buffers) {
             glGetIntegerv(GL_DRAW_BUFFER0, &draw_buffer);
             if (draw_buffer == GL_NONE) {
-                return NULL;
+                return false;
             }
         } else {
             // GL_COLOR_ATTACHMENT0 is implied
@@ -912,7 +908,7 @@ getDrawBufferImage() {
         }
 
         if (!getFramebufferAttachmentDesc(context, framebuffer_target, draw_buffer, desc)) {
-            return NULL;
+            return false;
         }
     } else {
         if (context.ES) {
@@ -924,31 +920,30 @@ getDrawBufferImage() {
         } else {
             glGetIntegerv(GL_DRAW_BUFFER, &draw_buffer);
             if (draw_buffer == GL_NONE) {
-                return NULL;
+                return false;
             }
         }
 
         if (!getDrawableBounds(&desc.width, &desc.height)) {
-            return NULL;
+            return false;
         }
 
         desc.depth = 1;
     }
 
-    GLenum type = GL_UNSIGNED_BYTE;
-    image::ChannelType channelType = image::TYPE_UNORM8;
-
-    if (format == GL_DEPTH_COMPONENT) {
-        type = GL_FLOAT;
-        channels = 1;
-        channelType = image::TYPE_FLOAT;
-    }
+    return true;
+}
 
-    image::Image *image = new image::Image(desc.width, desc.height, channels, true, channelType);
-    if (!image) {
-        return NULL;
-    }
 
+/**
+ * Read the draw buffer into pixels, which is an offset into the bound pixel
+ * pack buffer if bufferSize is non-zero.
+ */
+static bool
+readDrawBuffer(Context &context, GLint draw_framebuffer, GLint draw_buffer,
+               const ImageDesc &desc, GLenum format, GLenum type,
+               GLuint buffer, GLsizeiptr bufferSize, GLvoid *pixels)
+{
     while (glGetError() != GL_NO_ERROR) {}
 
     GLint read_framebuffer = 0;
@@ -964,7 +959,12 @@ getDrawBufferImage() {
     // TODO: reset imaging state too
     context.resetPixelPackState();
 
-    glReadPixels(0, 0, desc.width, desc.height, format, type, image->pixels);
+    if (buffer) {
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, buffer);
+        glBufferData(GL_PIXEL_PACK_BUFFER, bufferSize, NULL, GL_STREAM_READ);
+    }
+
+    glReadPixels(0, 0, desc.width, desc.height, format, type, pixels);
 
     context.restorePixelPackState();
 
@@ -979,6 +979,46 @@ getDrawBufferImage() {
             std::cerr << "warning: " << enumToString(error) << " while getting snapshot\n";
             error = glGetError();
         } while(error != GL_NO_ERROR);
+        return false;
+    }
+
+    return true;
+}
+
+
+image::Image *
+getDrawBufferImage() {
+    GLenum format = GL_RGB;
+    GLint channels = _gl_format_channels(format);
+    if (channels > 4) {
+        return NULL;
+    }
+
+    Context context;
+
+    GLint draw_framebuffer = 0;
+    GLint draw_buffer = GL_NONE;
+    ImageDesc desc;
+    if (!getDrawBufferDesc(context, draw_framebuffer, draw_buffer, desc)) {
+        return NULL;
+    }
+
+    GLenum type = GL_UNSIGNED_BYTE;
+    image::ChannelType channelType = image::TYPE_UNORM8;
+
+    if (format == GL_DEPTH_COMPONENT) {
+        type = GL_FLOAT;
+        channels = 1;
+        channelType = image::TYPE_FLOAT;
+    }
+
+    image::Image *image = new image::Image(desc.width, desc.height, channels, true, channelType);
+    if (!image) {
+        return NULL;
+    }
+
+    if (!readDrawBuffer(context, draw_framebuffer, draw_buffer, desc, format, type,
+                        0, 0, image->pixels)) {
         delete image;
         return NULL;
     }
@@ -987,6 +1027,126 @@ getDrawBufferImage() {
 }
 
 
+/*
+ * Asynchronous snapshots.
+ *
+ * The draw buffer is read into a pixel pack buffer, and only mapped once the
+ * snapshot is asked for, several frames later, so that reading it back does
+ * not stall the pipeline.  Pending readbacks belong to the current context,
+ * so they must be resolved before it is released.
+ */
+
+struct PendingImage
+{
+    GLuint buffer;
+    image::Image *image;
+};
+
+static std::deque<PendingImage> pendingImages;
+
+// Buffers of resolved readbacks, ready for reuse
+static std::vector<GLuint> freePackBuffers;
+
+
+static void
+resolvePendingImage(PendingImage &pending) {
+    if (!pending.buffer) {
+        return;
+    }
+
+    GLint pixel_pack_buffer_binding = 0;
+    glGetIntegerv(GL_PIXEL_PACK_BUFFER_BINDING, &pixel_pack_buffer_binding);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, pending.buffer);
+
+    image::Image *image = pending.image;
+    size_t size = image->height * image->width * image->bytesPerPixel;
+    const void *map = glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+    if (map) {
+        memcpy(image->pixels, map, size);
+        glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    } else {
+        std::cerr << "warning: failed to map snapshot pixel pack buffer\n";
+        delete image;
+        pending.image = NULL;
+    }
+
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, pixel_pack_buffer_binding);
+
+    freePackBuffers.push_back(pending.buffer);
+    pending.buffer = 0;
+}
+
+
+bool
+beginDrawBufferImage(void) {
+    Context context;
+    if (!context.ARB_pixel_buffer_object) {
+        return false;
+    }
+
+    GLint draw_framebuffer = 0;
+    GLint draw_buffer = GL_NONE;
+    ImageDesc desc;
+    if (!getDrawBufferDesc(context, draw_framebuffer, draw_buffer, desc)) {
+        return false;
+    }
+
+    GLenum format = GL_RGB;
+    GLint channels = _gl_format_channels(format);
+    image::Image *image = new image::Image(desc.width, desc.height, channels, true);
+
+    GLuint buffer = 0;
+    if (freePackBuffers.empty()) {
+        glGenBuffers(1, &buffer);
+    } else {
+        buffer = freePackBuffers.back();
+        freePackBuffers.pop_back();
+    }
+
+    GLsizeiptr size = image->height * image->width * image->bytesPerPixel;
+    if (!readDrawBuffer(context, draw_framebuffer, draw_buffer, desc, format, GL_UNSIGNED_BYTE,
+                        buffer, size, 0)) {
+        freePackBuffers.push_back(buffer);
+        delete image;
+        return false;
+    }
+
+    PendingImage pending;
+    pending.buffer = buffer;
+    pending.image = image;
+    pendingImages.push_back(pending);
+    return true;
+}
+
+
+image::Image *
+endDrawBufferImage(void) {
+    if (pendingImages.empty()) {
+        return NULL;
+    }
+
+    PendingImage &pending = pendingImages.front();
+    resolvePendingImage(pending);
+    image::Image *image = pending.image;
+    pendingImages.pop_front();
+    return image;
+}
+
+
+void
+flushDrawBufferImages(void) {
+    std::deque<PendingImage>::iterator it;
+    for (it = pendingImages.begin(); it != pendingImages.end(); ++it) {
+        resolvePendingImage(*it);
+    }
+
+    if (!freePackBuffers.empty()) {
+        glDeleteBuffers(freePackBuffers.size(), &freePackBuffers[0]);
+        freePackBuffers.clear();
+    }
+}
+
+
 /**
  * Dump the image of the currently bound read buffer.
  */
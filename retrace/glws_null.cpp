@@ -0,0 +1,96 @@
+/**************************************************************************
+ *
+ * Copyright 2014 VMware, Inc.
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ **************************************************************************/
+
+/*
+ * Null window system, which goes together with the no-op GL dispatch from
+ * glproc_null.cpp, to measure the CPU overhead of the replay pipeline
+ * without a display or a GPU.
+ */
+
+
+#include <assert.h>
+
+#include "glws.hpp"
+#include "retrace.hpp"
+
+
+namespace glws {
+
+
+class NullDrawable : public Drawable
+{
+public:
+    NullDrawable(const Visual *vis, int w, int h, bool pbuffer) :
+        Drawable(vis, w, h, pbuffer)
+    {}
+
+    void
+    swapBuffers(void) {
+    }
+};
+
+
+void
+init(void) {
+    /* Report the time spent on each replay stage. */
+    retrace::driver = retrace::DRIVER_NULL;
+}
+
+void
+cleanup(void) {
+}
+
+Visual *
+createVisual(bool doubleBuffer, unsigned samples, Profile profile) {
+    Visual *visual = new Visual(profile);
+    visual->doubleBuffer = doubleBuffer;
+    return visual;
+}
+
+Drawable *
+createDrawable(const Visual *visual, int width, int height, bool pbuffer)
+{
+    return new NullDrawable(visual, width, height, pbuffer);
+}
+
+Context *
+createContext(const Visual *visual, Context *shareContext, bool debug)
+{
+    return new Context(visual);
+}
+
+bool
+makeCurrent(Drawable *drawable, Context *context)
+{
+    return true;
+}
+
+bool
+processEvents(void) {
+    return true;
+}
+
+
+} /* namespace glws */
@@ -31,21 +31,29 @@
 #include <assert.h>
 #include <string.h>
 
+#include <algorithm>
 #include <sstream>
 
+#include "fast_hash.hpp"
 #include "image.hpp"
 #include "json.hpp"
 
 
 void
 JSONWriter::newline(void) {
-    os << "\n";
-    for (int i = 0; i < level; ++i)
-        os << "  ";
+    static const char spaces[] = "                                ";
+    os.put('\n');
+    size_t indent = 2*level;
+    while (indent) {
+        size_t length = std::min(indent, sizeof spaces - 1);
+        os.write(spaces, length);
+        indent -= length;
+    }
 }
 
 void
 JSONWriter::separator(void) {
+    memberValue = false;
     if (value) {
         os << ",";
         switch (space) {
@@ -65,43 +73,83 @@ JSONWriter::separator(void) {
     }
 }
 
+/**
+ * Whether the character can be written verbatim inside a JSON string.
+ */
+static inline bool
+isPlainChar(unsigned char c) {
+    return (c >= 0x20 && c <= 0x7e && c != '\"' && c != '\\') ||
+           c == '\t' ||
+           c == '\r' ||
+           c == '\n';
+}
+
+/**
+ * Write the longest run of plain characters at the start of the string in one
+ * go, returning the first character that needs special handling.
+ */
+static inline const char *
+writePlainRun(std::ostream &os, const char *str) {
+    const char *end = str;
+    while (isPlainChar(*end)) {
+        ++end;
+    }
+    if (end != str) {
+        os.write(str, end - str);
+    }
+    return end;
+}
+
 static void
 escapeAsciiString(std::ostream &os, const char *str) {
-    os << "\"";
+    os.put('"');
 
-    const unsigned char *src = (const unsigned char *)str;
-    unsigned char c;
-    while ((c = *src++)) {
+    const char *src = str;
+    while (true) {
+        src = writePlainRun(os, src);
+        unsigned char c = *src++;
+        if (!c) {
+            break;
+        }
         if ((c == '\"') ||
             (c == '\\')) {
             // escape character
-            os << '\\' << (unsigned char)c;
-        } else if ((c >= 0x20 && c <= 0x7e) ||
-                    c == '\t' ||
-                    c == '\r' ||
-                    c == '\n') {
-            // pass-through character
-            os << (unsigned char)c;
+            os.put('\\');
+            os.put(c);
         } else {
             assert(0);
-            os << "?";
+            os.put('?');
         }
     }
 
-    os << "\"";
+    os.put('"');
 }
 
 static void
 escapeUnicodeString(std::ostream &os, const char *str) {
-    os << "\"";
+    os.put('"');
+
+    // Most strings are plain ASCII, which needs no locale dependent
+    // conversion, so write it straight away.
+    const char *src = writePlainRun(os, str);
+    while (*src == '\"' || *src == '\\') {
+        os.put('\\');
+        os.put(*src++);
+        src = writePlainRun(os, src);
+    }
+    if (!*src) {
+        os.put('"');
+        return;
+    }
 
     const char *locale = setlocale(LC_CTYPE, "");
-    const char *src = str;
     mbstate_t state;
 
     memset(&state, 0, sizeof state);
 
     do {
+        src = writePlainRun(os, src);
+
         // Convert characters one at a time in order to recover from
         // conversion errors
         wchar_t c;
@@ -111,20 +159,21 @@ escapeUnicodeString(std::ostream &os, const char *str) {
             break;
         } if (written == (size_t)-1) {
             // conversion error -- skip
-            os << "?";
+            os.put('?');
             do {
                 ++src;
             } while (*src & 0x80);
         } else if ((c == '\"') ||
                    (c == '\\')) {
             // escape character
-            os << '\\' << (unsigned char)c;
+            os.put('\\');
+            os.put((unsigned char)c);
         } else if ((c >= 0x20 && c <= 0x7e) ||
                     c == '\t' ||
                     c == '\r' ||
                     c == '\n') {
             // pass-through character
-            os << (unsigned char)c;
+            os.put((unsigned char)c);
         } else {
             // unicode
             os << "\\u" << std::setfill('0') << std::hex << std::setw(4) << (unsigned)c;
@@ -134,47 +183,77 @@ escapeUnicodeString(std::ostream &os, const char *str) {
 
     setlocale(LC_CTYPE, locale);
 
-    os << "\"";
+    os.put('"');
 }
 
+
+/*
+ * Base64 encoding.
+ *
+ * Each 24 bits group is encoded as two 12 bits halves, looked up in a table
+ * with the two output characters of each possible 12 bits value, and the
+ * output is staged in a buffer of whole lines, so that the stream is only
+ * written once every few kilobytes.
+ */
+
+static const char table64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+#define BASE64_LINE_GROUPS (76/4)
+#define BASE64_BUFFER_LINES 64
+
+// Built during static initialization, before any thread may use it
+static const struct Base64PairTable {
+    char pairs[4096 * 2];
+
+    Base64PairTable() {
+        for (unsigned i = 0; i < 4096; ++i) {
+            pairs[2*i + 0] = table64[i >> 6];
+            pairs[2*i + 1] = table64[i & 0x3f];
+        }
+    }
+} base64PairTable;
+
 static void
 encodeBase64String(std::ostream &os, const unsigned char *bytes, size_t size) {
-    const char *table64 = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
-    unsigned char c0, c1, c2, c3;
-    char buf[4];
+    const char *pairs = base64PairTable.pairs;
+    char buf[BASE64_BUFFER_LINES * (BASE64_LINE_GROUPS*4 + 1)];
+    char *dst = buf;
     unsigned written;
 
-    os << "\"";
+    os.put('"');
 
     written = 0;
     while (size >= 3) {
-        c0 = bytes[0] >> 2;
-        c1 = ((bytes[0] & 0x03) << 4) | ((bytes[1] & 0xf0) >> 4);
-        c2 = ((bytes[1] & 0x0f) << 2) | ((bytes[2] & 0xc0) >> 6);
-        c3 = bytes[2] & 0x3f;
-
-        buf[0] = table64[c0];
-        buf[1] = table64[c1];
-        buf[2] = table64[c2];
-        buf[3] = table64[c3];
-
-        os.write(buf, 4);
+        unsigned bits = (bytes[0] << 16) | (bytes[1] << 8) | bytes[2];
+        const char *hi = pairs + 2*(bits >> 12);
+        const char *lo = pairs + 2*(bits & 0xfff);
+        dst[0] = hi[0];
+        dst[1] = hi[1];
+        dst[2] = lo[0];
+        dst[3] = lo[1];
+        dst += 4;
 
         bytes += 3;
         size -= 3;
         ++written;
 
-        if (written >= 76/4 && size) {
-            os << "\n";
+        if (written >= BASE64_LINE_GROUPS && size) {
+            *dst++ = '\n';
             written = 0;
+            if (dst + BASE64_LINE_GROUPS*4 + 1 > buf + sizeof buf) {
+                os.write(buf, dst - buf);
+                dst = buf;
+            }
         }
     }
 
     if (size > 0) {
+        unsigned char c0, c1, c2, c3;
+
         c0 = bytes[0] >> 2;
         c1 = ((bytes[0] & 0x03) << 4);
-        buf[2] = '=';
-        buf[3] = '=';
+        dst[2] = '=';
+        dst[3] = '=';
 
         if (size > 1) {
             c1 |= ((bytes[1] & 0xf0) >> 4);
@@ -182,26 +261,163 @@ encodeBase64String(std::ostream &os, const unsigned char *bytes, size_t size) {
             if (size > 2) {
                 c2 |= ((bytes[2] & 0xc0) >> 6);
                 c3 = bytes[2] & 0x3f;
-                buf[3] = table64[c3];
+                dst[3] = table64[c3];
             }
-            buf[2] = table64[c2];
+            dst[2] = table64[c2];
         }
-        buf[1] = table64[c1];
-        buf[0] = table64[c0];
+        dst[1] = table64[c1];
+        dst[0] = table64[c0];
+        dst += 4;
+    }
+
+    os.write(buf, dst - buf);
+
+    os.put('"');
+}
+
+/*
+ * Hashing for delta encoding.  Only used to tell whether something changed,
+ * so speed matters more than quality.
+ */
+
+template< class T >
+static inline unsigned long long
+hashValue(unsigned long long hash, const T &value) {
+    return fasthash::update(hash, &value, sizeof value);
+}
+
+
+/*
+ * Strings shorter than this are not worth replacing by a reference.
+ */
+#define DELTA_MIN_STRING_LENGTH 256
+
 
-        os.write(buf, 4);
+void
+JSONWriter::SectionBuffer::reset(void) {
+    data.clear();
+    hash = fasthash::basis;
+    hashing = true;
+}
+
+JSONWriter::SectionBuffer::int_type
+JSONWriter::SectionBuffer::overflow(int_type c) {
+    if (c != traits_type::eof()) {
+        char ch = traits_type::to_char_type(c);
+        data.push_back(ch);
+        if (hashing) {
+            hash = fasthash::update(hash, &ch, 1);
+        }
     }
+    return traits_type::not_eof(c);
+}
 
-    os << "\"";
+std::streamsize
+JSONWriter::SectionBuffer::xsputn(const char *s, std::streamsize n) {
+    data.append(s, n);
+    if (hashing) {
+        hash = fasthash::update(hash, s, n);
+    }
+    return n;
 }
 
-JSONWriter::JSONWriter(std::ostream &_os) :
+
+JSONWriter::JSONWriter(std::ostream &_os, JSONDelta *_delta) :
     os(_os),
     level(0),
     value(false),
-    space(0)
+    space(0),
+    delta(_delta),
+    memberValue(false),
+    savedBuffer(NULL)
 {
     beginObject();
+    if (delta) {
+        writeIntMember("__call__", delta->callNo);
+    }
+}
+
+
+std::string
+JSONWriter::pathKey(void) const {
+    std::string key;
+    for (unsigned i = 0; i < path.size(); ++i) {
+        key += path[i];
+        key += '\n';
+    }
+    return key;
+}
+
+
+/**
+ * Write a reference to the earlier document holding the member being written,
+ * if its hash did not change since, or remember the hash otherwise.
+ */
+bool
+JSONWriter::writeReference(unsigned long long hash) {
+    JSONDelta::Entry &entry = delta->entries[pathKey()];
+    if (entry.hash == hash && entry.callNo != delta->callNo) {
+        beginObject();
+        writeIntMember("__ref__", entry.callNo);
+        endObject();
+        return true;
+    }
+    entry.hash = hash;
+    entry.callNo = delta->callNo;
+    return false;
+}
+
+
+/**
+ * Called before writing an image or long string member value, which is
+ * replaced by a reference if it did not change.  Otherwise the caller must
+ * write the value and call endDeltaLeaf().
+ *
+ * Either way, only the leaf's hash (rather than how it ended up written)
+ * counts towards the hash of the enclosing top level member.
+ */
+bool
+JSONWriter::beginDeltaLeaf(unsigned long long hash) {
+    if (savedBuffer) {
+        section.hash = hashValue(section.hash, hash);
+        section.hashing = false;
+    }
+    if (writeReference(hash)) {
+        section.hashing = true;
+        return true;
+    }
+    return false;
+}
+
+void
+JSONWriter::endDeltaLeaf(void) {
+    section.hashing = true;
+}
+
+
+/**
+ * Emit the top level member value buffered since beginMember(), or a
+ * reference instead of it.
+ */
+void
+JSONWriter::endSection(void) {
+    os.rdbuf(savedBuffer);
+    savedBuffer = NULL;
+
+    bool savedValue = value;
+    char savedSpace = space;
+
+    // Pretend no value was written yet, as the reference (if any) will be
+    // written in its place.
+    value = false;
+    space = 0;
+    if (!writeReference(section.hash)) {
+        os.write(section.data.data(), section.data.size());
+        value = savedValue;
+        space = savedSpace;
+    }
+
+    section.data.clear();
 }
 
 JSONWriter::~JSONWriter() {
@@ -235,11 +451,27 @@ JSONWriter::beginMember(const char * name) {
     escapeAsciiString(os, name);
     os << ": ";
     value = false;
+
+    if (delta) {
+        path.push_back(name);
+        memberValue = true;
+        if (level == 1) {
+            // Buffer top level members, to only write them if they changed
+            section.reset();
+            savedBuffer = os.rdbuf(&section);
+        }
+    }
 }
 
 void
 JSONWriter::endMember(void) {
     assert(value);
+    if (delta) {
+        if (level == 1 && savedBuffer) {
+            endSection();
+        }
+        path.pop_back();
+    }
     value = true;
     space = 0;
 }
@@ -271,6 +503,21 @@ JSONWriter::writeString(const char *s) {
         return;
     }
 
+    if (delta && memberValue) {
+        size_t length = strlen(s);
+        if (length >= DELTA_MIN_STRING_LENGTH) {
+            if (beginDeltaLeaf(fasthash::update(fasthash::basis, s, length))) {
+                return;
+            }
+            separator();
+            escapeUnicodeString(os, s);
+            value = true;
+            space = ' ';
+            endDeltaLeaf();
+            return;
+        }
+    }
+
     separator();
     escapeUnicodeString(os, s);
     value = true;
@@ -309,6 +556,22 @@ JSONWriter::writeImage(image::Image *image, const char *format, unsigned depth)
         return;
     }
 
+    bool leaf = false;
+    if (delta && memberValue) {
+        unsigned long long hash = fasthash::basis;
+        hash = hashValue(hash, image->width);
+        hash = hashValue(hash, image->height);
+        hash = hashValue(hash, image->channels);
+        hash = hashValue(hash, image->channelType);
+        hash = hashValue(hash, depth);
+        hash = fasthash::update(hash, format, strlen(format));
+        hash = fasthash::update(hash, image->pixels, image->height * image->_stride());
+        if (beginDeltaLeaf(hash)) {
+            return;
+        }
+        leaf = true;
+    }
+
     beginObject();
 
     // Tell the GUI this is no ordinary object, but an image
@@ -334,4 +597,8 @@ JSONWriter::writeImage(image::Image *image, const char *format, unsigned depth)
     endMember(); // __data__
 
     endObject();
+
+    if (leaf) {
+        endDeltaLeaf();
+    }
 }
@@ -43,8 +43,11 @@
 
 #include <iomanip>
 #include <limits>
+#include <map>
 #include <ostream>
+#include <streambuf>
 #include <string>
+#include <vector>
 
 
 namespace image {
@@ -52,6 +55,38 @@ namespace image {
 }
 
 
+/**
+ * Memory of what previous documents contained, so that a sequence of
+ * documents (e.g., state dumps at successive calls) only needs to spell out
+ * what changed.
+ *
+ * Each document starts with a "__call__" member.  Top level members, as well
+ * as the images and long strings within them, which are identical to those
+ * at the same place in an earlier document, are replaced by
+ * {"__ref__": CALL}, where CALL is the "__call__" of the document which has
+ * them in full.
+ */
+class JSONDelta
+{
+public:
+    unsigned callNo;
+
+    JSONDelta() :
+        callNo(0)
+    {}
+
+private:
+    friend class JSONWriter;
+
+    struct Entry {
+        unsigned long long hash;
+        unsigned callNo;
+    };
+
+    std::map<std::string, Entry> entries;
+};
+
+
 class JSONWriter
 {
 private:
@@ -61,14 +96,56 @@ private:
     bool value;
     char space;
 
+    /*
+     * Delta encoding state, when a JSONDelta was given.
+     */
+    class SectionBuffer : public std::streambuf
+    {
+    public:
+        std::string data;
+        unsigned long long hash;
+        bool hashing;
+
+        void
+        reset(void);
+
+    protected:
+        int_type
+        overflow(int_type c);
+
+        std::streamsize
+        xsputn(const char *s, std::streamsize n);
+    };
+
+    JSONDelta *delta;
+    std::vector<std::string> path;
+    bool memberValue;
+    SectionBuffer section;
+    std::streambuf *savedBuffer;
+
     void
     newline(void);
 
     void
     separator(void);
 
+    std::string
+    pathKey(void) const;
+
+    bool
+    writeReference(unsigned long long hash);
+
+    bool
+    beginDeltaLeaf(unsigned long long hash);
+
+    void
+    endDeltaLeaf(void);
+
+    void
+    endSection(void);
+
 public:
-    JSONWriter(std::ostream &_os);
+    JSONWriter(std::ostream &_os, JSONDelta *_delta = NULL);
 
     ~JSONWriter();
 
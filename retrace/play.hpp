@@ -40,8 +40,8 @@
 #include "trace_parser.hpp"
 #include "trace_profiler.hpp"
 #include "trace_dump.hpp"
-
-
+#include "os_thread.hpp"
+#include "os_queue.hpp"
 
 #include "scoped_allocator.hpp"
 
@@ -53,17 +53,57 @@ namespace image {
 
 namespace play {
 
-  struct ThreadedParser {
-    ThreadedParser() : version(parser.version), bookmark(~0) {}
+  /**
+   * Parser which parses calls ahead on a separate thread.
+   *
+   * Parsed calls are handed over to the player through a bounded lock-free
+   * queue, and played calls are handed back through another queue so that
+   * they are also deleted on the parser thread.  A call returned by
+   * parse_call() remains valid until the next parse_call() invocation.
+   */
+  class ThreadedParser {
+  public:
+    ThreadedParser();
+    ~ThreadedParser();
     bool open( const char * file );
     void close();
-    void getBookmark( trace::ParseBookmark & bm ); 
+    void getBookmark( trace::ParseBookmark & bm );
     void setBookmark( const trace::ParseBookmark & bm );
     trace::Call * parse_call();
+
+    /**
+     * Maximum number of parsed calls held in memory.  Must be set before
+     * open().
+     */
+    void setQueueSize( size_t size ) { queueSize = size; }
+
     trace::Parser parser;
     unsigned long long & version;
-    std::deque<trace::Call *> queuedCalls, retiredCalls;
-    unsigned bookmark;
+
+  private:
+    struct Item {
+      trace::Call *call;
+      // Parser position right after this call.
+      trace::ParseBookmark bookmark;
+    };
+
+    size_t queueSize;
+    os::spsc_queue<Item> *queuedCalls;
+    os::spsc_queue<trace::Call *> *recycledCalls;
+    os::thread readerThread;
+    volatile bool stopping;
+    bool finished;
+
+    // Last call handed to the player, and the position right after it.
+    trace::Call *currentCall;
+    trace::ParseBookmark currentBookmark;
+
+    static void * readerThreadFunction( ThreadedParser * tp );
+    void read();
+    void deleteRecycledCalls();
+    void recycle( trace::Call * call );
+    void startReader();
+    void stopReader();
   };
 
 extern ThreadedParser parser;
@@ -71,13 +111,32 @@ extern ThreadedParser parser;
 
 class ScopedAllocator : public ::ScopedAllocator
 {
+private:
+    /*
+     * Small arrays are carved out of this buffer, which lives on the stack
+     * together with the allocator, sparing the common case of short input
+     * arrays a malloc/free pair.
+     */
+    union {
+        double d;
+        unsigned long long ull;
+        void *ptr;
+        unsigned char bytes[256];
+    } local;
+    size_t localUsed;
+
 public:
+    inline
+    ScopedAllocator() :
+        localUsed(0) {
+    }
+
     /**
      * Allocate an array with the same dimensions as the specified value.
      */
     inline void *
     alloc(const trace::Value *value, size_t size) {
-        const trace::Array *array = value->toArray();
+        const trace::Array *array = trace::toArray(*value);
         if (array) {
             return ::ScopedAllocator::alloc(array->size() * size);
         }
@@ -89,6 +148,28 @@ public:
         return NULL;
     }
 
+    /**
+     * Same as above, but small arrays are allocated from the stack.
+     *
+     * The result must not be passed to bind(), as it only lives as long as
+     * the allocator.
+     */
+    inline void *
+    allocLocal(const trace::Value *value, size_t size) {
+        const trace::Array *array = trace::toArray(*value);
+        if (array) {
+            size_t bytes = array->size() * size;
+            // Keep subsequent allocations suitably aligned
+            bytes = (bytes + sizeof(unsigned long long) - 1) & ~(sizeof(unsigned long long) - 1);
+            if (bytes && bytes <= sizeof local.bytes - localUsed) {
+                void *ptr = &local.bytes[localUsed];
+                localUsed += bytes;
+                return ptr;
+            }
+        }
+        return alloc(value, size);
+    }
+
 };
 
 
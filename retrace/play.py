@@ -53,6 +53,18 @@ def lookupHandle(handle, value, lval=False):
 
 class ValueAllocator(stdapi.Visitor):
 
+    def __init__(self, local = False):
+        # Whether small arrays may be allocated from the stack, which is only
+        # safe when the argument is not referred beyond the call life-time.
+        self.local = local
+
+    def allocArray(self, type, lvalue, rvalue):
+        if self.local:
+            method = 'allocLocal'
+        else:
+            method = 'alloc'
+        print '    %s = static_cast<%s *>(_allocator.%s(&%s, sizeof *%s));' % (lvalue, type, method, rvalue, lvalue)
+
     def visitLiteral(self, literal, lvalue, rvalue):
         pass
 
@@ -69,10 +81,10 @@ class ValueAllocator(stdapi.Visitor):
         pass
 
     def visitArray(self, array, lvalue, rvalue):
-        print '    %s = static_cast<%s *>(_allocator.alloc(&%s, sizeof *%s));' % (lvalue, array.type, rvalue, lvalue)
+        self.allocArray(array.type, lvalue, rvalue)
 
     def visitPointer(self, pointer, lvalue, rvalue):
-        print '    %s = static_cast<%s *>(_allocator.alloc(&%s, sizeof *%s));' % (lvalue, pointer.type, rvalue, lvalue)
+        self.allocArray(pointer.type, lvalue, rvalue)
 
     def visitIntPointer(self, pointer, lvalue, rvalue):
         pass
@@ -109,7 +121,7 @@ class ValueAllocator(stdapi.Visitor):
 class ValueDeserializer(stdapi.Visitor, stdapi.ExpanderMixin):
 
     def visitLiteral(self, literal, lvalue, rvalue):
-        print '    %s = (%s).to%s();' % (lvalue, rvalue, literal.kind)
+        print '    %s = trace::to%s(%s);' % (lvalue, literal.kind, rvalue)
 
     def visitConst(self, const, lvalue, rvalue):
         self.visit(const.type, lvalue, rvalue)
@@ -118,7 +130,7 @@ class ValueDeserializer(stdapi.Visitor, stdapi.ExpanderMixin):
         self.visit(alias.type, lvalue, rvalue)
     
     def visitEnum(self, enum, lvalue, rvalue):
-        print '    %s = static_cast<%s>((%s).toSInt());' % (lvalue, enum, rvalue)
+        print '    %s = static_cast<%s>(trace::toSInt(%s));' % (lvalue, enum, rvalue)
 
     def visitBitmask(self, bitmask, lvalue, rvalue):
         self.visit(bitmask.type, lvalue, rvalue)
@@ -129,7 +141,7 @@ class ValueDeserializer(stdapi.Visitor, stdapi.ExpanderMixin):
         self.seq += 1
 
         print '    if (%s) {' % (lvalue,)
-        print '        const trace::Array *%s = (%s).toArray();' % (tmp, rvalue)
+        print '        const trace::Array *%s = trace::toArray(%s);' % (tmp, rvalue)
         length = '%s->values.size()' % (tmp,)
         index = '_j' + array.tag
         print '        for (size_t {i} = 0; {i} < {length}; ++{i}) {{'.format(i = index, length = length)
@@ -144,7 +156,7 @@ class ValueDeserializer(stdapi.Visitor, stdapi.ExpanderMixin):
         self.seq += 1
 
         print '    if (%s) {' % (lvalue,)
-        print '        const trace::Array *%s = (%s).toArray();' % (tmp, rvalue)
+        print '        const trace::Array *%s = trace::toArray(%s);' % (tmp, rvalue)
         try:
             self.visit(pointer.type, '%s[0]' % (lvalue,), '*%s->values[0]' % (tmp,))
         finally:
@@ -251,7 +263,7 @@ class SwizzledValueRegistrator(stdapi.Visitor, stdapi.ExpanderMixin):
         pass
 
     def visitArray(self, array, lvalue, rvalue):
-        print '    const trace::Array *_a%s = (%s).toArray();' % (array.tag, rvalue)
+        print '    const trace::Array *_a%s = trace::toArray(%s);' % (array.tag, rvalue)
         print '    if (_a%s) {' % (array.tag)
         length = '_a%s->values.size()' % array.tag
         index = '_j' + array.tag
@@ -263,7 +275,7 @@ class SwizzledValueRegistrator(stdapi.Visitor, stdapi.ExpanderMixin):
             print '    }'
     
     def visitPointer(self, pointer, lvalue, rvalue):
-        print '    const trace::Array *_a%s = (%s).toArray();' % (pointer.tag, rvalue)
+        print '    const trace::Array *_a%s = trace::toArray(%s);' % (pointer.tag, rvalue)
         print '    if (_a%s) {' % (pointer.tag)
         try:
             self.visit(pointer.type, '%s[0]' % (lvalue,), '*_a%s->values[0]' % (pointer.tag,))
@@ -449,7 +461,9 @@ class Player:
         print '    return;'
 
     def extractArg(self, function, arg, arg_type, lvalue, rvalue):
-        ValueAllocator().visit(arg_type, lvalue, rvalue)
+        # Output arguments may be bound beyond the call life-time (e.g.,
+        # glFeedbackBuffer), so only input arrays can live on the stack.
+        ValueAllocator(local = not arg.output).visit(arg_type, lvalue, rvalue)
         if arg.input:
             ValueDeserializer().visit(arg_type, lvalue, rvalue)
     
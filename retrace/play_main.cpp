@@ -61,154 +61,149 @@ static unsigned dumpStateCallNo = ~0;
 
 play::Player player;
 
-#define ASYNC_READER_SLEEP 10
-#define ASYNC_READER_CALLS 100000
+#define DEFAULT_QUEUE_SIZE 16384
 
 namespace play {
 
-  os::mutex destroyerMutex;
-  std::vector< trace::Call * > retired;
-  os::thread * destroyerThread = NULL;
-  bool die = false;
-
-  void delete_retired_calls( ThreadedParser * tp ) {
-    os::unique_lock<os::mutex> lock(destroyerMutex);
-    std::deque< trace::Call * >::iterator end = tp->retiredCalls.end();
-    if( tp->bookmark != ~0 ) {
-      for( size_t i = 0; i < tp->retiredCalls.size(); i++ ) {
-        if( tp->retiredCalls[i]->no == tp->bookmark ) {
-          end = tp->retiredCalls.begin() + i;
-          break;
-        }
-      }
-    }
-    retired.insert( retired.end(), tp->retiredCalls.begin(), end );
-    tp->retiredCalls.erase( tp->retiredCalls.begin(), end );
+  ThreadedParser::ThreadedParser() :
+    version(parser.version),
+    queueSize(DEFAULT_QUEUE_SIZE),
+    queuedCalls(NULL),
+    recycledCalls(NULL),
+    stopping(false),
+    finished(false),
+    currentCall(NULL)
+  {
   }
-  
-  void async_destroyer() {
-    for(;die==false;) {
-      os::unique_lock<os::mutex> lock(destroyerMutex);
-      if( retired.size() ) {
-        for( size_t i = 0; i < retired.size(); i++ ) {
-          delete retired[i];
-        }
-        retired.clear();
-      } else {
-        lock.unlock();
-        os::sleep(ASYNC_READER_SLEEP);
-      }
-    }
+
+  ThreadedParser::~ThreadedParser() {
+    close();
   }
-  
-  
-  os::mutex readerMutex;
-  ThreadedParser *inbox;
-  std::vector< trace::Call *> calls;
-  int numCalls = -1;
-  os::thread * readerThread = NULL;
-  bool enqueue_read( ThreadedParser * tp ) {
+
+  void * ThreadedParser::readerThreadFunction( ThreadedParser * tp ) {
+    tp->read();
+    return 0;
+  }
+
+  /**
+   * Reader thread main loop.
+   */
+  void ThreadedParser::read() {
     for(;;) {
-      os::unique_lock<os::mutex> lock(readerMutex);
-      if( inbox == NULL ) {
-        inbox = tp;
-        //printf("e\n");
-        return true;
+      deleteRecycledCalls();
+
+      Item item;
+      item.call = stopping ? NULL : parser.parse_call();
+      parser.getBookmark( item.bookmark );
+
+      // Blocks while the queue is full
+      queuedCalls->push( item );
+      if( item.call == NULL ) {
+        break;
       }
-      lock.unlock();
-      os::sleep(ASYNC_READER_SLEEP);
     }
-    return false;
+    deleteRecycledCalls();
   }
 
-  bool fetch_read( ThreadedParser * tp ) {
-    for(;;) {
-      os::unique_lock<os::mutex> lock(readerMutex);
-      if( numCalls >= 0 ) {
-        tp->queuedCalls.insert( tp->queuedCalls.end(), calls.begin(), calls.end() );
-        calls.clear();
-        numCalls = -1;
-        //printf("  f\n");
-        return true;
-      }
-      lock.unlock();
-      os::sleep(ASYNC_READER_SLEEP);
+  void ThreadedParser::deleteRecycledCalls() {
+    trace::Call * call;
+    while( recycledCalls->try_pop( call ) ) {
+      delete call;
     }
-    return false;
   }
 
-  void async_reader() {
-    for(;die==false;) {
-      os::unique_lock<os::mutex> lock(readerMutex);
-      if( inbox != NULL ) {
-        ThreadedParser *tp = inbox;
-        inbox = NULL;
-        std::vector< trace::Call * > c;
-
-        lock.unlock();
-        while( c.size() < ASYNC_READER_CALLS ) {
-          c.push_back( tp->parser.parse_call() );
-          if( c.back() == NULL ) {
-            c.pop_back();
-            break;
-          }
-        }
-        lock.lock(); // who's there?
-        calls = c;
-        numCalls = calls.size();
-        //printf(" r %d\n", numCalls );
-      } else {
-        lock.unlock();
-        os::sleep(ASYNC_READER_SLEEP);
-      }
+  void ThreadedParser::recycle( trace::Call * call ) {
+    if( !recycledCalls->try_push( call ) ) {
+      // The reader is lagging behind; never block on it.
+      delete call;
     }
   }
 
-  bool ThreadedParser::open( const char * file ) {
-    if( readerThread == NULL ) {
-      readerThread = new os::thread( async_reader, NULL );
+  void ThreadedParser::startReader() {
+    assert( !readerThread.joinable() );
+    if( queuedCalls == NULL ) {
+      queuedCalls = new os::spsc_queue<Item>( queueSize );
+      recycledCalls = new os::spsc_queue<trace::Call *>( queueSize );
     }
-    if( destroyerThread == NULL ) {
-      destroyerThread = new os::thread( async_destroyer, NULL );
+    stopping = false;
+    finished = false;
+    readerThread = os::thread( readerThreadFunction, this );
+  }
+
+  /**
+   * Stop the reader thread, discarding all calls parsed ahead.
+   */
+  void ThreadedParser::stopReader() {
+    if( currentCall ) {
+      delete currentCall;
+      currentCall = NULL;
     }
+    if( !readerThread.joinable() ) {
+      return;
+    }
+    stopping = true;
+    if( !finished ) {
+      // Drain the queue until the reader acknowledges with a NULL call
+      Item item;
+      do {
+        queuedCalls->pop( item );
+        delete item.call;
+      } while( item.call );
+    }
+    readerThread.join();
+    readerThread = os::thread();
+    // The reader is gone, so it is now safe to consume its queue from here
+    trace::Call * call;
+    while( recycledCalls->try_pop( call ) ) {
+      delete call;
+    }
+  }
+
+  bool ThreadedParser::open( const char * file ) {
     bool ret = parser.open(file);
     if( ret ) {
-      enqueue_read( this );
+      parser.getBookmark( currentBookmark );
+      startReader();
     }
     return ret;
   }
+
   void ThreadedParser::close() {
+    stopReader();
     parser.close();
+    delete queuedCalls;
+    queuedCalls = NULL;
+    delete recycledCalls;
+    recycledCalls = NULL;
   }
+
   void ThreadedParser::getBookmark( trace::ParseBookmark & bm ) {
-    parser.getBookmark(bm);
-    bookmark = bm.next_call_no;
+    bm = currentBookmark;
   }
+
   void ThreadedParser::setBookmark( const trace::ParseBookmark & bm ) {
+    stopReader();
     parser.setBookmark(bm);
-    delete_retired_calls( this );
-    queuedCalls.insert( queuedCalls.begin(), retiredCalls.begin(), retiredCalls.end() );
-    retiredCalls.clear();
+    currentBookmark = bm;
+    startReader();
   }
+
   trace::Call * ThreadedParser::parse_call() {
-    if( queuedCalls.size() == 0 ) {
-        fetch_read( this );
-        if( queuedCalls.size() == 0 ) {
-            delete_retired_calls( this );
-            die = true;
-            destroyerThread->join();
-            readerThread->join();
-            return NULL;
-        }
-        enqueue_read( this );
+    if( currentCall ) {
+      recycle( currentCall );
+      currentCall = NULL;
     }
-    trace::Call * call = queuedCalls.front();
-    queuedCalls.pop_front();
-    if( retiredCalls.size() >= ASYNC_READER_CALLS ) {
-      delete_retired_calls( this );
+    if( finished ) {
+      return NULL;
     }
-    retiredCalls.push_back( call );
-    return call;
+    Item item;
+    queuedCalls->pop( item );
+    if( item.call == NULL ) {
+      finished = true;
+    }
+    currentCall = item.call;
+    currentBookmark = item.bookmark;
+    return item.call;
   }
 
   ThreadedParser parser;
@@ -698,9 +693,14 @@ usage(const char *argv0) {
     "Replay TRACE.\n"
     "\n"
     "      --help              print this message\n"
-    "      --loop              continuously loop, replaying final frame\n";
+    "      --loop              continuously loop, replaying final frame\n"
+    "      --queue-size=CALLS  maximum number of calls parsed ahead (default is " << DEFAULT_QUEUE_SIZE << ")\n";
 }
 
+enum {
+  QUEUE_SIZE_OPT = CHAR_MAX + 1
+};
+
 const static char *
 shortOptions = "hl";
 
@@ -708,6 +708,7 @@ const static struct option
 longOptions[] = {
   {"help", no_argument, 0, 'h'},
   {"loop", no_argument, 0, 'l'},
+  {"queue-size", required_argument, 0, QUEUE_SIZE_OPT},
   {0, 0, 0, 0}
 };
 
@@ -734,6 +735,12 @@ int main(int argc, char **argv)
         play::debug = false;
         play::verbosity = -1;
         break;
+      case 'l':
+        loopOnFinish = true;
+        break;
+      case QUEUE_SIZE_OPT:
+        play::parser.setQueueSize(atoi(optarg));
+        break;
       default:
         std::cerr << "error: unknown option " << opt << "\n";
         usage(argv[0]);
@@ -27,6 +27,7 @@
 #include <string.h>
 #include <iostream>
 
+#include "os_thread.hpp"
 #include "os_time.hpp"
 #include "retrace.hpp"
 
@@ -37,15 +38,19 @@ namespace retrace {
 trace::DumpFlags dumpFlags = 0;
 
 
-static bool call_dumped = false;
+/*
+ * Call already dumped by each thread, so that it is dumped only once.
+ */
+static OS_THREAD_SPECIFIC_PTR(trace::Call)
+dumped_call;
 
 
 static void dumpCall(trace::Call &call) {
-    if (verbosity >= 0 && !call_dumped) {
+    if (verbosity >= 0 && dumped_call != &call) {
         std::cout << std::hex << call.thread_id << std::dec << " ";
         trace::dump(call, std::cout, dumpFlags);
         std::cout.flush();
-        call_dumped = true;
+        dumped_call = &call;
     }
 }
 
@@ -71,7 +76,7 @@ void unsupported(trace::Call &call) {
 inline void Retracer::addCallback(const Entry *entry) {
     assert(entry->name);
     assert(entry->callback);
-    map[entry->name] = entry->callback;
+    map[entry->name] = entry;
 }
 
 
@@ -82,31 +87,42 @@ void Retracer::addCallbacks(const Entry *entries) {
 }
 
 
-void Retracer::retrace(trace::Call &call) {
-    call_dumped = false;
+static const Entry unsupported_entry = {"", &unsupported, 0};
+
 
-    Callback callback = 0;
+const Entry *Retracer::lookup(trace::Call &call) {
+    const Entry *entry = 0;
 
     trace::Id id = call.sig->id;
-    if (id >= callbacks.size()) {
-        callbacks.resize(id + 1);
-        callback = 0;
+    if (id >= resolvedEntries.size()) {
+        resolvedEntries.resize(id + 1);
+        entry = 0;
     } else {
-        callback = callbacks[id];
+        entry = resolvedEntries[id];
     }
 
-    if (!callback) {
+    if (!entry) {
         Map::const_iterator it = map.find(call.name());
         if (it == map.end()) {
-            callback = &unsupported;
+            entry = &unsupported_entry;
         } else {
-            callback = it->second;
+            entry = it->second;
         }
-        callbacks[id] = callback;
+        resolvedEntries[id] = entry;
     }
 
+    assert(entry);
+    assert(resolvedEntries[id] == entry);
+
+    return entry;
+}
+
+
+void Retracer::retrace(trace::Call &call) {
+    dumped_call = NULL;
+
+    Callback callback = lookup(call)->callback;
     assert(callback);
-    assert(callbacks[id] == callback);
 
     if (verbosity >= 1) {
         if (verbosity >= 2 ||
@@ -39,10 +39,14 @@
 #include "trace_parser.hpp"
 #include "trace_profiler.hpp"
 #include "trace_dump.hpp"
+#include "os_thread.hpp"
+#include "os_queue.hpp"
 
 #include "scoped_allocator.hpp"
 
 
+class JSONDelta;
+
 namespace image {
     class Image;
 }
@@ -51,19 +55,115 @@ namespace image {
 namespace retrace {
 
 
-extern trace::Parser parser;
+/**
+ * Parser which parses calls ahead on a separate thread.
+ *
+ * Parsed calls are handed over to the replaying thread through a bounded
+ * lock-free queue, which is bounded by the size of the blobs in the queued
+ * calls too.  Callers own the calls returned by parse_call(), but should
+ * hand them back with release() so that they are deleted on the parser thread
+ * too.  Only one thread may be calling parse_call() or release() at any given
+ * time.
+ *
+ * With a queue size of zero, calls are parsed on the calling thread.
+ */
+class ThreadedParser
+{
+public:
+    ThreadedParser();
+    ~ThreadedParser();
+
+    bool open(const char *filename);
+    void close(void);
+
+    void getBookmark(trace::ParseBookmark &bookmark);
+    void setBookmark(const trace::ParseBookmark &bookmark);
+
+    trace::Call *parse_call(void);
+    void release(trace::Call *call);
+
+    /**
+     * Maximum number of calls parsed ahead.  Must be set before open().
+     */
+    void setQueueSize(size_t size) {
+        queueSize = size;
+    }
+
+    trace::Parser parser;
+    unsigned long long &version;
+
+private:
+    struct Item {
+        trace::Call *call;
+        // Parser position right after this call
+        trace::ParseBookmark bookmark;
+        // Total size of the call's blobs
+        size_t blobSize;
+    };
+
+    size_t queueSize;
+    os::spsc_queue<Item> *queuedCalls;
+    os::spsc_queue<trace::Call *> *releasedCalls;
+
+    /*
+     * Size of the blobs queued, protected by blobMutex.  Only calls with
+     * blobs take the mutex.
+     */
+    os::mutex blobMutex;
+    os::condition_variable blobCond;
+    size_t queuedBlobSize;
+    bool readerWaiting;
+    os::thread readerThread;
+    volatile bool stopping;
+    bool finished;
+
+    // Position right after the last call returned
+    trace::ParseBookmark currentBookmark;
+
+    static void *
+    readerThreadFunction(ThreadedParser *_this);
+
+    void read(void);
+    void deleteReleasedCalls(void);
+    void queueBlobs(size_t size);
+    void dequeueBlobs(size_t size);
+    void startReader(void);
+    void stopReader(void);
+};
+
+
+extern ThreadedParser parser;
 extern trace::Profiler profiler;
 
 
 class ScopedAllocator : public ::ScopedAllocator
 {
+private:
+    /*
+     * Small arrays are carved out of this buffer, which lives on the stack
+     * together with the allocator, sparing the common case of short input
+     * arrays a malloc/free pair.
+     */
+    union {
+        double d;
+        unsigned long long ull;
+        void *ptr;
+        unsigned char bytes[256];
+    } local;
+    size_t localUsed;
+
 public:
+    inline
+    ScopedAllocator() :
+        localUsed(0) {
+    }
+
     /**
      * Allocate an array with the same dimensions as the specified value.
      */
     inline void *
     alloc(const trace::Value *value, size_t size) {
-        const trace::Array *array = value->toArray();
+        const trace::Array *array = trace::toArray(*value);
         if (array) {
             return ::ScopedAllocator::alloc(array->size() * size);
         }
@@ -75,6 +175,28 @@ public:
         return NULL;
     }
 
+    /**
+     * Same as above, but small arrays are allocated from the stack.
+     *
+     * The result must not be passed to bind(), as it only lives as long as
+     * the allocator.
+     */
+    inline void *
+    allocLocal(const trace::Value *value, size_t size) {
+        const trace::Array *array = trace::toArray(*value);
+        if (array) {
+            size_t bytes = array->size() * size;
+            // Keep subsequent allocations suitably aligned
+            bytes = (bytes + sizeof(unsigned long long) - 1) & ~(sizeof(unsigned long long) - 1);
+            if (bytes && bytes <= sizeof local.bytes - localUsed) {
+                void *ptr = &local.bytes[localUsed];
+                localUsed += bytes;
+                return ptr;
+            }
+        }
+        return alloc(value, size);
+    }
+
 };
 
 
@@ -102,6 +224,12 @@ extern bool profilingMemoryUsage;
  */
 extern bool dumpingState;
 
+/**
+ * Objects emitted by previous state dumps, when dumping at several calls.
+ * NULL otherwise.
+ */
+extern JSONDelta *dumpStateDelta;
+
 
 enum Driver {
     DRIVER_DEFAULT,
@@ -118,8 +246,19 @@ extern const char *driverModule;
 extern bool doubleBuffer;
 extern unsigned samples;
 
+/**
+ * Directory where linked program binaries are cached, or NULL.
+ */
+extern const char *programCacheDir;
+extern bool precompiling;
+
 extern unsigned frameNo;
-extern unsigned callNo;
+
+/**
+ * Number of the call being replayed by the calling thread.
+ */
+unsigned
+getCallNo(void);
 
 extern trace::DumpFlags dumpFlags;
 
@@ -132,9 +271,19 @@ void unsupported(trace::Call &call);
 
 typedef void (*Callback)(trace::Call &call);
 
+enum {
+    /**
+     * The call only touches the state of the current context, and objects
+     * which are never shared with other contexts, so it may be replayed
+     * concurrently with the calls of other threads.
+     */
+    ENTRY_FLAG_CONCURRENT = (1 << 0),
+};
+
 struct Entry {
     const char *name;
     Callback callback;
+    unsigned flags;
 };
 
 
@@ -150,10 +299,13 @@ extern const Entry stdc_callbacks[];
 
 class Retracer
 {
-    typedef std::map<const char *, Callback, stringComparer> Map;
+    typedef std::map<const char *, const Entry *, stringComparer> Map;
     Map map;
 
-    std::vector<Callback> callbacks;
+    std::vector<const Entry *> resolvedEntries;
+
+    const Entry *
+    lookup(trace::Call &call);
 
 public:
     Retracer() {
@@ -165,6 +317,14 @@ public:
     void addCallback(const Entry *entry);
     void addCallbacks(const Entry *entries);
 
+    /**
+     * Flags of the entry replaying the call, see ENTRY_FLAG_*.
+     */
+    unsigned
+    getFlags(trace::Call &call) {
+        return lookup(call)->flags;
+    }
+
     void retrace(trace::Call &call);
 };
 
@@ -177,6 +337,21 @@ public:
         return NULL;
     }
 
+    /**
+     * Start taking a snapshot without waiting for it, returning false if not
+     * supported.  Snapshots started this way are retrieved, in the same
+     * order, with endSnapshot(), which must be called on the same thread.
+     */
+    virtual bool
+    beginSnapshot(void) {
+        return false;
+    }
+
+    virtual image::Image *
+    endSnapshot(void) {
+        return NULL;
+    }
+
     virtual bool
     dumpState(std::ostream &os) {
         return false;
@@ -196,6 +371,13 @@ setUp(void);
 void
 addCallbacks(retrace::Retracer &retracer);
 
+/**
+ * Fill the program cache with every program in the trace, ahead of replaying
+ * it.
+ */
+void
+precompile(const char *filename);
+
 void
 frameComplete(trace::Call &call);
 
@@ -212,6 +394,14 @@ flushRendering(void);
 void
 finishRendering(void);
 
+/**
+ * Finish rendering on a thread which replays no more calls, and release
+ * what is current on it, so that the main thread may use it (called by the
+ * runner threads before exiting, one at a time.)
+ */
+void
+releaseRendering(void);
+
 void
 waitForInput(void);
 
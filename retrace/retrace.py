@@ -40,19 +40,35 @@ class UnsupportedType(Exception):
     pass
 
 
-def lookupHandle(handle, value, lval=False):
+def handleMap(handle):
     if handle.key is None:
-        return "_%s_map[%s]" % (handle.name, value)
+        return "_%s_map" % (handle.name,)
     else:
         key_name, key_type = handle.key
-        if handle.name == "location" and lval == False:
-            return "_location_map[%s].lookupUniformLocation(%s)" % (key_name, value)
-        else:
-            return "_%s_map[%s][%s]" % (handle.name, key_name, value)
+        return "_%s_map[%s]" % (handle.name, key_name)
+
+
+def lookupHandle(handle, value):
+    if handle.name == "location" and handle.key is not None:
+        return "%s.lookupUniformLocation(%s)" % (handleMap(handle), value)
+    else:
+        return "%s[%s]" % (handleMap(handle), value)
 
 
 class ValueAllocator(stdapi.Visitor):
 
+    def __init__(self, local = False):
+        # Whether small arrays may be allocated from the stack, which is only
+        # safe when the argument is not referred beyond the call life-time.
+        self.local = local
+
+    def allocArray(self, type, lvalue, rvalue):
+        if self.local:
+            method = 'allocLocal'
+        else:
+            method = 'alloc'
+        print '    %s = static_cast<%s *>(_allocator.%s(&%s, sizeof *%s));' % (lvalue, type, method, rvalue, lvalue)
+
     def visitLiteral(self, literal, lvalue, rvalue):
         pass
 
@@ -69,10 +85,10 @@ class ValueAllocator(stdapi.Visitor):
         pass
 
     def visitArray(self, array, lvalue, rvalue):
-        print '    %s = static_cast<%s *>(_allocator.alloc(&%s, sizeof *%s));' % (lvalue, array.type, rvalue, lvalue)
+        self.allocArray(array.type, lvalue, rvalue)
 
     def visitPointer(self, pointer, lvalue, rvalue):
-        print '    %s = static_cast<%s *>(_allocator.alloc(&%s, sizeof *%s));' % (lvalue, pointer.type, rvalue, lvalue)
+        self.allocArray(pointer.type, lvalue, rvalue)
 
     def visitIntPointer(self, pointer, lvalue, rvalue):
         pass
@@ -109,7 +125,7 @@ class ValueAllocator(stdapi.Visitor):
 class ValueDeserializer(stdapi.Visitor, stdapi.ExpanderMixin):
 
     def visitLiteral(self, literal, lvalue, rvalue):
-        print '    %s = (%s).to%s();' % (lvalue, rvalue, literal.kind)
+        print '    %s = trace::to%s(%s);' % (lvalue, literal.kind, rvalue)
 
     def visitConst(self, const, lvalue, rvalue):
         self.visit(const.type, lvalue, rvalue)
@@ -118,7 +134,7 @@ class ValueDeserializer(stdapi.Visitor, stdapi.ExpanderMixin):
         self.visit(alias.type, lvalue, rvalue)
     
     def visitEnum(self, enum, lvalue, rvalue):
-        print '    %s = static_cast<%s>((%s).toSInt());' % (lvalue, enum, rvalue)
+        print '    %s = static_cast<%s>(trace::toSInt(%s));' % (lvalue, enum, rvalue)
 
     def visitBitmask(self, bitmask, lvalue, rvalue):
         self.visit(bitmask.type, lvalue, rvalue)
@@ -129,7 +145,7 @@ class ValueDeserializer(stdapi.Visitor, stdapi.ExpanderMixin):
         self.seq += 1
 
         print '    if (%s) {' % (lvalue,)
-        print '        const trace::Array *%s = (%s).toArray();' % (tmp, rvalue)
+        print '        const trace::Array *%s = trace::toArray(%s);' % (tmp, rvalue)
         length = '%s->values.size()' % (tmp,)
         index = '_j' + array.tag
         print '        for (size_t {i} = 0; {i} < {length}; ++{i}) {{'.format(i = index, length = length)
@@ -144,7 +160,7 @@ class ValueDeserializer(stdapi.Visitor, stdapi.ExpanderMixin):
         self.seq += 1
 
         print '    if (%s) {' % (lvalue,)
-        print '        const trace::Array *%s = (%s).toArray();' % (tmp, rvalue)
+        print '        const trace::Array *%s = trace::toArray(%s);' % (tmp, rvalue)
         try:
             self.visit(pointer.type, '%s[0]' % (lvalue,), '*%s->values[0]' % (tmp,))
         finally:
@@ -234,6 +250,25 @@ class OpaqueValueDeserializer(ValueDeserializer):
         print '    %s = static_cast<%s>(retrace::toPointer(%s));' % (lvalue, opaque, rvalue)
 
 
+class SharedObjectFinder(stdapi.Traverser):
+    '''Type visitor which finds whether values of a type refer to objects
+    shared between threads.'''
+
+    def __init__(self, retracer):
+        self.retracer = retracer
+        self.found = False
+
+    def visitHandle(self, handle):
+        if self.retracer.isSharedHandle(handle):
+            self.found = True
+
+    def visitObjPointer(self, pointer):
+        self.found = True
+
+    def visitInterface(self, interface):
+        self.found = True
+
+
 class SwizzledValueRegistrator(stdapi.Visitor, stdapi.ExpanderMixin):
     '''Type visitor which will register (un)swizzled value pairs, to later be
     swizzled.'''
@@ -251,7 +286,7 @@ class SwizzledValueRegistrator(stdapi.Visitor, stdapi.ExpanderMixin):
         pass
 
     def visitArray(self, array, lvalue, rvalue):
-        print '    const trace::Array *_a%s = (%s).toArray();' % (array.tag, rvalue)
+        print '    const trace::Array *_a%s = trace::toArray(%s);' % (array.tag, rvalue)
         print '    if (_a%s) {' % (array.tag)
         length = '_a%s->values.size()' % array.tag
         index = '_j' + array.tag
@@ -263,7 +298,7 @@ class SwizzledValueRegistrator(stdapi.Visitor, stdapi.ExpanderMixin):
             print '    }'
     
     def visitPointer(self, pointer, lvalue, rvalue):
-        print '    const trace::Array *_a%s = (%s).toArray();' % (pointer.tag, rvalue)
+        print '    const trace::Array *_a%s = trace::toArray(%s);' % (pointer.tag, rvalue)
         print '    if (_a%s) {' % (pointer.tag)
         try:
             self.visit(pointer.type, '%s[0]' % (lvalue,), '*_a%s->values[0]' % (pointer.tag,))
@@ -289,15 +324,15 @@ class SwizzledValueRegistrator(stdapi.Visitor, stdapi.ExpanderMixin):
         OpaqueValueDeserializer().visit(handle.type, '_origResult', rvalue);
         if handle.range is None:
             rvalue = "_origResult"
-            entry = lookupHandle(handle, rvalue, True)
-            if (entry.startswith('_program_map') or entry.startswith('_shader_map')):
+            entry = handleMap(handle)
+            if handle.name in ('program', 'shader') and handle.key is None:
                 print 'if (glretrace::supportsARBShaderObjects) {'
-                print '    _handleARB_map[%s] = %s;' % (rvalue, lvalue)
+                print '    _handleARB_map.set(%s, %s);' % (rvalue, lvalue)
                 print '} else {'
-                print '    %s = %s;' % (entry, lvalue)
+                print '    %s.set(%s, %s);' % (entry, rvalue, lvalue)
                 print '}'
             else:
-                print "    %s = %s;" % (entry, lvalue)
+                print "    %s.set(%s, %s);" % (entry, rvalue, lvalue)
             print '    if (retrace::verbosity >= 2) {'
             print '        std::cout << "{handle.name} " << {rvalue} << " -> " << {lvalue} << "\\n";'.format(**locals())
             print '    }'
@@ -305,9 +340,9 @@ class SwizzledValueRegistrator(stdapi.Visitor, stdapi.ExpanderMixin):
             i = '_h' + handle.tag
             lvalue = "%s + %s" % (lvalue, i)
             rvalue = "_origResult + %s" % (i,)
-            entry = lookupHandle(handle, rvalue) 
+            entry = handleMap(handle)
             print '    for ({handle.type} {i} = 0; {i} < {handle.range}; ++{i}) {{'.format(**locals())
-            print '        {entry} = {lvalue};'.format(**locals())
+            print '        {entry}.set({rvalue}, {lvalue});'.format(**locals())
             print '        if (retrace::verbosity >= 2) {'
             print '            std::cout << "{handle.name} " << ({rvalue}) << " -> " << ({lvalue}) << "\\n";'.format(**locals())
             print '        }'
@@ -449,7 +484,9 @@ class Retracer:
         print '    return;'
 
     def extractArg(self, function, arg, arg_type, lvalue, rvalue):
-        ValueAllocator().visit(arg_type, lvalue, rvalue)
+        # Output arguments may be bound beyond the call life-time (e.g.,
+        # glFeedbackBuffer), so only input arrays can live on the stack.
+        ValueAllocator(local = not arg.output).visit(arg_type, lvalue, rvalue)
         if arg.input:
             ValueDeserializer().visit(arg_type, lvalue, rvalue)
     
@@ -503,6 +540,31 @@ class Retracer:
     def filterFunction(self, function):
         return True
 
+    def isSharedHandle(self, handle):
+        '''Whether the objects named by the handle may be shared between
+        threads.'''
+
+        return True
+
+    def isConcurrentFunction(self, function):
+        '''Whether the function may be replayed concurrently with the calls
+        of other threads, which holds when it names no shared objects.'''
+
+        if not function.sideeffects:
+            return True
+
+        finder = SharedObjectFinder(self)
+        for arg in function.args:
+            finder.visit(arg.type)
+        finder.visit(function.type)
+        return not finder.found
+
+    def entryFlags(self, function):
+        if self.isConcurrentFunction(function):
+            return 'retrace::ENTRY_FLAG_CONCURRENT'
+        else:
+            return '0'
+
     table_name = 'retrace::callbacks'
 
     def retraceApi(self, api):
@@ -522,7 +584,7 @@ class Retracer:
                     print 'static retrace::map<%s> _%s_map;' % (handle.type, handle.name)
                 else:
                     key_name, key_type = handle.key
-                    print 'static std::map<%s, retrace::map<%s> > _%s_map;' % (key_type, handle.type, handle.name)
+                    print 'static retrace::keyed_map<%s, %s> _%s_map;' % (key_type, handle.type, handle.name)
                 handle_names.add(handle.name)
         print
 
@@ -539,17 +601,18 @@ class Retracer:
         print 'const retrace::Entry %s[] = {' % self.table_name
         for function in functions:
             if not function.internal:
+                flags = self.entryFlags(function)
                 if function.sideeffects:
-                    print '    {"%s", &retrace_%s},' % (function.name, function.name)
+                    print '    {"%s", &retrace_%s, %s},' % (function.name, function.name, flags)
                 else:
-                    print '    {"%s", &retrace::ignore},' % (function.name,)
+                    print '    {"%s", &retrace::ignore, %s},' % (function.name, flags)
         for interface in interfaces:
             for method in interface.iterMethods():                
                 if method.sideeffects:
-                    print '    {"%s::%s", &retrace_%s__%s},' % (interface.name, method.name, interface.name, method.name)
+                    print '    {"%s::%s", &retrace_%s__%s, 0},' % (interface.name, method.name, interface.name, method.name)
                 else:
-                    print '    {"%s::%s", &retrace::ignore},' % (interface.name, method.name)
-        print '    {NULL, NULL}'
+                    print '    {"%s::%s", &retrace::ignore, 0},' % (interface.name, method.name)
+        print '    {NULL, NULL, 0}'
         print '};'
         print
 
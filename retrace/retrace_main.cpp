@@ -29,6 +29,10 @@
 #include <string.h>
 #include <limits.h> // for CHAR_MAX
 #include <iostream>
+#include <fstream>
+#include <algorithm>
+#include <deque>
+#include <vector>
 #include <getopt.h>
 #ifndef _WIN32
 #include <unistd.h> // for isatty()
@@ -38,40 +42,324 @@
 #include "os_time.hpp"
 #include "os_thread.hpp"
 #include "image.hpp"
+#include "json.hpp"
 #include "trace_callset.hpp"
 #include "trace_dump.hpp"
 #include "trace_option.hpp"
 #include "retrace.hpp"
+#include "retrace_swizzle.hpp"
 
 
 static bool waitOnFinish = false;
 static bool loopOnFinish = false;
+static unsigned loopCount = 0; // zero means forever
+static unsigned loopsDone = 0;
+
+static bool preload = false;
+static bool threadedParse = false;
+static unsigned preloadFirstFrame = 0;
+static unsigned preloadLastFrame = 0;
 
 static const char *snapshotPrefix = NULL;
 static enum {
     PNM_FMT,
     RAW_RGB,
-    RAW_MD5
+    RAW_MD5,
+    TILE_HASHES
 } snapshotFormat = PNM_FMT;
 
 static trace::CallSet snapshotFrequency;
+static unsigned snapshotLatency = 0;
 static trace::ParseBookmark lastFrameStart;
 
 static unsigned dumpStateCallNo = ~0;
+static trace::CallSet dumpStateCalls;
+
+/* Per-stage timing, gathered when replaying with the null driver to measure
+ * the CPU overhead of the replay pipeline itself. */
+static bool stageTiming = false;
+static long long parseTime = 0;
+static long long retraceTime = 0;
+static unsigned long long callCount = 0;
+static unsigned long long traceSize = 0;
 
 retrace::Retracer retracer;
 
 
+#define DEFAULT_QUEUE_SIZE 16384
+
+/**
+ * Maximum size of the blobs in the calls parsed ahead, so that traces
+ * uploading large textures or buffers don't queue gigabytes of them.
+ */
+#define QUEUE_MAX_BLOB_SIZE (64*1024*1024)
+
+/**
+ * Number of calls (or free slots) handed over at once between the parsing
+ * and the replaying threads.
+ */
+#define QUEUE_BATCH_SIZE 64
+
+
 namespace retrace {
 
 
-trace::Parser parser;
+ThreadedParser::ThreadedParser() :
+    version(parser.version),
+    queueSize(DEFAULT_QUEUE_SIZE),
+    queuedCalls(NULL),
+    releasedCalls(NULL),
+    queuedBlobSize(0),
+    readerWaiting(false),
+    stopping(false),
+    finished(false)
+{
+}
+
+
+ThreadedParser::~ThreadedParser() {
+    close();
+}
+
+
+void *
+ThreadedParser::readerThreadFunction(ThreadedParser *_this) {
+    _this->read();
+    return 0;
+}
+
+
+static size_t
+getBlobSize(const trace::Value *value) {
+    if (!value) {
+        return 0;
+    }
+    if (value->kind == trace::Value::KIND_ARRAY) {
+        const trace::Array *array = static_cast<const trace::Array *>(value);
+        size_t size = 0;
+        for (size_t i = 0; i < array->values.size(); ++i) {
+            size += getBlobSize(array->values[i]);
+        }
+        return size;
+    }
+    if (value->kind == trace::Value::KIND_OTHER) {
+        const trace::Blob *blob = dynamic_cast<const trace::Blob *>(value);
+        if (blob) {
+            return blob->size;
+        }
+    }
+    return 0;
+}
+
+
+static size_t
+getBlobSize(const trace::Call *call) {
+    size_t size = 0;
+    for (size_t i = 0; i < call->args.size(); ++i) {
+        size += getBlobSize(call->args[i].value);
+    }
+    return size;
+}
+
+
+/**
+ * Reader thread main loop.
+ */
+void
+ThreadedParser::read(void) {
+    while (1) {
+        deleteReleasedCalls();
+
+        Item item;
+        item.call = stopping ? NULL : parser.parse_call();
+        parser.getBookmark(item.bookmark);
+        item.blobSize = item.call ? getBlobSize(item.call) : 0;
+
+        // Both block while the queue is full
+        queueBlobs(item.blobSize);
+        queuedCalls->push(item);
+        if (!item.call) {
+            break;
+        }
+    }
+    queuedCalls->flush();
+    deleteReleasedCalls();
+}
+
+
+/**
+ * Account for the blobs of a call about to be queued, waiting while there is
+ * no room for them.
+ */
+void
+ThreadedParser::queueBlobs(size_t size) {
+    if (!size) {
+        return;
+    }
+    os::unique_lock<os::mutex> lock(blobMutex);
+    if (queuedBlobSize && queuedBlobSize + size > QUEUE_MAX_BLOB_SIZE) {
+        // The replaying thread may be waiting for a whole batch
+        queuedCalls->flush();
+        readerWaiting = true;
+        while (queuedBlobSize && queuedBlobSize + size > QUEUE_MAX_BLOB_SIZE) {
+            blobCond.wait(lock);
+        }
+        readerWaiting = false;
+    }
+    queuedBlobSize += size;
+}
+
+
+void
+ThreadedParser::dequeueBlobs(size_t size) {
+    if (!size) {
+        return;
+    }
+    os::unique_lock<os::mutex> lock(blobMutex);
+    queuedBlobSize -= size;
+    if (readerWaiting && queuedBlobSize <= QUEUE_MAX_BLOB_SIZE / 2) {
+        blobCond.signal();
+    }
+}
+
+
+void
+ThreadedParser::deleteReleasedCalls(void) {
+    trace::Call *call;
+    while (releasedCalls->try_pop(call)) {
+        delete call;
+    }
+}
+
+
+void
+ThreadedParser::startReader(void) {
+    assert(!readerThread.joinable());
+    if (!queuedCalls) {
+        // Hand calls over in batches, rather than waking up the replaying
+        // thread for every call
+        queuedCalls = new os::spsc_queue<Item>(queueSize, QUEUE_BATCH_SIZE);
+        releasedCalls = new os::spsc_queue<trace::Call *>(queueSize);
+    }
+    stopping = false;
+    finished = false;
+    readerThread = os::thread(readerThreadFunction, this);
+}
+
+
+/**
+ * Stop the reader thread, discarding all calls parsed ahead.
+ */
+void
+ThreadedParser::stopReader(void) {
+    if (!readerThread.joinable()) {
+        return;
+    }
+    stopping = true;
+    if (!finished) {
+        // Drain the queue until the reader acknowledges with a NULL call
+        Item item;
+        do {
+            queuedCalls->pop(item);
+            dequeueBlobs(item.blobSize);
+            delete item.call;
+        } while (item.call);
+    }
+    readerThread.join();
+    readerThread = os::thread();
+
+    // The reader is gone, so it is now safe to consume its queue from here
+    trace::Call *call;
+    while (releasedCalls->try_pop(call)) {
+        delete call;
+    }
+}
+
+
+bool
+ThreadedParser::open(const char *filename) {
+    if (!parser.open(filename)) {
+        return false;
+    }
+    parser.getBookmark(currentBookmark);
+    if (queueSize) {
+        startReader();
+    }
+    return true;
+}
+
+
+void
+ThreadedParser::close(void) {
+    stopReader();
+    parser.close();
+    delete queuedCalls;
+    queuedCalls = NULL;
+    delete releasedCalls;
+    releasedCalls = NULL;
+}
+
+
+void
+ThreadedParser::getBookmark(trace::ParseBookmark &bookmark) {
+    if (!queueSize) {
+        parser.getBookmark(bookmark);
+        return;
+    }
+    bookmark = currentBookmark;
+}
+
+
+void
+ThreadedParser::setBookmark(const trace::ParseBookmark &bookmark) {
+    if (!queueSize) {
+        parser.setBookmark(bookmark);
+        return;
+    }
+    stopReader();
+    parser.setBookmark(bookmark);
+    currentBookmark = bookmark;
+    startReader();
+}
+
+
+trace::Call *
+ThreadedParser::parse_call(void) {
+    if (!queueSize) {
+        return parser.parse_call();
+    }
+    if (finished) {
+        return NULL;
+    }
+    Item item;
+    queuedCalls->pop(item);
+    dequeueBlobs(item.blobSize);
+    if (!item.call) {
+        finished = true;
+    }
+    currentBookmark = item.bookmark;
+    return item.call;
+}
+
+
+void
+ThreadedParser::release(trace::Call *call) {
+    if (!releasedCalls ||
+        !releasedCalls->try_push(call)) {
+        // The reader is lagging behind; never block on it.
+        delete call;
+    }
+}
+
+
+ThreadedParser parser;
 trace::Profiler profiler;
 
 
 int verbosity = 0;
 bool debug = true;
 bool dumpingState = false;
+JSONDelta *dumpStateDelta = NULL;
 
 Driver driver = DRIVER_DEFAULT;
 const char *driverModule = NULL;
@@ -79,6 +367,9 @@ const char *driverModule = NULL;
 bool doubleBuffer = true;
 unsigned samples = 1;
 
+const char *programCacheDir = NULL;
+bool precompiling = false;
+
 bool profiling = false;
 bool profilingGpuTimes = false;
 bool profilingCpuTimes = false;
@@ -86,9 +377,27 @@ bool profilingPixelsDrawn = false;
 bool profilingMemoryUsage = false;
 bool useCallNos = true;
 bool singleThread = false;
+bool concurrent = false;
 
 unsigned frameNo = 0;
-unsigned callNo = 0;
+
+
+/*
+ * Although callNoPtr is a void *, we actually use it as a uintptr_t.
+ */
+static OS_THREAD_SPECIFIC_PTR(void)
+callNoPtr;
+
+unsigned
+getCallNo(void) {
+    return static_cast<unsigned>(
+        reinterpret_cast<uintptr_t>(static_cast<void *>(callNoPtr)));
+}
+
+static inline void
+setCallNo(unsigned no) {
+    callNoPtr = reinterpret_cast<void *>(static_cast<uintptr_t>(no));
+}
 
 
 void
@@ -103,15 +412,12 @@ Dumper *dumper = &defaultDumper;
 
 
 /**
- * Take snapshots.
+ * Write out a snapshot.
  */
 static void
-takeSnapshot(unsigned call_no) {
+writeSnapshot(image::Image *src, unsigned call_no) {
     static unsigned snapshot_no = 0;
 
-    assert(snapshotPrefix);
-
-    image::Image *src = dumper->getSnapshot();
     if (!src) {
         std::cerr << call_no << ": warning: failed to get snapshot\n";
         return;
@@ -132,6 +438,9 @@ takeSnapshot(unsigned call_no) {
             case RAW_MD5:
                 src->writeMD5(std::cout);
                 break;
+            case TILE_HASHES:
+                src->writeTileHashes(std::cout, comment);
+                break;
             default:
                 assert(0);
                 break;
@@ -154,6 +463,63 @@ takeSnapshot(unsigned call_no) {
 }
 
 
+struct PendingSnapshot {
+    unsigned call_no;
+    image::Image *image;
+    bool async;
+};
+
+static std::deque<PendingSnapshot> pendingSnapshots;
+
+
+static void
+writeOldestSnapshot(void) {
+    PendingSnapshot &pending = pendingSnapshots.front();
+    image::Image *src = pending.async ? dumper->endSnapshot() : pending.image;
+    writeSnapshot(src, pending.call_no);
+    pendingSnapshots.pop_front();
+}
+
+
+/**
+ * Write out all snapshots still being read back.  Must be called from the
+ * thread that took them.
+ */
+static void
+flushSnapshots(void) {
+    while (!pendingSnapshots.empty()) {
+        writeOldestSnapshot();
+    }
+}
+
+
+/**
+ * Take snapshots.
+ *
+ * With a snapshot latency, each snapshot is only read back and written out
+ * that many snapshots later, so that the replay does not wait for it.
+ */
+static void
+takeSnapshot(unsigned call_no) {
+    assert(snapshotPrefix);
+
+    if (!snapshotLatency) {
+        writeSnapshot(dumper->getSnapshot(), call_no);
+        return;
+    }
+
+    PendingSnapshot pending;
+    pending.call_no = call_no;
+    pending.async = dumper->beginSnapshot();
+    pending.image = pending.async ? NULL : dumper->getSnapshot();
+    pendingSnapshots.push_back(pending);
+
+    if (pendingSnapshots.size() > snapshotLatency) {
+        writeOldestSnapshot();
+    }
+}
+
+
 /**
  * Retrace one call.
  *
@@ -180,8 +546,15 @@ retraceCall(trace::Call *call) {
         }
     }
 
-    callNo = call->no;
-    retracer.retrace(*call);
+    setCallNo(call->no);
+    if (stageTiming) {
+        long long startTime = os::getTime();
+        retracer.retrace(*call);
+        retraceTime += os::getTime() - startTime;
+        ++callCount;
+    } else {
+        retracer.retrace(*call);
+    }
 
     if (doSnapshot && !swapRenderTarget)
         takeSnapshot(call->no);
@@ -190,6 +563,27 @@ retraceCall(trace::Call *call) {
         dumper->dumpState(std::cout)) {
         exit(0);
     }
+
+    if (dumpStateCalls.contains(*call)) {
+        dumpStateDelta->callNo = call->no;
+        dumper->dumpState(std::cout);
+    }
+}
+
+
+/**
+ * Parse the next call, accounting for the time spent if requested.
+ */
+static inline trace::Call *
+parseCall(void) {
+    if (!stageTiming) {
+        return parser.parse_call();
+    }
+
+    long long startTime = os::getTime();
+    trace::Call *call = parser.parse_call();
+    parseTime += os::getTime() - startTime;
+    return call;
 }
 
 
@@ -310,6 +704,8 @@ public:
 
         if (leg == 0) {
             race->stopRunners();
+        } else {
+            releaseRendering();
         }
     }
 
@@ -333,14 +729,17 @@ public:
             }
 
             retraceCall(call);
-            delete call;
-            call = parser.parse_call();
+            parser.release(call);
+            call = parseCall();
 
             /* Restart last frame if looping is requested. */
             if (loopOnFinish) {
                 if (!call) {
-                    parser.setBookmark(lastFrameStart);
-                    call = parser.parse_call();
+                    if (!loopCount || loopsDone < loopCount) {
+                        ++loopsDone;
+                        parser.setBookmark(lastFrameStart);
+                        call = parseCall();
+                    }
                 } else if (callEndsFrame) {
                     lastFrameStart = frameStart;
                 }
@@ -348,6 +747,8 @@ public:
 
         } while (call && call->thread_id == leg);
 
+        flushSnapshots();
+
         if (call) {
             /* Pass the baton */
             assert(call->thread_id != leg);
@@ -447,7 +848,7 @@ RelayRace::getRunner(unsigned leg) {
 void
 RelayRace::run(void) {
     trace::Call *call;
-    call = parser.parse_call();
+    call = parseCall();
     if (!call) {
         /* Nothing to do */
         return;
@@ -500,6 +901,9 @@ RelayRace::finishLine(void) {
 
 /**
  * Called by the fore runner after finish line to stop all other runners.
+ *
+ * Runners are stopped one at a time, as each releases its rendering state
+ * before exiting.
  */
 void
 RelayRace::stopRunners(void) {
@@ -508,11 +912,454 @@ RelayRace::stopRunners(void) {
         RelayRunner* runner = *it;
         if (runner) {
             runner->finishRace();
+            if (runner->thread.joinable()) {
+                runner->thread.join();
+            }
+        }
+    }
+}
+
+
+/**
+ * Maximum number of calls parsed ahead for a concurrent runner.
+ */
+#define CONCURRENT_QUEUE_SIZE 4096
+
+
+/**
+ * Replays the calls of one thread from the trace, as they are queued.
+ */
+class ConcurrentRunner
+{
+private:
+    unsigned leg;
+
+    os::mutex mutex;
+    os::condition_variable wake_cond;
+    os::condition_variable idle_cond;
+
+    /**
+     * These are protected by the mutex.
+     */
+    std::deque<trace::Call *> calls;
+    bool busy;
+    bool finished;
+    bool waiting;
+
+    os::thread thread;
+
+    static void *
+    runnerThread(ConcurrentRunner *_this);
+
+    void
+    runLeg(void);
+
+public:
+    ConcurrentRunner(unsigned _leg) :
+        leg(_leg),
+        busy(false),
+        finished(false),
+        waiting(false)
+    {
+        thread = os::thread(runnerThread, this);
+    }
+
+    ~ConcurrentRunner() {
+        mutex.lock();
+        finished = true;
+        mutex.unlock();
+
+        wake_cond.signal();
+
+        if (thread.joinable()) {
+            thread.join();
+        }
+    }
+
+    /**
+     * Called by the dispatching thread, which blocks while too many calls
+     * are queued already.
+     */
+    void
+    queueCall(trace::Call *call) {
+        assert(call->thread_id == leg);
+
+        os::unique_lock<os::mutex> lock(mutex);
+        while (calls.size() >= CONCURRENT_QUEUE_SIZE) {
+            waiting = true;
+            idle_cond.wait(lock);
+        }
+        calls.push_back(call);
+        if (calls.size() == 1) {
+            wake_cond.signal();
+        }
+    }
+
+    /**
+     * Wait until all queued calls have been replayed.
+     */
+    void
+    waitIdle(void) {
+        os::unique_lock<os::mutex> lock(mutex);
+        while (busy || !calls.empty()) {
+            waiting = true;
+            idle_cond.wait(lock);
+        }
+    }
+};
+
+
+void *
+ConcurrentRunner::runnerThread(ConcurrentRunner *_this) {
+    _this->runLeg();
+    return 0;
+}
+
+
+void
+ConcurrentRunner::runLeg(void) {
+    os::unique_lock<os::mutex> lock(mutex);
+
+    while (1) {
+        while (!finished && calls.empty()) {
+            wake_cond.wait(lock);
+        }
+
+        if (calls.empty()) {
+            break;
+        }
+
+        trace::Call *call = calls.front();
+        calls.pop_front();
+        busy = true;
+        lock.unlock();
+
+        retraceCall(call);
+        // Only the dispatching thread may hand calls back to the parser
+        delete call;
+
+        lock.lock();
+        busy = false;
+        if (waiting) {
+            waiting = false;
+            idle_cond.signal();
+        }
+    }
+
+    releaseRendering();
+}
+
+
+/**
+ * Implement multi-threading by replaying the calls of each thread
+ * concurrently with the other threads, as they were when traced.
+ *
+ * Only synchronization points are ordered with respect to other threads:
+ * they are replayed after all preceding calls, and before any following call.
+ * These are all calls but those the retracer flags with ENTRY_FLAG_CONCURRENT,
+ * that is, all calls naming objects which may be shared between contexts or
+ * modifying the bound ones, as well as the window system calls.  The first
+ * call with each signature is treated as a synchronization point too, so that
+ * lazily built lookup tables are never filled concurrently.
+ *
+ * The calls of the first thread are replayed by the thread parsing the trace.
+ */
+class ConcurrentRace
+{
+private:
+    /**
+     * Runners indexed by the thread_ids from the trace, except the first.
+     */
+    std::vector<ConcurrentRunner*> runners;
+
+    // Whether calls are synchronization points, indexed by signature id
+    std::vector<unsigned char> syncPoints;
+
+    ConcurrentRunner *
+    getRunner(unsigned leg);
+
+    bool
+    isSyncPoint(trace::Call *call);
+
+    void
+    waitIdle(void);
+
+public:
+    ~ConcurrentRace();
+
+    void
+    run(void);
+};
+
+
+ConcurrentRace::~ConcurrentRace() {
+    std::vector<ConcurrentRunner*>::const_iterator it;
+    for (it = runners.begin(); it != runners.end(); ++it) {
+        ConcurrentRunner* runner = *it;
+        if (runner) {
+            delete runner;
+        }
+    }
+}
+
+
+ConcurrentRunner *
+ConcurrentRace::getRunner(unsigned leg) {
+    assert(leg);
+
+    if (leg >= runners.size()) {
+        runners.resize(leg + 1);
+    }
+    ConcurrentRunner *runner = runners[leg];
+    if (!runner) {
+        runner = new ConcurrentRunner(leg);
+        runners[leg] = runner;
+    }
+    return runner;
+}
+
+
+bool
+ConcurrentRace::isSyncPoint(trace::Call *call) {
+    if (call->flags & (trace::CALL_FLAG_END_FRAME |
+                       trace::CALL_FLAG_SWAP_RENDERTARGET)) {
+        return true;
+    }
+
+    trace::Id id = call->sig->id;
+    if (id >= syncPoints.size()) {
+        syncPoints.resize(id + 1);
+    }
+    unsigned char &syncPoint = syncPoints[id];
+    if (!syncPoint) {
+        // Looking the entry up fills tables the runners read
+        waitIdle();
+        bool concurrent = retracer.getFlags(*call) & ENTRY_FLAG_CONCURRENT;
+        syncPoint = concurrent ? 1 : 2;
+        return true;
+    }
+    return syncPoint == 2;
+}
+
+
+void
+ConcurrentRace::waitIdle(void) {
+    std::vector<ConcurrentRunner*>::const_iterator it;
+    for (it = runners.begin(); it != runners.end(); ++it) {
+        ConcurrentRunner* runner = *it;
+        if (runner) {
+            runner->waitIdle();
         }
     }
 }
 
 
+void
+ConcurrentRace::run(void) {
+    retrace::lockMaps = true;
+
+    trace::Call *call;
+    while ((call = parseCall())) {
+        bool syncPoint = isSyncPoint(call);
+        if (syncPoint) {
+            waitIdle();
+        }
+
+        if (call->thread_id == 0) {
+            retraceCall(call);
+            parser.release(call);
+        } else {
+            ConcurrentRunner *runner = getRunner(call->thread_id);
+            runner->queueCall(call);
+            if (syncPoint) {
+                runner->waitIdle();
+            }
+        }
+    }
+
+    waitIdle();
+
+    retrace::lockMaps = false;
+}
+
+
+/**
+ * Whether the options given require calls to be replayed strictly in order.
+ *
+ * This also ensures the call sets consulted by retraceCall are empty when
+ * replaying concurrently, as CallSet lookups are not thread-safe.
+ */
+static bool
+needsOrderedReplay(void) {
+    return loopOnFinish ||
+           stageTiming ||
+           !snapshotFrequency.empty() ||
+           dumpingState ||
+           profiling ||
+           verbosity >= 1;
+}
+
+
+/**
+ * Histogram of frame times, with eight buckets per octave of microseconds,
+ * so that it takes constant space however long the replay loops, while its
+ * percentiles remain within about 6% of the exact ones.
+ */
+class FrameTimeHistogram
+{
+private:
+    std::vector<unsigned long long> buckets;
+    unsigned long long count;
+    long long minTime;
+
+    static unsigned
+    bucketIndex(unsigned long long us) {
+        if (us < 16) {
+            return us;
+        }
+        unsigned octave = 4;
+        while (octave < 63 && (us >> (octave + 1))) {
+            ++octave;
+        }
+        return (octave - 2) * 8 + ((us >> (octave - 3)) & 7);
+    }
+
+    // Middle of the bucket, in microseconds
+    static double
+    bucketTime(unsigned index) {
+        if (index < 16) {
+            return index;
+        }
+        unsigned octave = index / 8 + 2;
+        unsigned long long width = 1ULL << (octave - 3);
+        return (8 + index % 8) * width + width * 0.5;
+    }
+
+public:
+    FrameTimeHistogram() :
+        buckets(bucketIndex(~0ULL) + 1),
+        count(0),
+        minTime(0)
+    {}
+
+    void
+    add(long long time) {
+        if (!count || time < minTime) {
+            minTime = time;
+        }
+        ++count;
+        ++buckets[bucketIndex(time * 1000000LL / os::timeFrequency)];
+    }
+
+    /**
+     * Frame time in milliseconds below which p% of the frames are.
+     */
+    double
+    percentile(unsigned p) const {
+        if (!p) {
+            return minTime * (1000.0 / os::timeFrequency);
+        }
+        unsigned long long rank = (count * p + 99) / 100;
+        unsigned long long seen = 0;
+        unsigned index = 0;
+        while (index + 1 < buckets.size() &&
+               (seen += buckets[index]) < rank) {
+            ++index;
+        }
+        return bucketTime(index) / 1000.0;
+    }
+};
+
+
+/**
+ * Parse the selected frames once and replay them from memory, so that the
+ * measured frame times do not include decompression and parsing.
+ *
+ * Calls are replayed on the current thread, so the selected frames must not
+ * have calls from several threads.
+ */
+static void
+preloadLoop(void) {
+    trace::Call *call;
+
+    /* Replay the frames before the selected ones as usual, to establish the
+     * state they depend on. */
+    while ((call = parser.parse_call()) && frameNo < preloadFirstFrame) {
+        retraceCall(call);
+        parser.release(call);
+    }
+
+    /* Keep the selected frames, while replaying them for the first time as a
+     * warm up. */
+    std::vector<trace::Call *> calls;
+    bool multiThreaded = false;
+    while (call && frameNo <= preloadLastFrame) {
+        if (!calls.empty() && call->thread_id != calls.front()->thread_id) {
+            multiThreaded = true;
+        }
+        calls.push_back(call);
+        retraceCall(call);
+        call = parser.parse_call();
+    }
+    parser.release(call);
+
+    if (calls.empty()) {
+        std::cerr << "error: no calls in frames " << preloadFirstFrame
+                  << "-" << preloadLastFrame << "\n";
+        return;
+    }
+
+    if (multiThreaded) {
+        std::cerr << "error: frames " << preloadFirstFrame
+                  << "-" << preloadLastFrame << " have calls from several threads,"
+                     " which --preload can't replay\n";
+        for (std::vector<trace::Call *>::const_iterator it = calls.begin();
+             it != calls.end(); ++it) {
+            parser.release(*it);
+        }
+        return;
+    }
+
+    unsigned numPasses = loopOnFinish ? loopCount : 1;
+
+    FrameTimeHistogram frameTimes;
+    for (unsigned pass = 0; !numPasses || pass < numPasses; ++pass) {
+        long long frameStart = os::getTime();
+        bool frameCalls = false;
+        for (std::vector<trace::Call *>::const_iterator it = calls.begin();
+             it != calls.end(); ++it) {
+            trace::Call *call = *it;
+            setCallNo(call->no);
+            retracer.retrace(*call);
+            frameCalls = true;
+            if (call->flags & trace::CALL_FLAG_END_FRAME) {
+                long long frameEnd = os::getTime();
+                frameTimes.add(frameEnd - frameStart);
+                frameStart = frameEnd;
+                frameCalls = false;
+            }
+        }
+        if (frameCalls) {
+            frameTimes.add(os::getTime() - frameStart);
+        }
+
+        /* When looping forever, report as we go. */
+        if (!numPasses || pass + 1 == numPasses) {
+            std::cout <<
+                "Replayed " << calls.size() << " preloaded calls " << (pass + 1) << " times,"
+                " frame times: min " << frameTimes.percentile(0) << " ms,"
+                " median " << frameTimes.percentile(50) << " ms,"
+                " p99 " << frameTimes.percentile(99) << " ms\n";
+        }
+    }
+
+    for (std::vector<trace::Call *>::const_iterator it = calls.begin();
+         it != calls.end(); ++it) {
+        parser.release(*it);
+    }
+}
+
+
 static void
 mainLoop() {
     addCallbacks(retracer);
@@ -520,18 +1367,29 @@ mainLoop() {
     long long startTime = 0; 
     frameNo = 0;
 
+    stageTiming = driver == DRIVER_NULL;
+    parseTime = 0;
+    retraceTime = 0;
+    callCount = 0;
+
     startTime = os::getTime();
 
-    if (singleThread) {
+    if (preload) {
+        preloadLoop();
+    } else if (singleThread) {
         trace::Call *call;
-        while ((call = parser.parse_call())) {
+        while ((call = parseCall())) {
             retraceCall(call);
-            delete call;
+            parser.release(call);
         };
+    } else if (concurrent && !needsOrderedReplay()) {
+        ConcurrentRace race;
+        race.run();
     } else {
         RelayRace race;
         race.run();
     }
+    flushSnapshots();
     finishRendering();
 
     long long endTime = os::getTime();
@@ -544,6 +1402,19 @@ mainLoop() {
             " average of " << (frameNo/timeInterval) << " fps\n";
     }
 
+    if (stageTiming) {
+        double parseSecs = parseTime * (1.0 / os::timeFrequency);
+        double retraceSecs = retraceTime * (1.0 / os::timeFrequency);
+        std::cout <<
+            "Replayed " << callCount << " calls"
+            " (" << traceSize << " bytes) in " << timeInterval << " secs,"
+            " average of " << (callCount/timeInterval) << " calls/sec,"
+            " " << (traceSize/timeInterval) << " bytes/sec\n"
+            "  parse: " << parseSecs << " secs\n"
+            "  retrace: " << retraceSecs << " secs\n"
+            "  other: " << (timeInterval - parseSecs - retraceSecs) << " secs\n";
+    }
+
     if (waitOnFinish) {
         waitForInput();
     } else {
@@ -570,16 +1441,34 @@ usage(const char *argv0) {
         "      --core              use core profile\n"
         "      --db                use a double buffer visual (default)\n"
         "      --samples=N         use GL_ARB_multisample (default is 1)\n"
-        "      --driver=DRIVER     force driver type (`hw`, `sw`, `ref`, `null`, or driver module name)\n"
+        "      --driver=DRIVER     force driver type (`hw`, `sw`, `ref`, `null`, or driver module name);\n"
+        "                          `null` also reports the time spent on each replay stage\n"
         "      --sb                use a single buffer visual\n"
         "  -s, --snapshot-prefix=PREFIX    take snapshots; `-` for PNM stdout output\n"
-        "      --snapshot-format=FMT       use (PNM, RGB, or MD5; default is PNM) when writing to stdout output\n"
+        "      --snapshot-format=FMT       use (PNM, RGB, MD5, or TILES; default is PNM) when writing to stdout output\n"
         "  -S, --snapshot=CALLSET  calls to snapshot (default is every frame)\n"
+        "      --snapshot-latency=N        read snapshots back asynchronously, writing each one out\n"
+        "                                  N snapshots later (default is 0, i.e., synchronously)\n"
         "  -v, --verbose           increase output verbosity\n"
         "  -D, --dump-state=CALL   dump state at specific call no\n"
+        "      --dump-states=CALLSET  dump state at every call in CALLSET, each dump only\n"
+        "                          holding what changed since the previous ones\n"
         "  -w, --wait              waitOnFinish on final frame\n"
-        "      --loop              continuously loop, replaying final frame.\n"
-        "      --singlethread      use a single thread to replay command stream\n";
+        "      --loop[=N]          continuously loop, replaying final frame (N times, if specified).\n"
+        "      --preload=FRAMES    parse the given frames (`N` or `FIRST-LAST`) into memory once, and replay\n"
+        "                          them from there (as many times as --loop says), reporting frame times;\n"
+        "                          the frames must be from a single thread\n"
+        "      --threaded-parse    parse calls ahead on a separate thread\n"
+        "      --queue-size=CALLS  maximum number of calls parsed ahead with --threaded-parse\n"
+        "                          (default is " << DEFAULT_QUEUE_SIZE << "),\n"
+        "                          which never hold more than " << (QUEUE_MAX_BLOB_SIZE >> 20) << " MiB of blobs\n"
+        "      --program-cache=DIR cache linked program binaries in DIR, to skip linking\n"
+        "                          programs on later replays\n"
+        "      --precompile        compile and link all programs into the program cache on\n"
+        "                          several threads before replaying (requires --program-cache)\n"
+        "      --singlethread      use a single thread to replay command stream\n"
+        "      --concurrent        replay the calls of each thread concurrently between\n"
+        "                          synchronization points\n";
 }
 
 enum {
@@ -594,8 +1483,16 @@ enum {
     PMEM_OPT,
     SB_OPT,
     SNAPSHOT_FORMAT_OPT,
+    SNAPSHOT_LATENCY_OPT,
     LOOP_OPT,
-    SINGLETHREAD_OPT
+    PRELOAD_OPT,
+    THREADED_PARSE_OPT,
+    QUEUE_SIZE_OPT,
+    PROGRAM_CACHE_OPT,
+    PRECOMPILE_OPT,
+    SINGLETHREAD_OPT,
+    CONCURRENT_OPT,
+    DUMP_STATES_OPT
 };
 
 const static char *
@@ -610,6 +1507,7 @@ longOptions[] = {
     {"samples", required_argument, 0, SAMPLES_OPT},
     {"driver", required_argument, 0, DRIVER_OPT},
     {"dump-state", required_argument, 0, 'D'},
+    {"dump-states", required_argument, 0, DUMP_STATES_OPT},
     {"help", no_argument, 0, 'h'},
     {"pcpu", no_argument, 0, PCPU_OPT},
     {"pgpu", no_argument, 0, PGPU_OPT},
@@ -618,18 +1516,25 @@ longOptions[] = {
     {"sb", no_argument, 0, SB_OPT},
     {"snapshot-prefix", required_argument, 0, 's'},
     {"snapshot-format", required_argument, 0, SNAPSHOT_FORMAT_OPT},
+    {"snapshot-latency", required_argument, 0, SNAPSHOT_LATENCY_OPT},
     {"snapshot", required_argument, 0, 'S'},
     {"verbose", no_argument, 0, 'v'},
     {"wait", no_argument, 0, 'w'},
-    {"loop", no_argument, 0, LOOP_OPT},
+    {"loop", optional_argument, 0, LOOP_OPT},
+    {"preload", required_argument, 0, PRELOAD_OPT},
+    {"threaded-parse", no_argument, 0, THREADED_PARSE_OPT},
+    {"queue-size", required_argument, 0, QUEUE_SIZE_OPT},
+    {"program-cache", required_argument, 0, PROGRAM_CACHE_OPT},
+    {"precompile", no_argument, 0, PRECOMPILE_OPT},
     {"singlethread", no_argument, 0, SINGLETHREAD_OPT},
+    {"concurrent", no_argument, 0, CONCURRENT_OPT},
     {0, 0, 0, 0}
 };
 
 
 static void exceptionCallback(void)
 {
-    std::cerr << retrace::callNo << ": error: caught an unhandled exception\n";
+    std::cerr << retrace::getCallNo() << ": error: caught an unhandled exception\n";
 }
 
 
@@ -659,6 +1564,14 @@ int main(int argc, char **argv)
             dumpingState = true;
             retrace::verbosity = -2;
             break;
+        case DUMP_STATES_OPT:
+            dumpStateCalls.merge(optarg);
+            if (!dumpStateDelta) {
+                dumpStateDelta = new JSONDelta;
+            }
+            dumpingState = true;
+            retrace::verbosity = -2;
+            break;
         case CORE_OPT:
             retrace::setFeatureLevel("3_2_core");
             break;
@@ -685,9 +1598,25 @@ int main(int argc, char **argv)
         case SB_OPT:
             retrace::doubleBuffer = false;
             break;
+        case THREADED_PARSE_OPT:
+            threadedParse = true;
+            break;
+        case QUEUE_SIZE_OPT:
+            retrace::parser.setQueueSize(atoi(optarg));
+            break;
+        case PROGRAM_CACHE_OPT:
+            retrace::programCacheDir = optarg;
+            os::createDirectory(optarg);
+            break;
+        case PRECOMPILE_OPT:
+            retrace::precompiling = true;
+            break;
         case SINGLETHREAD_OPT:
             retrace::singleThread = true;
             break;
+        case CONCURRENT_OPT:
+            retrace::concurrent = true;
+            break;
         case 's':
             snapshotPrefix = optarg;
             if (snapshotFrequency.empty()) {
@@ -720,9 +1649,14 @@ int main(int argc, char **argv)
                 snapshotFormat = RAW_RGB;
             else if (strcmp(optarg, "MD5") == 0)
                 snapshotFormat = RAW_MD5;
+            else if (strcmp(optarg, "TILES") == 0)
+                snapshotFormat = TILE_HASHES;
             else
                 snapshotFormat = PNM_FMT;
             break;
+        case SNAPSHOT_LATENCY_OPT:
+            snapshotLatency = atoi(optarg);
+            break;
         case 'S':
             snapshotFrequency.merge(optarg);
             if (snapshotPrefix == NULL) {
@@ -737,6 +1671,22 @@ int main(int argc, char **argv)
             break;
         case LOOP_OPT:
             loopOnFinish = true;
+            if (optarg) {
+                loopCount = atoi(optarg);
+            }
+            break;
+        case PRELOAD_OPT:
+            preload = true;
+            switch (sscanf(optarg, "%u-%u", &preloadFirstFrame, &preloadLastFrame)) {
+            case 1:
+                preloadLastFrame = preloadFirstFrame;
+                break;
+            case 2:
+                break;
+            default:
+                std::cerr << "error: invalid frame range `" << optarg << "`\n";
+                return 1;
+            }
             break;
         case PGPU_OPT:
             retrace::debug = false;
@@ -779,6 +1729,15 @@ int main(int argc, char **argv)
     }
 #endif
 
+    if (!threadedParse) {
+        retrace::parser.setQueueSize(0);
+    }
+
+    if (retrace::precompiling && !retrace::programCacheDir) {
+        std::cerr << "error: --precompile requires --program-cache\n";
+        return 1;
+    }
+
     retrace::setUp();
     if (retrace::profiling) {
         retrace::profiler.setup(retrace::profilingCpuTimes, retrace::profilingGpuTimes, retrace::profilingPixelsDrawn, retrace::profilingMemoryUsage);
@@ -787,10 +1746,20 @@ int main(int argc, char **argv)
     os::setExceptionCallback(exceptionCallback);
 
     for (i = optind; i < argc; ++i) {
+        if (retrace::precompiling) {
+            retrace::precompile(argv[i]);
+        }
+
         if (!retrace::parser.open(argv[i])) {
             return 1;
         }
 
+        if (retrace::driver == retrace::DRIVER_NULL) {
+            std::ifstream stream(argv[i], std::ifstream::binary);
+            stream.seekg(0, std::ifstream::end);
+            traceSize = stream.tellg();
+        }
+
         retrace::mainLoop();
 
         retrace::parser.close();
@@ -798,6 +1767,9 @@ int main(int argc, char **argv)
     
     os::resetExceptionCallback();
 
+    delete retrace::dumpStateDelta;
+    retrace::dumpStateDelta = NULL;
+
     // XXX: X often hangs on XCloseDisplay
     //retrace::cleanUp();
 
@@ -35,6 +35,10 @@
 namespace retrace {
 
 
+bool lockMaps = false;
+os::mutex mapMutex;
+
+
 struct Region
 {
     void *buffer;
@@ -29,12 +29,43 @@
 
 #include <map>
 
+#include "os_thread.hpp"
 #include "trace_model.hpp"
 
 
 namespace retrace {
 
 
+/**
+ * Whether handle maps are looked up from several threads at once, as when
+ * replaying concurrently.
+ */
+extern bool lockMaps;
+extern os::mutex mapMutex;
+
+
+class MapLock
+{
+private:
+    bool locked;
+
+public:
+    MapLock() :
+        locked(lockMaps)
+    {
+        if (locked) {
+            mapMutex.lock();
+        }
+    }
+
+    ~MapLock() {
+        if (locked) {
+            mapMutex.unlock();
+        }
+    }
+};
+
+
 /**
  * Handle map.
  *
@@ -57,7 +88,12 @@ private:
 
 public:
 
-    T & operator[] (const T &key) {
+    /*
+     * Lookups return copies, as other threads may modify the map as soon as
+     * the lock is released.
+     */
+    T operator[] (const T &key) {
+        MapLock lock;
         typename base_type::iterator it;
         it = base.find(key);
         if (it == base.end()) {
@@ -65,14 +101,10 @@ public:
         }
         return it->second;
     }
-    
-    const T & operator[] (const T &key) const {
-        typename base_type::const_iterator it;
-        it = base.find(key);
-        if (it == base.end()) {
-            return (base[key] = key);
-        }
-        return it->second;
+
+    void set(const T &key, const T &value) {
+        MapLock lock;
+        base[key] = value;
     }
 
     /*
@@ -85,6 +117,7 @@ public:
      * "myMatrix[0]"), etc.
      */
     T lookupUniformLocation(const T &key) {
+        MapLock lock;
         typename base_type::const_iterator it;
         it = base.upper_bound(key);
         if (it != base.begin()) {
@@ -98,6 +131,30 @@ public:
 };
 
 
+/**
+ * Handle maps for handles that are only unique within another object (e.g.,
+ * uniform locations within a program).
+ */
+template <class K, class T>
+class keyed_map
+{
+private:
+    typedef std::map<K, map<T> > base_type;
+    base_type base;
+
+public:
+
+    /*
+     * The inner maps are never erased, and lock themselves, so they may be
+     * referred to after the lock is released.
+     */
+    map<T> & operator[] (const K &key) {
+        MapLock lock;
+        return base[key];
+    }
+};
+
+
 void
 addRegion(unsigned long long address, void *buffer, unsigned long long size);
 
@@ -296,6 +296,86 @@ def load(stream, strip_images = True, strip_comments = True):
         return json.load(stream, strict=False, object_hook = object_hook)
 
 
+_whitespace_re = re.compile(r'\s*')
+
+
+def load_documents(stream, strip_comments = True):
+    '''Load all the JSON documents concatenated in the stream, as written by
+    glretrace --dump-states.'''
+
+    data = stream.read()
+    if strip_comments:
+        data = _strip_comments(data)
+    decoder = json.JSONDecoder(strict=False)
+    documents = []
+    pos = _whitespace_re.match(data).end()
+    while pos < len(data):
+        document, pos = decoder.raw_decode(data, pos)
+        documents.append(document)
+        pos = _whitespace_re.match(data, pos).end()
+    return documents
+
+
+def _resolve_references(node, documents, path):
+    for name, value in list(node.items()):
+        if not isinstance(value, dict):
+            continue
+        if list(value.keys()) == ['__ref__']:
+            target = documents[value['__ref__']]
+            for member in path + [name]:
+                target = target[member]
+            node[name] = target
+        else:
+            _resolve_references(value, documents, path + [name])
+
+
+def resolve_references(documents):
+    '''Replace the {"__ref__": CALL} placeholders of delta encoded state
+    dumps by the values they stand for, in the dump of call CALL.'''
+
+    calls = {}
+    for document in documents:
+        _resolve_references(document, calls, [])
+        if '__call__' in document:
+            calls[document['__call__']] = document
+
+
+def _strip(node, strip_images):
+    if isinstance(node, dict):
+        obj = {}
+        for name, value in node.items():
+            obj[name] = _strip(value, strip_images)
+        if strip_images:
+            return strip_object_hook(obj)
+        obj.pop('__call__', None)
+        return obj
+    if isinstance(node, list):
+        return [_strip(value, strip_images) for value in node]
+    return node
+
+
+def load_state(filename, call, strip_images):
+    '''Load the state dumped at the given call, or the last one, from a file
+    holding one or more state dumps.'''
+
+    documents = load_documents(open(filename, 'rt'))
+    if not documents:
+        sys.stderr.write('error: %s holds no state\n' % filename)
+        sys.exit(1)
+    resolve_references(documents)
+
+    if call is None:
+        document = documents[-1]
+    else:
+        for document in documents:
+            if document.get('__call__') == call:
+                break
+        else:
+            sys.stderr.write('error: %s holds no state for call %u\n' % (filename, call))
+            sys.exit(1)
+    return _strip(document, strip_images)
+
+
 def main():
     optparser = optparse.OptionParser(
         usage="\n\t%prog [options] <ref_json> <src_json>")
@@ -303,14 +383,22 @@ def main():
         '--keep-images',
         action="store_false", dest="strip_images", default=True,
         help="compare images")
+    optparser.add_option(
+        '--ref-call', metavar='CALL',
+        type="int", dest="ref_call", default=None,
+        help="compare the reference state dumped at CALL [default: last]")
+    optparser.add_option(
+        '--src-call', metavar='CALL',
+        type="int", dest="src_call", default=None,
+        help="compare the source state dumped at CALL [default: last]")
 
     (options, args) = optparser.parse_args(sys.argv[1:])
 
     if len(args) != 2:
         optparser.error('incorrect number of arguments')
 
-    a = load(open(sys.argv[1], 'rt'), options.strip_images)
-    b = load(open(sys.argv[2], 'rt'), options.strip_images)
+    a = load_state(args[0], options.ref_call, options.strip_images)
+    b = load_state(args[1], options.src_call, options.strip_images)
 
     if False:
         dumper = Dumper()
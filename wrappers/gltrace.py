@@ -697,6 +697,79 @@ class GlTracer(Tracer):
 
         Tracer.traceFunctionImplBody(self, function)
 
+        # Let applications ask the flight recorder to write out the trace
+        if function.name in self.string_marker_functions:
+            self.checkMarker(function, 'apitrace-dump', 'trace::localWriter.dump();')
+
+    def checkMarker(self, function, marker, statement):
+        length, string = function.args
+        print '    if (%s) {' % string.name
+        print '        size_t _length = %s > 0 ? %s : strlen((const char *)%s);' % (length.name, length.name, string.name)
+        print '        if (_length == sizeof "%s" - 1 &&' % marker
+        print '            memcmp(%s, "%s", _length) == 0) {' % (string.name, marker)
+        print '            %s' % statement
+        print '        }'
+        print '    }'
+
+    frameTerminatorFunctionNames = [
+        'glXSwapBuffers',
+        'eglSwapBuffers',
+        'wglSwapBuffers',
+        'wglSwapLayerBuffers',
+        'wglSwapMultipleBuffers',
+        'CGLFlushDrawable',
+        'glFrameTerminatorGREMEDY',
+    ]
+
+    def isFunctionTransient(self, function):
+        # Calls that only draw, query, or synchronize are skipped until a
+        # mid-stream capture starts, so that what gets traced before it is
+        # the state that the captured frames will start from.  State setters,
+        # however cheap (e.g. uniforms), must always be traced, as must
+        # the reads which may write into a pixel pack or query buffer.
+        name = function.name
+        if name in self.frameTerminatorFunctionNames or name in self.marker_functions:
+            return True
+        if name.startswith(('glDraw', 'glMultiDraw', 'glDispatchCompute', 'glClearBuffer')):
+            return True
+        if name in ('glClear', 'glBegin', 'glEnd', 'glFlush', 'glFinish', 'glBlitFramebuffer'):
+            return True
+        if name.startswith(('glVertex2', 'glVertex3', 'glVertex4')):
+            return True
+        if name in self.buffer_read_functions or name.startswith(('glGetQueryObject', 'glGetQueryBufferObject')):
+            return False
+        # Locations and indices are needed to replay later calls
+        if name.startswith('glGet') and not ('Location' in name or 'Index' in name or 'Indices' in name):
+            return True
+        return False
+
+    # Reads which write into a bound pixel pack buffer
+    buffer_read_functions = [
+        'glGetTexImage',
+        'glGetnTexImage',
+        'glGetnTexImageARB',
+        'glGetCompressedTexImage',
+        'glGetCompressedTexImageARB',
+        'glGetnCompressedTexImage',
+        'glGetnCompressedTexImageARB',
+        'glGetTextureImage',
+        'glGetTextureImageEXT',
+        'glGetCompressedTextureImage',
+        'glGetCompressedTextureImageEXT',
+    ]
+
+    def skipFunctionImplBody(self, function):
+        if function.name in self.frameTerminatorFunctionNames:
+            print '    trace::localWriter.skipFrame();'
+        if function.name in self.string_marker_functions:
+            self.checkMarker(function, 'apitrace-start', 'trace::localWriter.startCapture();')
+
+    # Markers whose text applications can use to control the tracer
+    string_marker_functions = [
+        'glStringMarkerGREMEDY',
+        'glInsertEventMarkerEXT',
+    ]
+
     # These entrypoints are only expected to be implemented by tools;
     # drivers will probably not implement them.
     marker_functions = [
@@ -547,12 +547,35 @@ class Tracer:
             print '        return;'
         print '    }'
 
+        # Pass through until a mid-stream capture starts
+        if self.isFunctionTransient(function):
+            print '    if (!trace::localWriter.isCapturing()) {'
+            self.doInvokeFunction(function)
+            self.skipFunctionImplBody(function)
+            if function.type is not stdapi.Void:
+                print '        return _result;'
+            else:
+                print '        return;'
+            print '    }'
+
         self.traceFunctionImplBody(function)
         if function.type is not stdapi.Void:
             print '    return _result;'
         print '}'
         print
 
+    def isFunctionTransient(self, function):
+        '''Whether calls to this function leave no state behind that later
+        calls depend on, so that they needn't be traced until a mid-stream
+        capture starts.'''
+
+        return False
+
+    def skipFunctionImplBody(self, function):
+        '''Emit the code to run when a transient call is not traced.'''
+
+        pass
+
     def traceFunctionImplBody(self, function):
         if not function.internal:
             print '    unsigned _call = trace::localWriter.beginEnter(&_%s_sig);' % (function.name,)